@@ -0,0 +1,101 @@
+/* Bulk reliable transfer over loopback, measuring the CPU spent retiring acknowledgements.
+
+   usage: devils-bench-ack [megabytes] [loss percent]
+
+   Queues the whole transfer up front as 1 MB reliable packets, so the sender keeps a full
+   window of reliable commands in flight for the length of the run. Every acknowledgement
+   retires one of them; with loss, retransmissions also keep the sent queue long. The loss
+   is applied to datagrams arriving at the receiver. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../devils/include/devils.h"
+
+static unsigned int loss_percent = 0;
+static unsigned int loss_seed = 1;
+
+static int DEVILS_CALLBACK drop_datagram(devils_host *host, devils_event *event)
+{
+    (void)host;
+    (void)event;
+
+    loss_seed = loss_seed * 1103515245u + 12345u;
+
+    return ((loss_seed >> 8) % 100) < loss_percent;
+}
+
+int main(int argc, char **argv)
+{
+    int megabytes = argc > 1 ? atoi(argv[1]) : 64;
+    int received = 0, i;
+    devils_address address;
+    devils_host *server, *client;
+    devils_peer *peer;
+    devils_event event;
+    devils_uint32 start, elapsed, peakInTransit = 0;
+    clock_t cpuStart;
+
+    if (argc > 2)
+        loss_percent = (unsigned int)atoi(argv[2]);
+
+    if (devils_initialize() != 0)
+    {
+        fprintf(stderr, "An error occurred while initializing ENet.\n");
+        return 1;
+    }
+
+    devils_address_set_host_ip(&address, "127.0.0.1");
+    address.port = 0;
+    server = devils_host_create(&address, 1, 1, 0, 0);
+    client = devils_host_create(NULL, 1, 1, 0, 0);
+    if (server == NULL || client == NULL || devils_socket_get_address(server->socket, &address) < 0)
+    {
+        fprintf(stderr, "An error occurred while creating the hosts.\n");
+        return 1;
+    }
+
+    peer = devils_host_connect(client, &address, 1, 0);
+    while (peer->state != DEVILS_PEER_STATE_CONNECTED)
+    {
+        devils_host_service(client, &event, 1);
+        devils_host_service(server, &event, 1);
+    }
+
+    if (loss_percent > 0)
+        server->intercept = drop_datagram;
+
+    for (i = 0; i < megabytes; ++i)
+        devils_peer_send(peer, 0, devils_packet_create(NULL, 1 << 20, DEVILS_PACKET_FLAG_RELIABLE));
+
+    start = devils_time_get();
+    cpuStart = clock();
+
+    while (received < megabytes && devils_time_get() - start < 120000)
+    {
+        devils_host_service(client, &event, 0);
+
+        if (peer->reliableDataInTransit > peakInTransit)
+            peakInTransit = peer->reliableDataInTransit;
+
+        while (devils_host_service(server, &event, 0) > 0)
+        {
+            if (event.type != DEVILS_EVENT_TYPE_RECEIVE)
+                continue;
+
+            devils_packet_destroy(event.packet);
+            ++received;
+        }
+    }
+
+    elapsed = devils_time_get() - start;
+
+    printf("%d/%d MB at %u%% loss in %u ms wall, %.0f ms cpu, at most %u KB in flight\n",
+           received, megabytes, loss_percent, elapsed,
+           (double)(clock() - cpuStart) * 1000 / CLOCKS_PER_SEC, peakInTransit / 1024);
+
+    devils_host_destroy(client);
+    devils_host_destroy(server);
+    devils_deinitialize();
+
+    return received < megabytes;
+}
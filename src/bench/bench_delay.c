@@ -0,0 +1,210 @@
+/* Bulk reliable transfer across an emulated long fat link.
+
+   usage: devils-bench-delay [one-way delay ms] [link Mbit/s] [megabytes] [bbr]
+
+   The client connects to a relay socket in this process rather than to the server. The relay
+   delays every datagram by the one-way delay. Towards the server it also serializes datagrams
+   at the link rate behind a drop-tail queue of four bandwidth-delay products. The transfer is
+   queued as 1 MB reliable packets once the connection is up, and the time until the server
+   has received all of it is reported along with the window the peers negotiated. Passing
+   "bbr" as the fourth argument selects BBR congestion control on the sender. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../devils/include/devils.h"
+
+#define RELAY_QUEUE_SIZE 16384
+
+typedef struct _relay_datagram
+{
+    double dueTime;
+    size_t dataLength;
+    devils_uint8 data[DEVILS_HOST_DEFAULT_MTU];
+} relay_datagram;
+
+typedef struct _relay_queue
+{
+    relay_datagram *datagrams;
+    size_t head, tail;
+    size_t queuedData;
+} relay_queue;
+
+static relay_datagram *
+relay_queue_push(relay_queue *queue)
+{
+    relay_datagram *datagram;
+
+    if ((queue->tail + 1) % RELAY_QUEUE_SIZE == queue->head)
+        return NULL;
+
+    datagram = &queue->datagrams[queue->tail];
+    queue->tail = (queue->tail + 1) % RELAY_QUEUE_SIZE;
+
+    return datagram;
+}
+
+/* forwards every datagram of the queue that is due, in order; due times only increase */
+static void
+relay_queue_deliver(relay_queue *queue, devils_socket socket, const devils_address *address, double now)
+{
+    while (queue->head != queue->tail && queue->datagrams[queue->head].dueTime <= now)
+    {
+        relay_datagram *datagram = &queue->datagrams[queue->head];
+        devils_buffer buffer;
+
+        buffer.data = datagram->data;
+        buffer.dataLength = datagram->dataLength;
+        devils_socket_send(socket, address, &buffer, 1);
+
+        queue->queuedData -= datagram->dataLength;
+        queue->head = (queue->head + 1) % RELAY_QUEUE_SIZE;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    double oneWayDelay = argc > 1 ? atof(argv[1]) : 75,
+           linkRate = (argc > 2 ? atof(argv[2]) : 100) * 1000000 / 8 / 1000, /* bytes per millisecond */
+           linkFree = 0, now;
+    int megabytes = argc > 3 ? atoi(argv[3]) : 32, useBBR = argc > 4 && strcmp(argv[4], "bbr") == 0, i;
+    size_t queueLimit = (size_t)(4 * linkRate * 2 * oneWayDelay), received = 0;
+    relay_queue toServer, toClient;
+    devils_address relayAddress, serverAddress, clientAddress, from;
+    devils_socket relay;
+    devils_host *server, *client;
+    devils_peer *peer;
+    devils_event event;
+    devils_uint32 start = 0, elapsed;
+    devils_uint8 receiveData[DEVILS_PROTOCOL_MAXIMUM_MTU];
+    devils_buffer receiveBuffer;
+    int connected = 0, haveClient = 0, receiveLength;
+
+    if (devils_initialize() != 0)
+    {
+        fprintf(stderr, "An error occurred while initializing ENet.\n");
+        return 1;
+    }
+
+    memset(&toServer, 0, sizeof(toServer));
+    memset(&toClient, 0, sizeof(toClient));
+    toServer.datagrams = (relay_datagram *)malloc(RELAY_QUEUE_SIZE * sizeof(relay_datagram));
+    toClient.datagrams = (relay_datagram *)malloc(RELAY_QUEUE_SIZE * sizeof(relay_datagram));
+
+    devils_address_set_host_ip(&serverAddress, "127.0.0.1");
+    serverAddress.port = 0;
+    relayAddress = serverAddress;
+
+    relay = devils_socket_create(DEVILS_SOCKET_TYPE_DATAGRAM);
+    server = devils_host_create(&serverAddress, 1, 1, 0, 0);
+    client = devils_host_create(NULL, 1, 1, 0, 0);
+    if (toServer.datagrams == NULL || toClient.datagrams == NULL ||
+        relay == DEVILS_SOCKET_NULL || devils_socket_bind(relay, &relayAddress) < 0 ||
+        devils_socket_get_address(relay, &relayAddress) < 0 ||
+        server == NULL || client == NULL || devils_socket_get_address(server->socket, &serverAddress) < 0)
+    {
+        fprintf(stderr, "An error occurred while creating the relay and the hosts.\n");
+        return 1;
+    }
+
+    devils_socket_set_option(relay, DEVILS_SOCKOPT_NONBLOCK, 1);
+    devils_socket_set_option(relay, DEVILS_SOCKOPT_RCVBUF, 16 << 20);
+    devils_socket_set_option(relay, DEVILS_SOCKOPT_SNDBUF, 16 << 20);
+
+    if (useBBR)
+        devils_host_congestion_control_with_bbr(client);
+
+    peer = devils_host_connect(client, &relayAddress, 1, 0);
+
+    for (;;)
+    {
+        now = (double)devils_time_get();
+
+        for (;;)
+        {
+            relay_datagram *datagram;
+
+            receiveBuffer.data = receiveData;
+            receiveBuffer.dataLength = sizeof(receiveData);
+            receiveLength = devils_socket_receive(relay, &from, &receiveBuffer, 1);
+            if (receiveLength <= 0)
+                break;
+
+            if (receiveLength > DEVILS_HOST_DEFAULT_MTU)
+                continue;
+
+            if (from.host == serverAddress.host && from.port == serverAddress.port)
+            {
+                datagram = relay_queue_push(&toClient);
+                if (datagram == NULL)
+                    continue;
+
+                datagram->dueTime = now + oneWayDelay;
+                toClient.queuedData += receiveLength;
+            }
+            else
+            {
+                clientAddress = from;
+                haveClient = 1;
+
+                if (toServer.queuedData + receiveLength > queueLimit)
+                    continue;
+
+                datagram = relay_queue_push(&toServer);
+                if (datagram == NULL)
+                    continue;
+
+                linkFree = (linkFree > now ? linkFree : now) + receiveLength / linkRate;
+                datagram->dueTime = linkFree + oneWayDelay;
+                toServer.queuedData += receiveLength;
+            }
+
+            datagram->dataLength = (size_t)receiveLength;
+            memcpy(datagram->data, receiveData, receiveLength);
+        }
+
+        relay_queue_deliver(&toServer, relay, &serverAddress, now);
+        if (haveClient)
+            relay_queue_deliver(&toClient, relay, &clientAddress, now);
+
+        while (devils_host_service(server, &event, 0) > 0)
+        {
+            if (event.type != DEVILS_EVENT_TYPE_RECEIVE)
+                continue;
+
+            received += event.packet->dataLength;
+            devils_packet_destroy(event.packet);
+        }
+
+        while (devils_host_service(client, &event, 0) > 0)
+        {
+            if (event.type != DEVILS_EVENT_TYPE_CONNECT || connected)
+                continue;
+
+            connected = 1;
+            start = devils_time_get();
+
+            for (i = 0; i < megabytes; ++i)
+                devils_peer_send(peer, 0, devils_packet_create(NULL, 1 << 20, DEVILS_PACKET_FLAG_RELIABLE));
+        }
+
+        if (connected && (received >= (size_t)megabytes << 20 || devils_time_get() - start > 120000))
+            break;
+    }
+
+    elapsed = devils_time_get() - start;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    printf("%u/%d MB in %u ms = %.2f MB/s over a %.0f Mbit/s link with %.0f ms round trip, window %u KB%s\n",
+           (unsigned int)(received >> 20), megabytes, elapsed, (double)received / (1 << 20) * 1000 / elapsed,
+           linkRate * 8 * 1000 / 1000000, 2 * oneWayDelay, peer->windowSize / 1024, useBBR ? ", BBR" : "");
+
+    devils_host_destroy(client);
+    devils_host_destroy(server);
+    devils_socket_destroy(relay);
+    free(toServer.datagrams);
+    free(toClient.datagrams);
+    devils_deinitialize();
+
+    return received < (size_t)megabytes << 20;
+}
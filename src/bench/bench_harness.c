@@ -0,0 +1,596 @@
+/* Regression harness for the protocol extensions, run over loopback with emulated loss.
+
+   usage: devils-bench-harness [loss|negotiate|extended|migrate]
+
+   Without an argument every part runs in turn:
+     loss       reliable, unreliable and unsequenced packets on four channels, some of them
+                fragmented, at 0, 5 and 15% loss. Reliable packets must all arrive intact and in
+                order, unreliable ones in order.
+     negotiate  CONNECT and VERIFY_CONNECT lose their extension flags on the way to the server, as
+                if the client did not have the extensions. Neither side may then use any of them,
+                and the connection must still carry traffic at 5% loss.
+     extended   with every compact peer ID taken, a client is given a peer ID from
+                DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID on and carries traffic, while a client that
+                does not announce extended peer IDs is not admitted.
+     migrate    at 5% loss, a client datagram replayed from another address must not move the peer,
+                while the client's own move to a new socket is followed in both directions.
+   Prints one line per check and returns non-zero if any failed. */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../devils/include/devils.h"
+
+#define HARNESS_CHANNELS 4
+#define HARNESS_PACKETS 300
+#define HARNESS_EXTENSION_FLAGS \
+    (DEVILS_PEER_FLAG_SERIAL_UNRELIABLE | DEVILS_PEER_FLAG_WINDOW_SCALE | DEVILS_PEER_FLAG_SKIP | DEVILS_PEER_FLAG_REPAIR)
+
+typedef struct _harness_counts
+{
+    unsigned int nextReliable[HARNESS_CHANNELS];
+    unsigned int lastUnreliable[HARNESS_CHANNELS];
+    int reliable, unreliable, unsequenced, clientReceived, errors;
+    int connected, disconnected; /* bit 0: client, bit 1: server, bit 2: disconnect requested */
+    devils_peer *remote;         /* the client's peer on the server */
+} harness_counts;
+
+static harness_counts counts;
+
+static unsigned int loss_percent = 0;
+static unsigned int random_seed = 1;
+static devils_host *strip_host = NULL; /* host whose incoming datagrams lose the extension flags */
+static devils_uint16 blocked_port = 0; /* port whose datagrams are dropped, or 0 */
+static int capturing = 0;
+static devils_uint8 captured[DEVILS_PROTOCOL_MAXIMUM_MTU], capture_data[64];
+static size_t captured_length = 0, capture_length = 0;
+
+static unsigned int
+random_next(void)
+{
+    random_seed = random_seed * 1103515245u + 12345u;
+
+    return random_seed >> 8;
+}
+
+/* clears what a host without the extensions would not send: the extended peer ID flag of a
+   header without a peer ID and the extension flags of CONNECT and VERIFY_CONNECT */
+static void
+strip_extensions(devils_host *host)
+{
+    devils_uint8 *data = host->receivedData, *end = host->receivedData + host->receivedDataLength;
+    devils_uint16 header;
+    size_t headerSize, peerID;
+
+    if (host->receivedDataLength < sizeof(devils_protocol_header))
+        return;
+
+    memcpy(&header, data, sizeof(header));
+    header = DEVILS_NET_TO_HOST_16(header);
+    if (header & DEVILS_PROTOCOL_HEADER_FLAG_COMPRESSED)
+        return;
+
+    headerSize = header & DEVILS_PROTOCOL_HEADER_FLAG_SENT_TIME ? sizeof(devils_protocol_header) : sizeof(devils_uint16);
+    peerID = header & ~(DEVILS_PROTOCOL_HEADER_FLAG_MASK | DEVILS_PROTOCOL_HEADER_SESSION_MASK);
+    if (peerID == DEVILS_PROTOCOL_EXTENDED_PEER_ID)
+        headerSize += sizeof(devils_uint32);
+    else if (peerID == DEVILS_PROTOCOL_MAXIMUM_PEER_ID)
+    {
+        header = DEVILS_HOST_TO_NET_16(header & ~DEVILS_PROTOCOL_HEADER_FLAG_EXTENDED_PEER_ID);
+        memcpy(data, &header, sizeof(header));
+    }
+    if (host->checksum != NULL)
+        headerSize += sizeof(devils_uint32);
+
+    /* the handshake commands come first and carry no data, so the walk stops at the first that does */
+    for (data += headerSize; data + sizeof(devils_protocol_command_header) <= end; data += devils_protocol_command_size(*data))
+    {
+        switch (*data & DEVILS_PROTOCOL_COMMAND_MASK)
+        {
+        case DEVILS_PROTOCOL_COMMAND_CONNECT:
+        case DEVILS_PROTOCOL_COMMAND_VERIFY_CONNECT:
+            *data &= ~(DEVILS_PROTOCOL_COMMAND_FLAG_SKIP | DEVILS_PROTOCOL_COMMAND_FLAG_SERIAL_UNRELIABLE | DEVILS_PROTOCOL_COMMAND_FLAG_WINDOW_SCALE);
+            break;
+
+        case DEVILS_PROTOCOL_COMMAND_ACKNOWLEDGE:
+        case DEVILS_PROTOCOL_COMMAND_PING:
+        case DEVILS_PROTOCOL_COMMAND_BANDWIDTH_LIMIT:
+        case DEVILS_PROTOCOL_COMMAND_THROTTLE_CONFIGURE:
+            break;
+
+        default:
+            return;
+        }
+    }
+}
+
+static int DEVILS_CALLBACK
+intercept(devils_host *host, devils_event *event)
+{
+    (void)event;
+
+    if (blocked_port != 0 && host->receivedAddress.port == blocked_port)
+        return 1;
+
+    /* takes the first datagram ending in the capture packet off the wire, and every later one from its sender */
+    if (capturing && host->receivedDataLength >= capture_length && host->receivedDataLength <= sizeof(captured) &&
+        memcmp(host->receivedData + host->receivedDataLength - capture_length, capture_data, capture_length) == 0)
+    {
+        memcpy(captured, host->receivedData, host->receivedDataLength);
+        captured_length = host->receivedDataLength;
+        capturing = 0;
+        blocked_port = host->receivedAddress.port;
+        return 1;
+    }
+
+    if (loss_percent > 0 && random_next() % 100 < loss_percent)
+        return 1;
+
+    if (host == strip_host)
+        strip_extensions(host);
+
+    return 0;
+}
+
+static size_t
+reliable_length(int channelID, unsigned int index)
+{
+    /* every 37th packet is fragmented */
+    if (index % 37 == 5)
+        return 20000 + (index * 131) % 70000;
+
+    return 8 + (index * 7 + channelID) % 900;
+}
+
+static devils_packet *
+create_packet(size_t length, devils_uint32 flags, int kind, int channelID, unsigned int index)
+{
+    devils_packet *packet = devils_packet_create(NULL, length, flags);
+    size_t i;
+
+    packet->data[0] = (devils_uint8)kind;
+    packet->data[1] = (devils_uint8)channelID;
+    memcpy(packet->data + 2, &index, sizeof(index));
+    for (i = 6; i < length; ++i)
+        packet->data[i] = (devils_uint8)(i * 31 + index + channelID);
+
+    return packet;
+}
+
+static void
+check_packet(const devils_packet *packet, int channelID)
+{
+    unsigned int index;
+    size_t i;
+
+    if (packet->dataLength < 6 || packet->data[1] != channelID)
+    {
+        printf("  packet of %u bytes on the wrong channel %d\n", (unsigned int)packet->dataLength, channelID);
+        ++counts.errors;
+        return;
+    }
+
+    memcpy(&index, packet->data + 2, sizeof(index));
+    for (i = 6; i < packet->dataLength; ++i)
+    {
+        if (packet->data[i] != (devils_uint8)(i * 31 + index + channelID))
+        {
+            printf("  packet %c%u on channel %d corrupt at byte %u\n", packet->data[0], index, channelID, (unsigned int)i);
+            ++counts.errors;
+            return;
+        }
+    }
+
+    switch (packet->data[0])
+    {
+    case 'R':
+        if (index != counts.nextReliable[channelID] || packet->dataLength != reliable_length(channelID, index))
+        {
+            printf("  reliable packet %u on channel %d, expected %u\n", index, channelID, counts.nextReliable[channelID]);
+            ++counts.errors;
+        }
+        counts.nextReliable[channelID] = index + 1;
+        ++counts.reliable;
+        break;
+
+    case 'U':
+        if (index <= counts.lastUnreliable[channelID])
+        {
+            printf("  unreliable packet %u on channel %d after %u\n", index, channelID, counts.lastUnreliable[channelID]);
+            ++counts.errors;
+        }
+        counts.lastUnreliable[channelID] = index;
+        ++counts.unreliable;
+        break;
+
+    default:
+        ++counts.unsequenced;
+        break;
+    }
+}
+
+/* services the client, then the server, waiting up to a millisecond on the server */
+static void
+service_hosts(devils_host *server, devils_host *client)
+{
+    devils_event event;
+
+    while (devils_host_service(client, &event, 0) > 0)
+    {
+        switch (event.type)
+        {
+        case DEVILS_EVENT_TYPE_CONNECT:
+            counts.connected = 1;
+            break;
+
+        case DEVILS_EVENT_TYPE_DISCONNECT:
+            counts.disconnected |= 1;
+            break;
+
+        case DEVILS_EVENT_TYPE_RECEIVE:
+            ++counts.clientReceived;
+            devils_packet_destroy(event.packet);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    while (devils_host_service(server, &event, 1) > 0)
+    {
+        switch (event.type)
+        {
+        case DEVILS_EVENT_TYPE_CONNECT:
+            counts.remote = event.peer;
+            break;
+
+        case DEVILS_EVENT_TYPE_DISCONNECT:
+            counts.disconnected |= 2;
+            break;
+
+        case DEVILS_EVENT_TYPE_RECEIVE:
+            check_packet(event.packet, event.channelID);
+            devils_packet_destroy(event.packet);
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+static void
+service_for(devils_host *server, devils_host *client, devils_uint32 duration)
+{
+    devils_uint32 start = devils_time_get();
+
+    while (devils_time_get() - start < duration)
+        service_hosts(server, client);
+}
+
+static void
+create_hosts(devils_host **server, devils_host **client, size_t peerCount, devils_address *address)
+{
+    devils_address_set_host_ip(address, "127.0.0.1");
+    address->port = 0;
+
+    *server = devils_host_create(address, peerCount, HARNESS_CHANNELS, 0, 0);
+    *client = devils_host_create(NULL, 1, HARNESS_CHANNELS, 0, 0);
+    if (*server == NULL || *client == NULL || devils_socket_get_address((*server)->socket, address) < 0)
+    {
+        fprintf(stderr, "An error occurred while creating the hosts.\n");
+        exit(1);
+    }
+
+    (*server)->intercept = intercept;
+    (*client)->intercept = intercept;
+
+    memset(&counts, 0, sizeof(counts));
+}
+
+/* returns the client's peer once both sides saw the connection, or NULL if they did not in time */
+static devils_peer *
+connect_peer(devils_host *server, devils_host *client, const devils_address *address)
+{
+    devils_peer *peer = devils_host_connect(client, address, HARNESS_CHANNELS, 0);
+    devils_uint32 start = devils_time_get();
+
+    while (!(counts.connected && counts.remote != NULL) && devils_time_get() - start < 10000)
+        service_hosts(server, client);
+
+    return counts.connected && counts.remote != NULL ? peer : NULL;
+}
+
+static void
+destroy_hosts(devils_host *server, devils_host *client)
+{
+    devils_host_destroy(client);
+    devils_host_destroy(server);
+
+    strip_host = NULL;
+    blocked_port = 0;
+    capturing = 0;
+    loss_percent = 0;
+}
+
+static int
+check(int ok, const char *name, const char *format, ...)
+{
+    va_list arguments;
+
+    printf("%s %s: ", ok ? "ok  " : "FAIL", name);
+    va_start(arguments, format);
+    vprintf(format, arguments);
+    va_end(arguments);
+    printf("\n");
+
+    return ok ? 0 : 1;
+}
+
+/* sends HARNESS_PACKETS rounds of traffic on every channel, then disconnects once all reliable packets arrived */
+static int
+run_transfer(const char *name, devils_host *server, devils_host *client, devils_peer *peer)
+{
+    devils_uint32 start = devils_time_get();
+    unsigned int sent = 0, i;
+    int channelID;
+
+    while (!(counts.disconnected & 2) && devils_time_get() - start < 60000)
+    {
+        service_hosts(server, client);
+
+        if (sent < HARNESS_PACKETS)
+        {
+            for (channelID = 0; channelID < HARNESS_CHANNELS; ++channelID)
+            {
+                devils_peer_send(peer, (devils_uint8)channelID,
+                                 create_packet(reliable_length(channelID, sent), DEVILS_PACKET_FLAG_RELIABLE, 'R', channelID, sent));
+
+                for (i = 0; i < 3; ++i)
+                    devils_peer_send(peer, (devils_uint8)channelID,
+                                     create_packet(10 + random_next() % (i == 2 ? 3000 : 300), i == 1 ? DEVILS_PACKET_FLAG_UNSEQUENCED : 0,
+                                                   i == 1 ? 'S' : 'U', channelID, sent * 3 + i + 1));
+            }
+            ++sent;
+        }
+        else if (counts.reliable == HARNESS_PACKETS * HARNESS_CHANNELS && !(counts.disconnected & 4))
+        {
+            devils_peer_disconnect(peer, 0);
+            counts.disconnected |= 4;
+        }
+    }
+
+    return check(counts.errors == 0 && counts.reliable == HARNESS_PACKETS * HARNESS_CHANNELS && (counts.disconnected & 2), name,
+                 "reliable %d/%d, unreliable %d, unsequenced %d, errors %d, %u ms",
+                 counts.reliable, HARNESS_PACKETS * HARNESS_CHANNELS, counts.unreliable, counts.unsequenced, counts.errors,
+                 devils_time_get() - start);
+}
+
+static int
+test_loss(void)
+{
+    static const unsigned int losses[] = {0, 5, 15};
+    devils_host *server, *client;
+    devils_peer *peer;
+    devils_address address;
+    char name[32];
+    int failures = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(losses) / sizeof(losses[0]); ++i)
+    {
+        create_hosts(&server, &client, 8, &address);
+        loss_percent = losses[i];
+
+        sprintf(name, "loss %u%%", losses[i]);
+        peer = connect_peer(server, client, &address);
+        if (peer == NULL)
+            failures += check(0, name, "no connection");
+        else
+            failures += run_transfer(name, server, client, peer);
+
+        destroy_hosts(server, client);
+    }
+
+    return failures;
+}
+
+static int
+test_negotiate(void)
+{
+    devils_host *server, *client;
+    devils_peer *peer;
+    devils_address address;
+    const char *name;
+    int failures = 0, strip, expected;
+
+    for (strip = 0; strip < 2; ++strip)
+    {
+        create_hosts(&server, &client, 8, &address);
+        loss_percent = 5;
+        if (strip)
+            strip_host = server;
+
+        name = strip ? "negotiate without extensions" : "negotiate with extensions";
+        expected = strip ? 0 : HARNESS_EXTENSION_FLAGS;
+        peer = connect_peer(server, client, &address);
+        if (peer == NULL)
+            failures += check(0, name, "no connection");
+        else
+        {
+            failures += check((peer->flags & HARNESS_EXTENSION_FLAGS) == expected && (counts.remote->flags & HARNESS_EXTENSION_FLAGS) == expected &&
+                                  (devils_peer_channel_fec(peer, 0, 1) == 0) == !strip,
+                              name, "client flags %x, server flags %x, expected %x",
+                              peer->flags & HARNESS_EXTENSION_FLAGS, counts.remote->flags & HARNESS_EXTENSION_FLAGS, expected);
+            failures += run_transfer(name, server, client, peer);
+        }
+
+        destroy_hosts(server, client);
+    }
+
+    return failures;
+}
+
+static int
+test_extended(void)
+{
+    devils_host *server, *client, *baseline;
+    devils_peer *peer;
+    devils_address address;
+    devils_event event;
+    devils_uint32 start;
+    size_t peerID;
+    int failures = 0, admitted = 0;
+
+    create_hosts(&server, &client, DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID + 2, &address);
+
+    /* as if every peer a compact header can address were connected */
+    server->freePeers = NULL;
+
+    peer = connect_peer(server, client, &address);
+    if (peer == NULL)
+    {
+        failures += check(0, "extended peer ID", "no connection");
+        destroy_hosts(server, client);
+        return failures;
+    }
+
+    peerID = (size_t)(counts.remote - server->peers);
+    failures += check(peerID >= DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID && peer->outgoingPeerID == peerID,
+                      "extended peer ID", "server peer %u, client addresses it as %u",
+                      (unsigned int)peerID, (unsigned int)peer->outgoingPeerID);
+    failures += run_transfer("extended peer ID traffic", server, client, peer);
+
+    baseline = devils_host_create(NULL, 1, HARNESS_CHANNELS, 0, 0);
+    if (baseline == NULL)
+    {
+        fprintf(stderr, "An error occurred while creating the hosts.\n");
+        exit(1);
+    }
+
+    strip_host = server;
+    devils_host_connect(baseline, &address, HARNESS_CHANNELS, 0);
+    for (start = devils_time_get(); devils_time_get() - start < 2000;)
+    {
+        while (devils_host_service(baseline, &event, 0) > 0)
+            admitted |= event.type == DEVILS_EVENT_TYPE_CONNECT;
+        service_hosts(server, client);
+    }
+    failures += check(!admitted, "client without extended peer IDs", "%s", admitted ? "admitted" : "not admitted");
+
+    devils_host_destroy(baseline);
+    destroy_hosts(server, client);
+
+    return failures;
+}
+
+static int
+test_migrate(void)
+{
+    devils_host *server, *client;
+    devils_peer *peer;
+    devils_packet *packet;
+    devils_address address, any, moved;
+    devils_socket attacker;
+    devils_buffer buffer;
+    devils_uint16 port;
+    devils_uint32 start;
+    int failures = 0, i;
+
+    create_hosts(&server, &client, 4, &address);
+    server->checksum = devils_crc32;
+    client->checksum = devils_crc32;
+    devils_host_migration(server, 1);
+    loss_percent = 5;
+
+    peer = connect_peer(server, client, &address);
+    if (peer == NULL)
+    {
+        failures += check(0, "migration", "no connection");
+        destroy_hosts(server, client);
+        return failures;
+    }
+    port = counts.remote->address.port;
+
+    /* the first datagram carrying this packet is taken off the wire and the client's port blocked */
+    counts.nextReliable[0] = 100;
+    packet = create_packet(reliable_length(0, 100), DEVILS_PACKET_FLAG_RELIABLE, 'R', 0, 100);
+    memcpy(capture_data, packet->data + packet->dataLength - sizeof(capture_data), sizeof(capture_data));
+    capture_length = sizeof(capture_data);
+    captured_length = 0;
+    capturing = 1;
+    devils_peer_send(peer, 0, packet);
+    for (start = devils_time_get(); captured_length == 0 && devils_time_get() - start < 5000;)
+        service_hosts(server, client);
+
+    any.host = DEVILS_HOST_ANY;
+    any.port = 0;
+    attacker = devils_socket_create(DEVILS_SOCKET_TYPE_DATAGRAM);
+    devils_socket_bind(attacker, &any);
+    for (i = 0; i < 5; ++i)
+    {
+        buffer.data = captured;
+        buffer.dataLength = captured_length;
+        devils_socket_send(attacker, &address, &buffer, 1);
+        service_for(server, client, 50);
+    }
+    devils_socket_destroy(attacker);
+
+    failures += check(captured_length != 0 && counts.remote->address.port == port && counts.reliable == 0,
+                      "replay from another address", "captured %u bytes, peer %s, %d packets taken from the replay",
+                      (unsigned int)captured_length, counts.remote->address.port == port ? "unmoved" : "moved", counts.reliable);
+
+    /* the client moves to a new socket; the old port stays blocked */
+    devils_socket_destroy(client->socket);
+    client->socket = devils_socket_create(DEVILS_SOCKET_TYPE_DATAGRAM);
+    devils_socket_bind(client->socket, &any);
+    devils_socket_set_option(client->socket, DEVILS_SOCKOPT_NONBLOCK, 1);
+    devils_socket_get_address(client->socket, &moved);
+
+    for (i = 101; i <= 110; ++i)
+    {
+        devils_peer_send(peer, 0, create_packet(reliable_length(0, i), DEVILS_PACKET_FLAG_RELIABLE, 'R', 0, i));
+        devils_peer_send(counts.remote, 0, create_packet(reliable_length(0, i), DEVILS_PACKET_FLAG_RELIABLE, 'R', 0, i));
+    }
+
+    for (start = devils_time_get(); !(counts.reliable == 11 && counts.clientReceived == 10) && devils_time_get() - start < 10000;)
+        service_hosts(server, client);
+
+    failures += check(counts.remote->address.port == moved.port && counts.reliable == 11 && counts.clientReceived == 10 &&
+                          counts.errors == 0 && !counts.disconnected,
+                      "move to a new socket", "peer %s, server received %d/11, client received %d/10, errors %d, disconnects %d",
+                      counts.remote->address.port == moved.port ? "followed" : "not followed",
+                      counts.reliable, counts.clientReceived, counts.errors, counts.disconnected);
+
+    destroy_hosts(server, client);
+
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    const char *part = argc > 1 ? argv[1] : NULL;
+    int failures = 0;
+
+    if (devils_initialize() != 0)
+    {
+        fprintf(stderr, "An error occurred while initializing ENet.\n");
+        return 1;
+    }
+
+    if (part == NULL || strcmp(part, "loss") == 0)
+        failures += test_loss();
+    if (part == NULL || strcmp(part, "negotiate") == 0)
+        failures += test_negotiate();
+    if (part == NULL || strcmp(part, "extended") == 0)
+        failures += test_extended();
+    if (part == NULL || strcmp(part, "migrate") == 0)
+        failures += test_migrate();
+
+    printf("%d failed\n", failures);
+
+    devils_deinitialize();
+
+    return failures != 0;
+}
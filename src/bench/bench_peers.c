@@ -0,0 +1,72 @@
+/* One service pass over many idle connected peers, starting from cold caches.
+
+   usage: devils-bench-peers [peers] [passes]
+
+   The peers are marked connected without a remote end and their ping interval is pushed
+   out, so a flush visits every peer's hot fields and sends nothing. Before each pass a
+   buffer larger than the last level cache is touched, so the pass measures the cache misses
+   of walking the peer array rather than the work done per peer. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../devils/include/devils.h"
+
+#define EVICTION_BUFFER_SIZE (64 << 20)
+
+static char eviction_buffer[EVICTION_BUFFER_SIZE];
+
+int main(int argc, char **argv)
+{
+    size_t peerCount = argc > 1 ? (size_t)atoi(argv[1]) : 4000, offset;
+    int passCount = argc > 2 ? atoi(argv[2]) : 50, pass;
+    volatile char sink = 0;
+    devils_host *host;
+    devils_peer *peer;
+    clock_t start, elapsed, best = 0, total = 0;
+
+    if (devils_initialize() != 0)
+    {
+        fprintf(stderr, "An error occurred while initializing ENet.\n");
+        return 1;
+    }
+
+    host = devils_host_create(NULL, peerCount, 1, 0, 0);
+    if (host == NULL)
+    {
+        fprintf(stderr, "An error occurred while creating the host.\n");
+        return 1;
+    }
+
+    for (peer = host->peers; peer < &host->peers[host->peerCount]; ++peer)
+    {
+        peer->state = DEVILS_PEER_STATE_CONNECTED;
+        peer->pingInterval = 1u << 30;
+        peer->lastReceiveTime = devils_time_get();
+    }
+
+    for (pass = 0; pass < passCount; ++pass)
+    {
+        for (offset = 0; offset < EVICTION_BUFFER_SIZE; offset += 64)
+            sink ^= ++eviction_buffer[offset];
+
+        start = clock();
+        devils_host_flush(host);
+        elapsed = clock() - start;
+
+        total += elapsed;
+        if (pass == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    printf("sizeof(devils_peer) = %u, cold pass over %u idle peers: best %.0f us, mean %.0f us\n",
+           (unsigned int)sizeof(devils_peer), (unsigned int)peerCount,
+           (double)best * 1000000 / CLOCKS_PER_SEC, (double)total * 1000000 / CLOCKS_PER_SEC / passCount);
+
+    for (peer = host->peers; peer < &host->peers[host->peerCount]; ++peer)
+        peer->state = DEVILS_PEER_STATE_DISCONNECTED;
+
+    devils_host_destroy(host);
+    devils_deinitialize();
+
+    return sink & 0;
+}
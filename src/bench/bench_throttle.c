@@ -0,0 +1,136 @@
+/* Cost of one bandwidth throttle interval over many bandwidth-limited peers.
+
+   usage: devils-bench-throttle [peers] [rounds] [random|ramp|tight]
+
+   The peers are marked connected without a remote end and given bandwidth limits and queued
+   data of the chosen shape before every round:
+     random  upstreams, downstreams and queued data drawn at random
+     ramp    limits rising evenly across the peers, so each pass of the allocation caps a band
+     tight   random, with the host's incoming bandwidth exactly covering every peer's upstream
+   Each round runs devils_host_bandwidth_throttle() once without and once with the incoming
+   limit recalculation, which also queues a BANDWIDTH_LIMIT command to every peer. The checksum
+   of the resulting throttle limits and commands lets two builds be compared for identical
+   results. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../devils/include/devils.h"
+
+static void
+prepare_peers(devils_host *host, const char *shape, int recalculate)
+{
+    size_t peerCount = host->peerCount, i;
+    devils_uint32 upstreamTotal = 0;
+    int ramp = strcmp(shape, "ramp") == 0;
+
+    host->incomingBandwidth = 2000 * (devils_uint32)peerCount;
+    host->outgoingBandwidth = 500 * (devils_uint32)peerCount;
+    host->connectedPeers = peerCount;
+    host->bandwidthLimitedPeers = peerCount;
+    host->recalculateBandwidthLimits = recalculate;
+
+    for (i = 0; i < peerCount; ++i)
+    {
+        devils_peer *peer = &host->peers[i];
+
+        peer->state = DEVILS_PEER_STATE_CONNECTED;
+        peer->incomingBandwidth = ramp ? 100 + (devils_uint32)(1000.0 * i / peerCount) : 100 + (devils_uint32)(rand() % 1000);
+        peer->outgoingBandwidth = ramp ? 100 + (devils_uint32)(4000.0 * i / peerCount) : 100 + (devils_uint32)(rand() % 4000);
+        peer->outgoingDataTotal = ramp ? 1000 : rand() % 2000;
+        peer->packetThrottle = DEVILS_PEER_PACKET_THROTTLE_SCALE;
+        peer->incomingBandwidthThrottleEpoch = 0;
+        peer->outgoingBandwidthThrottleEpoch = 0;
+
+        upstreamTotal += peer->outgoingBandwidth;
+    }
+
+    if (strcmp(shape, "tight") == 0)
+        host->incomingBandwidth = upstreamTotal;
+
+    host->bandwidthThrottleEpoch = 1000000 - 1000;
+}
+
+/* folds the round's results into the checksum and drops the queued commands */
+static devils_uint64
+collect_results(devils_host *host)
+{
+    devils_uint64 checksum = 0;
+    size_t i;
+
+    for (i = 0; i < host->peerCount; ++i)
+    {
+        devils_peer *peer = &host->peers[i];
+
+        checksum += (devils_uint64)peer->packetThrottleLimit * (i + 1);
+        if (!devils_list_empty(&peer->outgoingCommands))
+        {
+            devils_outgoing_command *command = (devils_outgoing_command *)devils_list_back(&peer->outgoingCommands);
+
+            checksum += (devils_uint64)DEVILS_NET_TO_HOST_32(command->command.bandwidthLimit.incomingBandwidth) * (i + 1);
+        }
+
+        devils_peer_reset_queues(peer);
+    }
+
+    return checksum;
+}
+
+int main(int argc, char **argv)
+{
+    size_t peerCount = argc > 1 ? (size_t)atoi(argv[1]) : 4000, i;
+    int roundCount = argc > 2 ? atoi(argv[2]) : 100, round, recalculate;
+    const char *shape = argc > 3 ? argv[3] : "random";
+    devils_uint64 checksum = 0;
+    devils_uint32 tick;
+    clock_t start, total[2] = {0, 0};
+    devils_host *host;
+
+    if (devils_initialize() != 0)
+    {
+        fprintf(stderr, "An error occurred while initializing ENet.\n");
+        return 1;
+    }
+
+    host = devils_host_create(NULL, peerCount, 1, 0, 0);
+    if (host == NULL)
+    {
+        fprintf(stderr, "An error occurred while creating the host.\n");
+        return 1;
+    }
+
+    srand(1);
+
+    for (round = 0; round < roundCount; ++round)
+    {
+        for (recalculate = 0; recalculate < 2; ++recalculate)
+        {
+            prepare_peers(host, shape, recalculate);
+
+            /* a whole second since the last throttle, so that two builds see the same interval;
+               starting on a fresh millisecond keeps the clock from ticking before it is read */
+            for (tick = devils_time_get(); devils_time_get() == tick;)
+                ;
+            devils_time_set(1000000);
+            start = clock();
+            devils_host_bandwidth_throttle(host);
+            total[recalculate] += clock() - start;
+
+            checksum += collect_results(host);
+        }
+    }
+
+    printf("%u peers, %s: throttle %.3f ms, with limit recalculation %.3f ms, checksum %llx\n",
+           (unsigned int)peerCount, shape,
+           (double)total[0] * 1000 / CLOCKS_PER_SEC / roundCount,
+           (double)total[1] * 1000 / CLOCKS_PER_SEC / roundCount,
+           (unsigned long long)checksum);
+
+    for (i = 0; i < peerCount; ++i)
+        host->peers[i].state = DEVILS_PEER_STATE_DISCONNECTED;
+
+    devils_host_destroy(host);
+    devils_deinitialize();
+
+    return 0;
+}
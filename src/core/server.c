@@ -60,10 +60,10 @@ int main(int argc, char **argv)
                 /* Create a client */
                 client = (Client *)calloc(1, sizeof(Client));
                 client->ip[0] = '?';
-                devils_address_get_host_ip(&(event.peer->address), client->ip, sizeof(client->ip));
-                client->port = event.peer->address.port;
-                /* Save the Client* in peer->data */
-                event.peer->data = client;
+                devils_address_get_host_ip(devils_peer_get_address(event.peer), client->ip, sizeof(client->ip));
+                client->port = devils_peer_get_address(event.peer)->port;
+                /* Save the Client* as the peer data */
+                devils_peer_set_data(event.peer, client);
                 fprintf(stdout,
                         "Client connected: %s:%u\n",
                         client->ip,
@@ -72,7 +72,7 @@ int main(int argc, char **argv)
 
             case DEVILS_EVENT_TYPE_RECEIVE:
                 /* Get the Client* */
-                client = (Client *)event.peer->data;
+                client = (Client *)devils_peer_get_data(event.peer);
                 if (verbose)
                 {
                     fprintf(stdout,
@@ -97,14 +97,14 @@ int main(int argc, char **argv)
 
             case DEVILS_EVENT_TYPE_DISCONNECT:
                 /* Get the Client* */
-                client = (Client *)event.peer->data;
+                client = (Client *)devils_peer_get_data(event.peer);
                 fprintf(stdout,
                         "Client disconnected: %s:%u packet_count=%u\n",
                         client->ip,
                         (unsigned int)client->port,
                         client->packet_count);
                 /* Destroy the client */
-                event.peer->data = NULL;
+                devils_peer_set_data(event.peer, NULL);
                 free(client);
                 break;
 
@@ -0,0 +1,321 @@
+/**
+ @file congestion.c
+ @brief A BBR-style delay-based congestion controller
+*/
+#define DEVILS_BUILDING_LIB 1
+#include <string.h>
+#include "include/devils_utility.h"
+#include "include/devils_time.h"
+#include "include/devils.h"
+
+/* gains are ratios with respect to DEVILS_BBR_GAIN_SCALE */
+enum
+{
+    DEVILS_BBR_GAIN_SCALE = 256,
+    DEVILS_BBR_HIGH_GAIN = 739,  /* 2/ln(2), doubles the delivery rate every round */
+    DEVILS_BBR_DRAIN_GAIN = 88,  /* ln(2)/2, drains the queue built during startup */
+    DEVILS_BBR_WINDOW_GAIN = 512,
+    DEVILS_BBR_FULL_BANDWIDTH_GAIN = 320,
+    DEVILS_BBR_FULL_BANDWIDTH_ROUNDS = 3,
+
+    DEVILS_BBR_BANDWIDTH_FILTER_ROUNDS = 10,
+    DEVILS_BBR_GAIN_CYCLE_LENGTH = 8,
+    DEVILS_BBR_MINIMUM_ROUND_TIME = 10,
+    DEVILS_BBR_MINIMUM_ROUND_TRIP_TIME_INTERVAL = 10000,
+    DEVILS_BBR_PROBE_ROUND_TRIP_TIME_DURATION = 200,
+
+    DEVILS_BBR_INITIAL_WINDOW_PACKETS = 10,
+    DEVILS_BBR_MINIMUM_WINDOW_PACKETS = 4
+};
+
+typedef enum _devils_bbr_state
+{
+    DEVILS_BBR_STATE_STARTUP = 0,
+    DEVILS_BBR_STATE_DRAIN = 1,
+    DEVILS_BBR_STATE_PROBE_BANDWIDTH = 2,
+    DEVILS_BBR_STATE_PROBE_ROUND_TRIP_TIME = 3
+} devils_bbr_state;
+
+static const devils_uint32 pacingGainCycle[DEVILS_BBR_GAIN_CYCLE_LENGTH] =
+    {
+        320, 192, 256, 256, 256, 256, 256, 256};
+
+typedef struct _devils_bbr
+{
+    devils_bbr_state state;
+    devils_uint32 bandwidthSamples[DEVILS_BBR_BANDWIDTH_FILTER_ROUNDS];
+    devils_uint32 bandwidthRounds;
+    devils_uint32 bottleneckBandwidth; /* windowed maximum delivery rate in bytes/second */
+    devils_uint32 minimumRoundTripTime;
+    devils_uint32 minimumRoundTripTimeStamp;
+    devils_uint32 roundStart;
+    devils_uint32 roundDelivered;
+    devils_uint32 rounds;
+    devils_uint32 fullBandwidth;
+    devils_uint32 fullBandwidthRounds;
+    int fullBandwidthReached;
+    devils_uint32 cycleIndex;
+    devils_uint32 cycleStamp;
+    devils_uint32 probeRoundTripTimeDone;
+    devils_uint32 recoveryRound;
+    devils_uint32 recoveryWindow;
+} devils_bbr;
+
+/* computes value * numerator / denominator for the small denominators used here, saturating instead of overflowing */
+static devils_uint32
+devils_bbr_scale(devils_uint32 value, devils_uint32 numerator, devils_uint32 denominator)
+{
+    devils_uint32 quotient = value / denominator,
+                  remainder = value % denominator;
+
+    if (numerator == 0)
+        return 0;
+
+    if (quotient > 0xFFFFFFFFU / numerator)
+        return 0xFFFFFFFFU;
+
+    quotient *= numerator;
+    remainder = (remainder * numerator) / denominator;
+
+    return quotient > 0xFFFFFFFFU - remainder ? 0xFFFFFFFFU : quotient + remainder;
+}
+
+static devils_uint32
+devils_bbr_bandwidth_delay_product(devils_bbr *bbr, devils_uint32 gain)
+{
+    return devils_bbr_scale(devils_bbr_scale(bbr->bottleneckBandwidth, bbr->minimumRoundTripTime, 1000), gain, DEVILS_BBR_GAIN_SCALE);
+}
+
+static void
+devils_bbr_update_bandwidth(devils_bbr *bbr, devils_peer *peer)
+{
+    devils_uint32 serviceTime = peer->host->serviceTime,
+                  elapsedTime = DEVILS_TIME_DIFFERENCE(serviceTime, bbr->roundStart),
+                  bandwidth,
+                  sample;
+    int appLimited, index;
+
+    if (elapsedTime < DEVILS_MAX(peer->roundTripTime, DEVILS_BBR_MINIMUM_ROUND_TIME))
+        return;
+
+    sample = devils_bbr_scale(bbr->roundDelivered, 1000, elapsedTime);
+    appLimited = !devils_peer_has_outgoing_commands(peer);
+
+    bbr->roundStart = serviceTime;
+    bbr->roundDelivered = 0;
+    ++bbr->rounds;
+
+    /* samples limited by the application rather than the network only count if they raise the estimate */
+    if (appLimited && sample <= bbr->bottleneckBandwidth)
+        return;
+
+    bbr->bandwidthSamples[bbr->bandwidthRounds % DEVILS_BBR_BANDWIDTH_FILTER_ROUNDS] = sample;
+    ++bbr->bandwidthRounds;
+
+    for (bandwidth = 0, index = 0; index < DEVILS_BBR_BANDWIDTH_FILTER_ROUNDS; ++index)
+        bandwidth = DEVILS_MAX(bandwidth, bbr->bandwidthSamples[index]);
+
+    bbr->bottleneckBandwidth = bandwidth;
+
+    if (bbr->fullBandwidthReached || appLimited)
+        return;
+
+    if (bandwidth >= devils_bbr_scale(bbr->fullBandwidth, DEVILS_BBR_FULL_BANDWIDTH_GAIN, DEVILS_BBR_GAIN_SCALE))
+    {
+        bbr->fullBandwidth = bandwidth;
+        bbr->fullBandwidthRounds = 0;
+    }
+    else if (++bbr->fullBandwidthRounds >= DEVILS_BBR_FULL_BANDWIDTH_ROUNDS)
+        bbr->fullBandwidthReached = 1;
+}
+
+static void
+devils_bbr_update_state(devils_bbr *bbr, devils_peer *peer)
+{
+    devils_uint32 serviceTime = peer->host->serviceTime;
+
+    switch (bbr->state)
+    {
+    case DEVILS_BBR_STATE_STARTUP:
+        if (bbr->fullBandwidthReached)
+            bbr->state = DEVILS_BBR_STATE_DRAIN;
+        break;
+
+    case DEVILS_BBR_STATE_DRAIN:
+        if (peer->reliableDataInTransit <= devils_bbr_bandwidth_delay_product(bbr, DEVILS_BBR_GAIN_SCALE))
+        {
+            bbr->state = DEVILS_BBR_STATE_PROBE_BANDWIDTH;
+            bbr->cycleIndex = 2 + devils_host_random(peer->host) % (DEVILS_BBR_GAIN_CYCLE_LENGTH - 2);
+            bbr->cycleStamp = serviceTime;
+        }
+        break;
+
+    case DEVILS_BBR_STATE_PROBE_BANDWIDTH:
+        if (DEVILS_TIME_DIFFERENCE(serviceTime, bbr->cycleStamp) >= DEVILS_MAX(bbr->minimumRoundTripTime, 1))
+        {
+            bbr->cycleIndex = (bbr->cycleIndex + 1) % DEVILS_BBR_GAIN_CYCLE_LENGTH;
+            bbr->cycleStamp = serviceTime;
+        }
+        break;
+
+    case DEVILS_BBR_STATE_PROBE_ROUND_TRIP_TIME:
+        if (DEVILS_TIME_GREATER_EQUAL(serviceTime, bbr->probeRoundTripTimeDone))
+        {
+            bbr->minimumRoundTripTimeStamp = serviceTime;
+            bbr->state = bbr->fullBandwidthReached ? DEVILS_BBR_STATE_PROBE_BANDWIDTH : DEVILS_BBR_STATE_STARTUP;
+            bbr->cycleStamp = serviceTime;
+        }
+        break;
+    }
+}
+
+static void
+devils_bbr_update_window(devils_bbr *bbr, devils_peer *peer)
+{
+    devils_uint32 minimumWindow = DEVILS_BBR_MINIMUM_WINDOW_PACKETS * peer->mtu,
+                  pacingGain,
+                  windowGain = DEVILS_BBR_WINDOW_GAIN,
+                  congestionWindow;
+
+    switch (bbr->state)
+    {
+    case DEVILS_BBR_STATE_STARTUP:
+        pacingGain = windowGain = DEVILS_BBR_HIGH_GAIN;
+        break;
+
+    case DEVILS_BBR_STATE_DRAIN:
+        pacingGain = DEVILS_BBR_DRAIN_GAIN;
+        windowGain = DEVILS_BBR_HIGH_GAIN;
+        break;
+
+    case DEVILS_BBR_STATE_PROBE_BANDWIDTH:
+        pacingGain = pacingGainCycle[bbr->cycleIndex];
+        break;
+
+    default:
+        pacingGain = DEVILS_BBR_GAIN_SCALE;
+        break;
+    }
+
+    if (bbr->bottleneckBandwidth == 0 || bbr->minimumRoundTripTime == 0)
+    {
+        congestionWindow = DEVILS_BBR_INITIAL_WINDOW_PACKETS * peer->mtu;
+        peer->pacingRate = devils_bbr_scale(devils_bbr_scale(congestionWindow, 1000, DEVILS_MAX(peer->roundTripTime, 1)), pacingGain, DEVILS_BBR_GAIN_SCALE);
+    }
+    else
+    {
+        congestionWindow = devils_bbr_bandwidth_delay_product(bbr, windowGain);
+        peer->pacingRate = devils_bbr_scale(bbr->bottleneckBandwidth, pacingGain, DEVILS_BBR_GAIN_SCALE);
+    }
+
+    if (bbr->state == DEVILS_BBR_STATE_PROBE_ROUND_TRIP_TIME)
+        congestionWindow = minimumWindow;
+    else if (bbr->recoveryWindow != 0)
+    {
+        if (bbr->rounds == bbr->recoveryRound)
+            congestionWindow = DEVILS_MIN(congestionWindow, bbr->recoveryWindow);
+        else
+            bbr->recoveryWindow = 0;
+    }
+
+    peer->congestionWindow = DEVILS_MAX(congestionWindow, minimumWindow);
+}
+
+void *
+devils_bbr_create(void *context, devils_peer *peer)
+{
+    devils_bbr *bbr = (devils_bbr *)devils_malloc(sizeof(devils_bbr));
+
+    (void)context;
+
+    if (bbr == NULL)
+        return NULL;
+
+    memset(bbr, 0, sizeof(devils_bbr));
+
+    bbr->state = DEVILS_BBR_STATE_STARTUP;
+    bbr->roundStart = peer->host->serviceTime;
+
+    devils_bbr_update_window(bbr, peer);
+
+    return bbr;
+}
+
+void devils_bbr_destroy(void *context, void *state)
+{
+    (void)context;
+
+    devils_free(state);
+}
+
+void devils_bbr_acknowledge(void *context, void *state, devils_peer *peer, devils_uint32 roundTripTime, devils_uint32 bytesAcknowledged)
+{
+    devils_bbr *bbr = (devils_bbr *)state;
+    devils_uint32 serviceTime = peer->host->serviceTime;
+    int minimumRoundTripTimeExpired = bbr->minimumRoundTripTime != 0 &&
+                                      DEVILS_TIME_DIFFERENCE(serviceTime, bbr->minimumRoundTripTimeStamp) >= DEVILS_BBR_MINIMUM_ROUND_TRIP_TIME_INTERVAL;
+
+    (void)context;
+
+    if (bbr->minimumRoundTripTime == 0 || roundTripTime <= bbr->minimumRoundTripTime || minimumRoundTripTimeExpired)
+    {
+        bbr->minimumRoundTripTime = roundTripTime;
+        bbr->minimumRoundTripTimeStamp = serviceTime;
+    }
+
+    /* an expired estimate means the queue may never have drained, so briefly send very little to measure it again */
+    if (minimumRoundTripTimeExpired && bbr->state != DEVILS_BBR_STATE_PROBE_ROUND_TRIP_TIME)
+    {
+        bbr->state = DEVILS_BBR_STATE_PROBE_ROUND_TRIP_TIME;
+        bbr->probeRoundTripTimeDone = serviceTime + DEVILS_MAX(DEVILS_BBR_PROBE_ROUND_TRIP_TIME_DURATION, peer->roundTripTime);
+    }
+
+    bbr->roundDelivered += bytesAcknowledged;
+
+    devils_bbr_update_bandwidth(bbr, peer);
+    devils_bbr_update_state(bbr, peer);
+    devils_bbr_update_window(bbr, peer);
+}
+
+void devils_bbr_loss(void *context, void *state, devils_peer *peer, devils_uint32 bytesLost)
+{
+    devils_bbr *bbr = (devils_bbr *)state;
+
+    (void)context;
+    (void)bytesLost;
+
+    /* conserve packets for the rest of the round instead of sending into the loss */
+    bbr->recoveryRound = bbr->rounds;
+    bbr->recoveryWindow = DEVILS_MAX(peer->reliableDataInTransit, DEVILS_BBR_MINIMUM_WINDOW_PACKETS * peer->mtu);
+
+    devils_bbr_update_window(bbr, peer);
+}
+
+/** @defgroup host ENet host functions
+    @{
+*/
+
+/** Sets the congestion controller the host should use to the default BBR-style controller.
+
+    The controller estimates the bottleneck bandwidth and minimum round trip time of each peer
+    from its acknowledgements and bounds reliable data in transit to a multiple of their product,
+    rather than scaling the window with the packet throttle. Peers that negotiated window scaling may
+    then keep up to DEVILS_PROTOCOL_MAXIMUM_SCALED_WINDOW_SIZE in transit, as long-haul links need.
+    Each channel still keeps at most DEVILS_PEER_INCOMING_RELIABLE_RING_MAXIMUM_SIZE reliable commands
+    in flight, about 11 MB of full fragments at the default MTU, so a single channel only fills the
+    window with a larger MTU; traffic over several channels can fill it at any MTU.
+
+    @param host host to enable the controller for
+*/
+void devils_host_congestion_control_with_bbr(devils_host *host)
+{
+    devils_congestion_control congestionControl;
+    memset(&congestionControl, 0, sizeof(congestionControl));
+    congestionControl.create = devils_bbr_create;
+    congestionControl.acknowledge = devils_bbr_acknowledge;
+    congestionControl.loss = devils_bbr_loss;
+    congestionControl.destroy = devils_bbr_destroy;
+    devils_host_congestion_control(host, &congestionControl);
+}
+
+/** @} */
@@ -0,0 +1,191 @@
+/**
+ @file cookie.c
+ @brief Stateless connect cookies and per-prefix connect admission
+*/
+#define DEVILS_BUILDING_LIB 1
+#include <string.h>
+#include "include/devils_time.h"
+#include "include/devils.h"
+
+enum
+{
+    DEVILS_COOKIE_INTERVAL = 10000,     /* a cookie stays valid for one to two intervals of this many milliseconds */
+    DEVILS_COOKIE_PREFIX_COUNT = 4096,  /* number of /24 prefixes whose admission rate is tracked at once */
+    DEVILS_COOKIE_PREFIX_RATE = 32,     /* verified connects admitted per second from one /24 prefix */
+    DEVILS_COOKIE_PREFIX_BURST = 32,    /* verified connects a quiet /24 prefix may make back to back */
+    DEVILS_COOKIE_TOKEN_SCALE = 1000
+};
+
+typedef struct _devils_cookie_prefix
+{
+    devils_uint32 prefix;
+    devils_uint32 tokens;
+    devils_uint32 time;
+} devils_cookie_prefix;
+
+typedef struct _devils_host_cookies
+{
+    devils_uint32 key[2];
+    devils_cookie_prefix prefixes[DEVILS_COOKIE_PREFIX_COUNT];
+} devils_host_cookies;
+
+#define DEVILS_COOKIE_ROTATE(x, b) (devils_uint32)(((x) << (b)) | ((x) >> (32 - (b))))
+
+static void
+devils_cookie_round(devils_uint32 *v)
+{
+    v[0] += v[1];
+    v[1] = DEVILS_COOKIE_ROTATE(v[1], 5) ^ v[0];
+    v[0] = DEVILS_COOKIE_ROTATE(v[0], 16);
+    v[2] += v[3];
+    v[3] = DEVILS_COOKIE_ROTATE(v[3], 8) ^ v[2];
+    v[0] += v[3];
+    v[3] = DEVILS_COOKIE_ROTATE(v[3], 7) ^ v[0];
+    v[2] += v[1];
+    v[1] = DEVILS_COOKIE_ROTATE(v[1], 13) ^ v[2];
+    v[2] = DEVILS_COOKIE_ROTATE(v[2], 16);
+}
+
+/* HalfSipHash-2-4 with a 64-bit tag over a fixed number of 32-bit words */
+static void
+devils_cookie_hash(const devils_uint32 *key, const devils_uint32 *words, size_t wordCount, devils_uint32 *tag)
+{
+    devils_uint32 v[4];
+    size_t i;
+
+    v[0] = key[0];
+    v[1] = key[1];
+    v[2] = key[0] ^ 0x6c796765;
+    v[3] = key[1] ^ 0x74656462;
+    v[1] ^= 0xee;
+
+    for (i = 0; i < wordCount; ++i)
+    {
+        v[3] ^= words[i];
+        devils_cookie_round(v);
+        devils_cookie_round(v);
+        v[0] ^= words[i];
+    }
+
+    v[3] ^= (devils_uint32)(wordCount * 4) << 24;
+    devils_cookie_round(v);
+    devils_cookie_round(v);
+    v[0] ^= (devils_uint32)(wordCount * 4) << 24;
+
+    v[2] ^= 0xee;
+    for (i = 0; i < 4; ++i)
+        devils_cookie_round(v);
+    tag[0] = v[1] ^ v[3];
+
+    v[1] ^= 0xdd;
+    for (i = 0; i < 4; ++i)
+        devils_cookie_round(v);
+    tag[1] = v[1] ^ v[3];
+}
+
+static void
+devils_cookie_compute(devils_host *host, const devils_address *address, devils_uint32 connectID, devils_uint32 slot, devils_uint32 *cookie)
+{
+    devils_uint32 words[4];
+
+    words[0] = address->host;
+    words[1] = address->port;
+    words[2] = connectID;
+    words[3] = slot;
+
+    devils_cookie_hash(host->cookies->key, words, 4, cookie);
+}
+
+/** Requires connecting peers to echo a stateless cookie before the host allocates a peer for them.
+    @param host host to configure
+    @param key DEVILS_HOST_COOKIE_KEY_SIZE bytes of secret key material, or NULL to admit connecting peers directly
+    @returns 0 on success, < 0 on failure
+    @remarks Without a valid cookie a CONNECT only earns a reply no larger than itself, so spoofed
+    connects cost neither peer slots nor amplified traffic. Verified connects are further limited per
+    /24 source prefix. Hosts behind a shared address should use the same key.
+*/
+int
+devils_host_connect_cookies(devils_host *host, const devils_uint8 *key)
+{
+    if (key == NULL)
+    {
+        if (host->cookies != NULL)
+        {
+            devils_free(host->cookies);
+            host->cookies = NULL;
+        }
+        return 0;
+    }
+
+    if (host->cookies == NULL)
+    {
+        host->cookies = (devils_host_cookies *)devils_malloc(sizeof(devils_host_cookies));
+        if (host->cookies == NULL)
+            return -1;
+    }
+
+    memset(host->cookies, 0, sizeof(devils_host_cookies));
+    memcpy(host->cookies->key, key, DEVILS_HOST_COOKIE_KEY_SIZE);
+
+    return 0;
+}
+
+void
+devils_host_cookie_generate(devils_host *host, const devils_address *address, devils_uint32 connectID, devils_uint32 *cookie)
+{
+    devils_cookie_compute(host, address, connectID, host->serviceTime / DEVILS_COOKIE_INTERVAL, cookie);
+}
+
+int
+devils_host_cookie_verify(devils_host *host, const devils_address *address, devils_uint32 connectID, const devils_uint32 *cookie)
+{
+    devils_uint32 slot = host->serviceTime / DEVILS_COOKIE_INTERVAL, expected[2];
+    int i;
+
+    for (i = 0; i < 2; ++i)
+    {
+        devils_cookie_compute(host, address, connectID, slot - i, expected);
+        if (((expected[0] ^ cookie[0]) | (expected[1] ^ cookie[1])) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+int
+devils_host_cookie_admit(devils_host *host, const devils_address *address)
+{
+    devils_uint32 prefix = DEVILS_NET_TO_HOST_32(address->host) & 0xFFFFFF00, elapsed, hash;
+    devils_cookie_prefix *entry;
+
+    hash = prefix >> 8;
+    hash ^= hash >> 12;
+    entry = &host->cookies->prefixes[hash & (DEVILS_COOKIE_PREFIX_COUNT - 1)];
+
+    if (entry->time == 0 || entry->prefix != prefix)
+    {
+        entry->prefix = prefix;
+        entry->tokens = DEVILS_COOKIE_PREFIX_BURST * DEVILS_COOKIE_TOKEN_SCALE;
+    }
+    else
+    {
+        elapsed = DEVILS_TIME_DIFFERENCE(host->serviceTime, entry->time);
+        if (elapsed >= DEVILS_COOKIE_PREFIX_BURST * DEVILS_COOKIE_TOKEN_SCALE / DEVILS_COOKIE_PREFIX_RATE)
+            entry->tokens = DEVILS_COOKIE_PREFIX_BURST * DEVILS_COOKIE_TOKEN_SCALE;
+        else
+        {
+            entry->tokens += elapsed * DEVILS_COOKIE_PREFIX_RATE;
+            if (entry->tokens > DEVILS_COOKIE_PREFIX_BURST * DEVILS_COOKIE_TOKEN_SCALE)
+                entry->tokens = DEVILS_COOKIE_PREFIX_BURST * DEVILS_COOKIE_TOKEN_SCALE;
+        }
+    }
+
+    entry->time = host->serviceTime | 1;
+
+    if (entry->tokens < DEVILS_COOKIE_TOKEN_SCALE)
+        return 0;
+
+    entry->tokens -= DEVILS_COOKIE_TOKEN_SCALE;
+
+    return 1;
+}
@@ -0,0 +1,334 @@
+/**
+ @file fec.c
+ @brief Forward error correction for unreliable channels
+*/
+#define DEVILS_BUILDING_LIB 1
+#include <string.h>
+#include "include/devils_utility.h"
+#include "include/devils.h"
+
+enum
+{
+    DEVILS_FEC_MAXIMUM_GROUP_SIZE = 8,
+    DEVILS_FEC_WINDOW_SIZE = 2 * DEVILS_FEC_MAXIMUM_GROUP_SIZE,
+    DEVILS_FEC_LOSS_FACTOR = 4 /* size groups so that roughly one in four is expected to lose a datagram */
+};
+
+typedef struct _devils_fec_entry
+{
+    devils_uint8 command;
+    devils_uint16 reliableSequenceNumber;
+    devils_uint16 sequenceNumber;
+    devils_uint16 dataLength;
+} devils_fec_entry;
+
+typedef struct _devils_channel_fec
+{
+    int encode;
+    devils_uint8 groupSize;
+    devils_uint8 groupCount;
+    devils_uint16 repairLength;
+    devils_protocol_repair_descriptor descriptors[DEVILS_FEC_MAXIMUM_GROUP_SIZE];
+    devils_uint8 repair[DEVILS_PROTOCOL_MAXIMUM_MTU];
+
+    devils_fec_entry entries[DEVILS_FEC_WINDOW_SIZE];
+    size_t entryCount;
+    size_t slotSize;
+    devils_uint8 *slots; /**< DEVILS_FEC_WINDOW_SIZE copies of recently received commands followed by a scratch slot */
+} devils_channel_fec;
+
+/* largest command that can be protected while its repair command still fits a datagram */
+static size_t
+devils_fec_maximum_length(const devils_peer *peer)
+{
+    size_t overhead = sizeof(devils_protocol_header) + sizeof(devils_uint32) + sizeof(devils_uint32) +
+                      sizeof(devils_protocol_send_repair) +
+                      DEVILS_FEC_MAXIMUM_GROUP_SIZE * sizeof(devils_protocol_repair_descriptor);
+
+    return peer->mtu > overhead ? peer->mtu - overhead : 0;
+}
+
+static devils_uint8
+devils_fec_group_size(const devils_peer *peer)
+{
+    devils_uint32 groupSize;
+
+    if (peer->packetLoss == 0)
+        return DEVILS_FEC_MAXIMUM_GROUP_SIZE;
+
+    groupSize = DEVILS_PEER_PACKET_LOSS_SCALE / (peer->packetLoss * DEVILS_FEC_LOSS_FACTOR);
+
+    return (devils_uint8)DEVILS_MAX(DEVILS_MIN(groupSize, DEVILS_FEC_MAXIMUM_GROUP_SIZE), 1);
+}
+
+static devils_channel_fec *
+devils_fec_create(void)
+{
+    devils_channel_fec *fec = (devils_channel_fec *)devils_malloc(sizeof(devils_channel_fec));
+    if (fec == NULL)
+        return NULL;
+
+    memset(fec, 0, sizeof(devils_channel_fec));
+
+    return fec;
+}
+
+static void
+devils_fec_xor(devils_uint8 *repair, const devils_uint8 *data, size_t dataLength)
+{
+    size_t i;
+
+    for (i = 0; i < dataLength; ++i)
+        repair[i] ^= data[i];
+}
+
+static void
+devils_fec_send_repair(devils_peer *peer, devils_channel *channel, devils_channel_fec *fec)
+{
+    size_t descriptorLength = fec->groupCount * sizeof(devils_protocol_repair_descriptor),
+           dataLength = descriptorLength + fec->repairLength;
+    devils_outgoing_command *outgoingCommand;
+    devils_protocol command;
+    devils_packet *packet;
+
+    packet = devils_packet_create(NULL, dataLength, 0);
+    if (packet != NULL)
+    {
+        memcpy(packet->data, fec->descriptors, descriptorLength);
+        memcpy(packet->data + descriptorLength, fec->repair, fec->repairLength);
+
+        command.header.command = DEVILS_PROTOCOL_COMMAND_SEND_REPAIR | DEVILS_PROTOCOL_COMMAND_FLAG_UNSEQUENCED;
+        command.header.channelID = (devils_uint8)(channel - peer->channels);
+        command.sendRepair.groupSize = fec->groupCount;
+        command.sendRepair.dataLength = DEVILS_HOST_TO_NET_16(dataLength);
+
+        outgoingCommand = (devils_outgoing_command *)devils_malloc(sizeof(devils_outgoing_command));
+        if (outgoingCommand == NULL)
+            devils_packet_destroy(packet);
+        else
+        {
+            outgoingCommand->command = command;
+            outgoingCommand->fragmentOffset = 0;
+            outgoingCommand->fragmentLength = (devils_uint16)dataLength;
+            outgoingCommand->packet = packet;
+            ++packet->referenceCount;
+
+            devils_list_insert(devils_list_end(&peer->repairCommands), outgoingCommand);
+        }
+    }
+
+    memset(fec->repair, 0, fec->repairLength);
+    fec->repairLength = 0;
+    fec->groupCount = 0;
+}
+
+/** @defgroup peer ENet peer functions
+    @{
+*/
+
+/** Enables or disables forward error correction for unreliable and unsequenced packets sent on a channel.
+
+    Every group of sent packets is followed by a repair command carrying their XOR parity, from which
+    the foreign host can rebuild any single packet of the group that was lost.  The group size adapts
+    to the measured packet loss of the peer, from one repair for every eight packets down to a repair
+    for every packet.  Packets too large to fit a repair command in one datagram, and
+    fragmented packets, are not protected.
+
+    @param peer peer to configure
+    @param channelID channel to configure
+    @param enable nonzero to protect packets sent on the channel, zero to stop
+    @retval 0 on success
+    @retval < 0 on failure, including enabling it before the peer connected or for a peer that does
+    not understand DEVILS_PROTOCOL_COMMAND_SEND_REPAIR
+*/
+int devils_peer_channel_fec(devils_peer *peer, devils_uint8 channelID, int enable)
+{
+    devils_channel *channel;
+
+    if (channelID >= peer->channelCount ||
+        (enable && !(peer->flags & DEVILS_PEER_FLAG_REPAIR)))
+        return -1;
+
+    channel = &peer->channels[channelID];
+    if (channel->fec == NULL)
+    {
+        if (!enable)
+            return 0;
+
+        channel->fec = devils_fec_create();
+        if (channel->fec == NULL)
+            return -1;
+    }
+
+    channel->fec->encode = enable;
+
+    memset(channel->fec->repair, 0, channel->fec->repairLength);
+    channel->fec->repairLength = 0;
+    channel->fec->groupCount = 0;
+
+    return 0;
+}
+
+/** @} */
+
+void devils_peer_fec_encode(devils_peer *peer, devils_channel *channel, const devils_outgoing_command *outgoingCommand)
+{
+    devils_channel_fec *fec = channel->fec;
+    devils_protocol_repair_descriptor *descriptor;
+    devils_uint8 commandNumber = outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_MASK;
+
+    if (fec == NULL || !fec->encode ||
+        (commandNumber != DEVILS_PROTOCOL_COMMAND_SEND_UNRELIABLE && commandNumber != DEVILS_PROTOCOL_COMMAND_SEND_UNSEQUENCED) ||
+        outgoingCommand->fragmentLength > devils_fec_maximum_length(peer))
+        return;
+
+    if (fec->groupCount == 0)
+        fec->groupSize = devils_fec_group_size(peer);
+
+    descriptor = &fec->descriptors[fec->groupCount];
+    descriptor->command = commandNumber;
+    descriptor->reliableSequenceNumber = outgoingCommand->command.header.reliableSequenceNumber;
+    descriptor->sequenceNumber = commandNumber == DEVILS_PROTOCOL_COMMAND_SEND_UNSEQUENCED ? outgoingCommand->command.sendUnsequenced.unsequencedGroup : outgoingCommand->command.sendUnreliable.unreliableSequenceNumber;
+    descriptor->dataLength = DEVILS_HOST_TO_NET_16(outgoingCommand->fragmentLength);
+
+    devils_fec_xor(fec->repair, outgoingCommand->packet->data + outgoingCommand->fragmentOffset, outgoingCommand->fragmentLength);
+    if (outgoingCommand->fragmentLength > fec->repairLength)
+        fec->repairLength = outgoingCommand->fragmentLength;
+
+    if (++fec->groupCount >= fec->groupSize)
+        devils_fec_send_repair(peer, channel, fec);
+}
+
+void devils_peer_fec_record(devils_peer *peer, devils_channel *channel, const devils_protocol *command, const devils_uint8 *data, size_t dataLength)
+{
+    devils_channel_fec *fec = channel->fec;
+    devils_fec_entry *entry;
+    size_t index;
+
+    (void)peer;
+
+    if (fec == NULL || fec->slots == NULL || dataLength > fec->slotSize)
+        return;
+
+    index = fec->entryCount++ % DEVILS_FEC_WINDOW_SIZE;
+
+    entry = &fec->entries[index];
+    entry->command = command->header.command & DEVILS_PROTOCOL_COMMAND_MASK;
+    entry->reliableSequenceNumber = command->header.reliableSequenceNumber;
+    entry->sequenceNumber = entry->command == DEVILS_PROTOCOL_COMMAND_SEND_UNSEQUENCED ? DEVILS_NET_TO_HOST_16(command->sendUnsequenced.unsequencedGroup) : DEVILS_NET_TO_HOST_16(command->sendUnreliable.unreliableSequenceNumber);
+    entry->dataLength = (devils_uint16)dataLength;
+
+    memcpy(&fec->slots[index * fec->slotSize], data, dataLength);
+}
+
+/** Rebuilds the one command of a repair group that was not received, if any.
+    @returns 1 and the rebuilt command in recoveredCommand if a command was recovered, 0 if none could be, or -1 if the repair command is malformed
+*/
+int devils_peer_fec_recover(devils_peer *peer, devils_channel *channel, const devils_protocol *command, const devils_uint8 *data, size_t dataLength,
+                            devils_protocol *recoveredCommand, const devils_uint8 **recoveredData, size_t *recoveredLength)
+{
+    devils_channel_fec *fec = channel->fec;
+    const devils_protocol_repair_descriptor *descriptors = (const devils_protocol_repair_descriptor *)data,
+                                            *missing = NULL;
+    size_t groupSize = command->sendRepair.groupSize,
+           descriptorLength = groupSize * sizeof(devils_protocol_repair_descriptor),
+           repairLength, present[DEVILS_FEC_MAXIMUM_GROUP_SIZE], presentCount = 0, i, j;
+    devils_uint8 *scratch;
+
+    if (groupSize == 0 || groupSize > DEVILS_FEC_MAXIMUM_GROUP_SIZE || dataLength < descriptorLength)
+        return -1;
+
+    repairLength = dataLength - descriptorLength;
+    if (repairLength > devils_fec_maximum_length(peer))
+        return -1;
+
+    if (fec == NULL)
+    {
+        fec = devils_fec_create();
+        if (fec == NULL)
+            return 0;
+
+        channel->fec = fec;
+    }
+
+    if (fec->slots == NULL)
+    {
+        fec->slotSize = devils_fec_maximum_length(peer);
+        fec->slots = (devils_uint8 *)devils_malloc((DEVILS_FEC_WINDOW_SIZE + 1) * fec->slotSize);
+        if (fec->slots == NULL)
+            return 0;
+
+        /* commands sent before the decoder existed were not kept, so this group cannot be repaired */
+        return 0;
+    }
+
+    for (i = 0; i < groupSize; ++i)
+    {
+        const devils_protocol_repair_descriptor *descriptor = &descriptors[i];
+        devils_uint16 reliableSequenceNumber = DEVILS_NET_TO_HOST_16(descriptor->reliableSequenceNumber),
+                      sequenceNumber = DEVILS_NET_TO_HOST_16(descriptor->sequenceNumber);
+
+        if ((descriptor->command != DEVILS_PROTOCOL_COMMAND_SEND_UNRELIABLE && descriptor->command != DEVILS_PROTOCOL_COMMAND_SEND_UNSEQUENCED) ||
+            DEVILS_NET_TO_HOST_16(descriptor->dataLength) > repairLength)
+            return -1;
+
+        for (j = 0; j < DEVILS_FEC_WINDOW_SIZE && j < fec->entryCount; ++j)
+        {
+            const devils_fec_entry *entry = &fec->entries[j];
+
+            if (entry->command == descriptor->command &&
+                entry->sequenceNumber == sequenceNumber &&
+                (entry->command == DEVILS_PROTOCOL_COMMAND_SEND_UNSEQUENCED || entry->reliableSequenceNumber == reliableSequenceNumber))
+                break;
+        }
+
+        if (j < DEVILS_FEC_WINDOW_SIZE && j < fec->entryCount)
+            present[presentCount++] = j;
+        else if (missing != NULL)
+            return 0;
+        else
+            missing = descriptor;
+    }
+
+    if (missing == NULL)
+        return 0;
+
+    scratch = &fec->slots[DEVILS_FEC_WINDOW_SIZE * fec->slotSize];
+    memcpy(scratch, data + descriptorLength, repairLength);
+
+    for (i = 0; i < presentCount; ++i)
+        devils_fec_xor(scratch, &fec->slots[present[i] * fec->slotSize], fec->entries[present[i]].dataLength);
+
+    recoveredCommand->header.command = missing->command;
+    recoveredCommand->header.channelID = command->header.channelID;
+    recoveredCommand->header.reliableSequenceNumber = DEVILS_NET_TO_HOST_16(missing->reliableSequenceNumber);
+    if (missing->command == DEVILS_PROTOCOL_COMMAND_SEND_UNSEQUENCED)
+    {
+        recoveredCommand->header.command |= DEVILS_PROTOCOL_COMMAND_FLAG_UNSEQUENCED;
+        recoveredCommand->sendUnsequenced.unsequencedGroup = missing->sequenceNumber;
+        recoveredCommand->sendUnsequenced.dataLength = missing->dataLength;
+    }
+    else
+    {
+        recoveredCommand->sendUnreliable.unreliableSequenceNumber = missing->sequenceNumber;
+        recoveredCommand->sendUnreliable.dataLength = missing->dataLength;
+    }
+
+    *recoveredData = scratch;
+    *recoveredLength = DEVILS_NET_TO_HOST_16(missing->dataLength);
+
+    return 1;
+}
+
+void devils_peer_fec_destroy(devils_channel *channel)
+{
+    if (channel->fec == NULL)
+        return;
+
+    if (channel->fec->slots != NULL)
+        devils_free(channel->fec->slots);
+
+    devils_free(channel->fec);
+
+    channel->fec = NULL;
+}
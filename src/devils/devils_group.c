@@ -0,0 +1,147 @@
+/**
+ @file group.c
+ @brief Peer groups for sending one packet to a subset of a host's peers
+*/
+#define DEVILS_BUILDING_LIB 1
+#include <string.h>
+#include "include/devils.h"
+
+enum
+{
+    DEVILS_GROUP_WORD_BITS = 32
+};
+
+/** Creates an empty group of peers on a host.
+    @param host host whose peers may join the group
+    @returns the group on success, NULL on failure
+    @remarks Membership is kept as a bitmap over host->peers. A peer leaves every group
+    when it disconnects, so a reused peer slot never inherits old memberships.
+    Groups still alive when their host is destroyed are destroyed with it.
+*/
+devils_group *
+devils_group_create(devils_host *host)
+{
+    devils_group *group = (devils_group *)devils_malloc(sizeof(devils_group));
+    size_t wordCount = (host->peerCount + DEVILS_GROUP_WORD_BITS - 1) / DEVILS_GROUP_WORD_BITS;
+
+    if (group == NULL)
+        return NULL;
+
+    group->members = (devils_uint32 *)devils_malloc(wordCount * sizeof(devils_uint32));
+    if (group->members == NULL)
+    {
+        devils_free(group);
+        return NULL;
+    }
+
+    memset(group->members, 0, wordCount * sizeof(devils_uint32));
+
+    group->host = host;
+    group->wordCount = wordCount;
+    group->peerCount = 0;
+
+    devils_list_insert(devils_list_end(&host->groups), &group->groupList);
+
+    return group;
+}
+
+/** Destroys a group; its peers are unaffected.
+    @param group group to destroy
+*/
+void devils_group_destroy(devils_group *group)
+{
+    if (group == NULL)
+        return;
+
+    devils_list_remove(&group->groupList);
+
+    devils_free(group->members);
+    devils_free(group);
+}
+
+/** Adds a peer to a group.
+    @param group group to add the peer to
+    @param peer peer to add, which must belong to the group's host and not be disconnected
+    @retval 0 on success, including when the peer was already a member
+    @retval < 0 on failure
+*/
+int devils_group_add(devils_group *group, devils_peer *peer)
+{
+    size_t peerIndex = peer - group->host->peers;
+    devils_uint32 *word, bit;
+
+    if (peer->host != group->host || peer->state == DEVILS_PEER_STATE_DISCONNECTED)
+        return -1;
+
+    word = &group->members[peerIndex / DEVILS_GROUP_WORD_BITS];
+    bit = (devils_uint32)1 << (peerIndex % DEVILS_GROUP_WORD_BITS);
+    if (!(*word & bit))
+    {
+        *word |= bit;
+        ++group->peerCount;
+    }
+
+    return 0;
+}
+
+/** Removes a peer from a group.
+    @param group group to remove the peer from
+    @param peer peer to remove; nothing happens if it is not a member
+*/
+void devils_group_remove(devils_group *group, devils_peer *peer)
+{
+    size_t peerIndex = peer - group->host->peers;
+    devils_uint32 *word, bit;
+
+    if (peer->host != group->host)
+        return;
+
+    word = &group->members[peerIndex / DEVILS_GROUP_WORD_BITS];
+    bit = (devils_uint32)1 << (peerIndex % DEVILS_GROUP_WORD_BITS);
+    if (*word & bit)
+    {
+        *word &= ~bit;
+        --group->peerCount;
+    }
+}
+
+/** Queues a packet to be sent to every connected member of a group.
+    @param group group whose members receive the packet
+    @param channelID channel on which to send
+    @param packet packet to send, shared by all members
+    @remarks the packet is destroyed if no member ended up holding a reference to it
+*/
+void devils_group_send(devils_group *group, devils_uint8 channelID, devils_packet *packet)
+{
+    devils_peer *peers = group->host->peers;
+    devils_uint32 word;
+    size_t wordIndex, bitIndex;
+
+    if (packet->dataLength <= group->host->maximumPacketSize)
+        for (wordIndex = 0; wordIndex < group->wordCount; ++wordIndex)
+        {
+            for (word = group->members[wordIndex], bitIndex = wordIndex * DEVILS_GROUP_WORD_BITS;
+                 word != 0;
+                 word >>= 1, ++bitIndex)
+            {
+                if (!(word & 1))
+                    continue;
+
+                if (peers[bitIndex].state == DEVILS_PEER_STATE_CONNECTED)
+                    devils_peer_send(&peers[bitIndex], channelID, packet);
+            }
+        }
+
+    if (packet->referenceCount == 0)
+        devils_packet_destroy(packet);
+}
+
+void devils_host_leave_groups(devils_host *host, devils_peer *peer)
+{
+    devils_list_iterator currentGroup;
+
+    for (currentGroup = devils_list_begin(&host->groups);
+         currentGroup != devils_list_end(&host->groups);
+         currentGroup = devils_list_next(currentGroup))
+        devils_group_remove((devils_group *)currentGroup, peer);
+}
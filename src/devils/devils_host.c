@@ -13,7 +13,9 @@
 /** Creates a host for communicating to peers.  
 
     @param address   the address at which other peers may connect to this host.  If NULL, then no peers may connect to the host.
-    @param peerCount the maximum number of peers that should be allocated for the host.
+    @param peerCount the maximum number of peers that should be allocated for the host.  Peers from
+    DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID on are addressed by an extended header and only accept
+    connections from hosts that support it; the two peers before them are never used.
     @param channelLimit the maximum number of channels allowed; if 0, then this is equivalent to DEVILS_PROTOCOL_MAXIMUM_CHANNEL_COUNT
     @param incomingBandwidth downstream bandwidth of the host in bytes/second; if 0, ENet will assume unlimited bandwidth.
     @param outgoingBandwidth upstream bandwidth of the host in bytes/second; if 0, ENet will assume unlimited bandwidth.
@@ -30,8 +32,9 @@ devils_host_create(const devils_address *address, size_t peerCount, size_t chann
 {
   devils_host *host;
   devils_peer *currentPeer;
+  size_t priority, bucketCount;
 
-  if (peerCount > DEVILS_PROTOCOL_MAXIMUM_PEER_ID)
+  if (peerCount > DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID)
     return NULL;
 
   host = (devils_host *)devils_malloc(sizeof(devils_host));
@@ -48,12 +51,26 @@ devils_host_create(const devils_address *address, size_t peerCount, size_t chann
   }
   memset(host->peers, 0, peerCount * sizeof(devils_peer));
 
+  for (bucketCount = 1; bucketCount < peerCount; bucketCount <<= 1)
+    ;
+  host->peerBuckets = (devils_peer **)devils_malloc(bucketCount * sizeof(devils_peer *));
+  if (host->peerBuckets == NULL)
+  {
+    devils_free(host->peers);
+    devils_free(host);
+
+    return NULL;
+  }
+  memset(host->peerBuckets, 0, bucketCount * sizeof(devils_peer *));
+  host->peerBucketMask = bucketCount - 1;
+
   host->socket = devils_socket_create(DEVILS_SOCKET_TYPE_DATAGRAM);
   if (host->socket == DEVILS_SOCKET_NULL || (address != NULL && devils_socket_bind(host->socket, address) < 0))
   {
     if (host->socket != DEVILS_SOCKET_NULL)
       devils_socket_destroy(host->socket);
 
+    devils_free(host->peerBuckets);
     devils_free(host->peers);
     devils_free(host);
 
@@ -81,35 +98,77 @@ devils_host_create(const devils_address *address, size_t peerCount, size_t chann
   host->outgoingBandwidth = outgoingBandwidth;
   host->bandwidthThrottleEpoch = 0;
   host->recalculateBandwidthLimits = 0;
+  host->pacingDeadline = 0;
+  host->totalQueued = 0;
   host->mtu = DEVILS_HOST_DEFAULT_MTU;
   host->peerCount = peerCount;
   host->commandCount = 0;
   host->bufferCount = 0;
+  host->sendCount = 0;
   host->checksum = NULL;
+  host->migration = 0;
+  host->cookies = NULL;
   host->receivedAddress.host = DEVILS_HOST_ANY;
   host->receivedAddress.port = 0;
   host->receivedData = NULL;
   host->receivedDataLength = 0;
 
+  host->serviceTime = devils_time_get();
   host->totalSentData = 0;
   host->totalSentPackets = 0;
   host->totalReceivedData = 0;
   host->totalReceivedPackets = 0;
+  memset(&host->counters, 0, sizeof(host->counters));
 
   host->connectedPeers = 0;
   host->bandwidthLimitedPeers = 0;
-  host->duplicatePeers = DEVILS_PROTOCOL_MAXIMUM_PEER_ID;
+  host->duplicatePeers = DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID;
   host->maximumPacketSize = DEVILS_HOST_DEFAULT_MAXIMUM_PACKET_SIZE;
   host->maximumWaitingData = DEVILS_HOST_DEFAULT_MAXIMUM_WAITING_DATA;
+  host->maximumReassemblyData = DEVILS_HOST_DEFAULT_MAXIMUM_REASSEMBLY_DATA;
+  host->reassemblyData = 0;
+  host->chunkedPackets = 0;
+  host->bandwidthPacing = 0;
+  host->reassemblyPool = NULL;
+  host->reassemblyPoolCount = 0;
 
   host->compressor.context = NULL;
   host->compressor.compress = NULL;
   host->compressor.decompress = NULL;
   host->compressor.destroy = NULL;
 
+  host->congestionControl.context = NULL;
+  host->congestionControl.create = NULL;
+  host->congestionControl.acknowledge = NULL;
+  host->congestionControl.loss = NULL;
+  host->congestionControl.destroy = NULL;
+
   host->intercept = NULL;
 
   devils_list_clear(&host->dispatchQueue);
+  devils_list_clear(&host->groups);
+  devils_list_clear(&host->streams);
+  devils_list_clear(&host->trafficClasses);
+
+  host->freePeers = NULL;
+  host->freeExtendedPeers = NULL;
+
+  for (currentPeer = &host->peers[host->peerCount];
+       currentPeer > host->peers;)
+  {
+    --currentPeer;
+
+    if (currentPeer - host->peers < DEVILS_PROTOCOL_EXTENDED_PEER_ID)
+    {
+      currentPeer->nextPeer = host->freePeers;
+      host->freePeers = currentPeer;
+    }
+    else if (currentPeer - host->peers >= DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID)
+    {
+      currentPeer->nextPeer = host->freeExtendedPeers;
+      host->freeExtendedPeers = currentPeer;
+    }
+  }
 
   for (currentPeer = host->peers;
        currentPeer < &host->peers[host->peerCount];
@@ -124,6 +183,9 @@ devils_host_create(const devils_address *address, size_t peerCount, size_t chann
     devils_list_clear(&currentPeer->sentReliableCommands);
     devils_list_clear(&currentPeer->sentUnreliableCommands);
     devils_list_clear(&currentPeer->outgoingCommands);
+    for (priority = 0; priority < DEVILS_PEER_CHANNEL_PRIORITIES; ++priority)
+      devils_list_clear(&currentPeer->activeChannels[priority]);
+    devils_list_clear(&currentPeer->repairCommands);
     devils_list_clear(&currentPeer->dispatchedCommands);
 
     devils_peer_reset(currentPeer);
@@ -154,6 +216,19 @@ void devils_host_destroy(devils_host *host)
   if (host->compressor.context != NULL && host->compressor.destroy)
     (*host->compressor.destroy)(host->compressor.context);
 
+  devils_host_connect_cookies(host, NULL);
+  devils_host_flush_reassembly_pool(host);
+
+  while (!devils_list_empty(&host->groups))
+    devils_group_destroy((devils_group *)devils_list_front(&host->groups));
+
+  devils_host_destroy_streams(host);
+
+  while (!devils_list_empty(&host->trafficClasses))
+    devils_traffic_class_destroy((devils_traffic_class *)devils_list_front(&host->trafficClasses));
+
+  devils_free(host->bandwidthShares);
+  devils_free(host->peerBuckets);
   devils_free(host->peers);
   devils_free(host);
 }
@@ -168,6 +243,89 @@ devils_host_random(devils_host *host)
   return n ^ (n >> 14);
 }
 
+static devils_peer **
+devils_host_address_bucket(devils_host *host, devils_uint32 address)
+{
+  devils_uint32 hash = address * 0x9E3779B1U;
+
+  return &host->peerBuckets[(hash ^ (hash >> 16)) & host->peerBucketMask];
+}
+
+/* first peer of the bucket holding the peers in use at the given IP address */
+devils_peer *
+devils_host_address_peers(devils_host *host, devils_uint32 address)
+{
+  return *devils_host_address_bucket(host, address);
+}
+
+/* disconnected peer to hand out next, preferring those a compact header can address */
+devils_peer *
+devils_host_free_peer(devils_host *host, int extended)
+{
+  if (host->freePeers != NULL)
+    return host->freePeers;
+
+  return extended ? host->freeExtendedPeers : NULL;
+}
+
+static void
+devils_host_link_peer(devils_host *host, devils_peer *peer)
+{
+  devils_peer **bucket = devils_host_address_bucket(host, peer->address.host);
+
+  peer->nextPeer = *bucket;
+  if (peer->nextPeer != NULL)
+    peer->nextPeer->peerLink = &peer->nextPeer;
+  peer->peerLink = bucket;
+  *bucket = peer;
+}
+
+static void
+devils_host_unlink_peer(devils_peer *peer)
+{
+  *peer->peerLink = peer->nextPeer;
+  if (peer->nextPeer != NULL)
+    peer->nextPeer->peerLink = peer->peerLink;
+}
+
+/** Takes a peer returned by devils_host_free_peer() into use at its current address. */
+void devils_host_bind_peer(devils_host *host, devils_peer *peer)
+{
+  if (host->freePeers == peer)
+    host->freePeers = peer->nextPeer;
+  else
+    host->freeExtendedPeers = peer->nextPeer;
+
+  devils_host_link_peer(host, peer);
+}
+
+/** Returns a peer leaving use to the free list of its host. */
+void devils_host_unbind_peer(devils_host *host, devils_peer *peer)
+{
+  devils_host_unlink_peer(peer);
+
+  if (peer->incomingPeerID < DEVILS_PROTOCOL_EXTENDED_PEER_ID)
+  {
+    peer->nextPeer = host->freePeers;
+    host->freePeers = peer;
+  }
+  else
+  {
+    peer->nextPeer = host->freeExtendedPeers;
+    host->freeExtendedPeers = peer;
+  }
+}
+
+/** Moves a peer in use to a new address. */
+void devils_host_move_peer(devils_host *host, devils_peer *peer, const devils_address *address)
+{
+  devils_host_unlink_peer(peer);
+
+  peer->address = *address;
+
+  devils_host_link_peer(host, peer);
+}
+
 /** Initiates a connection to a foreign host.
     @param host host seeking the connection
     @param address destination for the connection
@@ -175,7 +333,8 @@ devils_host_random(devils_host *host)
     @param data user data supplied to the receiving host 
     @returns a peer representing the foreign host on success, NULL on failure
     @remarks The peer returned will have not completed the connection until devils_host_service()
-    notifies of an DEVILS_EVENT_TYPE_CONNECT event for the peer.
+    notifies of an DEVILS_EVENT_TYPE_CONNECT event for the peer. Only peers a compact header can
+    address initiate connections, since the foreign host may not support extended peer IDs.
 */
 devils_peer *
 devils_host_connect(devils_host *host, const devils_address *address, size_t channelCount, devils_uint32 data)
@@ -189,15 +348,8 @@ devils_host_connect(devils_host *host, const devils_address *address, size_t cha
   else if (channelCount > DEVILS_PROTOCOL_MAXIMUM_CHANNEL_COUNT)
     channelCount = DEVILS_PROTOCOL_MAXIMUM_CHANNEL_COUNT;
 
-  for (currentPeer = host->peers;
-       currentPeer < &host->peers[host->peerCount];
-       ++currentPeer)
-  {
-    if (currentPeer->state == DEVILS_PEER_STATE_DISCONNECTED)
-      break;
-  }
-
-  if (currentPeer >= &host->peers[host->peerCount])
+  currentPeer = devils_host_free_peer(host, 0);
+  if (currentPeer == NULL)
     return NULL;
 
   currentPeer->channels = (devils_channel *)devils_malloc(channelCount * sizeof(devils_channel));
@@ -206,10 +358,14 @@ devils_host_connect(devils_host *host, const devils_address *address, size_t cha
   currentPeer->channelCount = channelCount;
   currentPeer->state = DEVILS_PEER_STATE_CONNECTING;
   currentPeer->address = *address;
+  devils_host_bind_peer(host, currentPeer);
   currentPeer->connectID = devils_host_random(host);
 
+  devils_peer_reset_congestion_control(currentPeer);
+
+  /* advertise the scaled window; VERIFY_CONNECT brings it back down unless the server scales too */
   if (host->outgoingBandwidth == 0)
-    currentPeer->windowSize = DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE;
+    currentPeer->windowSize = DEVILS_PROTOCOL_MAXIMUM_SCALED_WINDOW_SIZE;
   else
     currentPeer->windowSize = (host->outgoingBandwidth /
                                DEVILS_PEER_WINDOW_SIZE_SCALE) *
@@ -217,8 +373,8 @@ devils_host_connect(devils_host *host, const devils_address *address, size_t cha
 
   if (currentPeer->windowSize < DEVILS_PROTOCOL_MINIMUM_WINDOW_SIZE)
     currentPeer->windowSize = DEVILS_PROTOCOL_MINIMUM_WINDOW_SIZE;
-  else if (currentPeer->windowSize > DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE)
-    currentPeer->windowSize = DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE;
+  else if (currentPeer->windowSize > DEVILS_PROTOCOL_MAXIMUM_SCALED_WINDOW_SIZE)
+    currentPeer->windowSize = DEVILS_PROTOCOL_MAXIMUM_SCALED_WINDOW_SIZE;
 
   for (channel = currentPeer->channels;
        channel < &currentPeer->channels[channelCount];
@@ -229,21 +385,23 @@ devils_host_connect(devils_host *host, const devils_address *address, size_t cha
     channel->incomingReliableSequenceNumber = 0;
     channel->incomingUnreliableSequenceNumber = 0;
 
-    devils_list_clear(&channel->incomingReliableCommands);
-    devils_list_clear(&channel->incomingUnreliableCommands);
-
     channel->usedReliableWindows = 0;
-    memset(channel->reliableWindows, 0, sizeof(channel->reliableWindows));
+    channel->priority = DEVILS_PEER_CHANNEL_DEFAULT_PRIORITY;
+    channel->weight = DEVILS_PEER_CHANNEL_DEFAULT_WEIGHT;
+    channel->unordered = 0;
+    channel->state = NULL;
+    channel->fec = NULL;
   }
 
-  command.header.command = DEVILS_PROTOCOL_COMMAND_CONNECT | DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE;
+  command.header.command = DEVILS_PROTOCOL_COMMAND_CONNECT | DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE | DEVILS_PROTOCOL_COMMAND_FLAG_SERIAL_UNRELIABLE |
+                           DEVILS_PROTOCOL_COMMAND_FLAG_WINDOW_SCALE | DEVILS_PROTOCOL_COMMAND_FLAG_SKIP;
   command.header.channelID = 0xFF;
-  command.connect.outgoingPeerID = DEVILS_HOST_TO_NET_16(currentPeer->incomingPeerID);
+  command.connect.outgoingPeerID = DEVILS_HOST_TO_NET_16((devils_uint16)currentPeer->incomingPeerID);
   command.connect.incomingSessionID = currentPeer->incomingSessionID;
   command.connect.outgoingSessionID = currentPeer->outgoingSessionID;
   command.connect.mtu = DEVILS_HOST_TO_NET_32(currentPeer->mtu);
   command.connect.windowSize = DEVILS_HOST_TO_NET_32(currentPeer->windowSize);
-  command.connect.channelCount = DEVILS_HOST_TO_NET_32(channelCount);
+  command.connect.channelCount = DEVILS_HOST_TO_NET_32(channelCount | (currentPeer->incomingPeerID >> 16) << DEVILS_PROTOCOL_CONNECT_PEER_ID_SHIFT);
   command.connect.incomingBandwidth = DEVILS_HOST_TO_NET_32(host->incomingBandwidth);
   command.connect.outgoingBandwidth = DEVILS_HOST_TO_NET_32(host->outgoingBandwidth);
   command.connect.packetThrottleInterval = DEVILS_HOST_TO_NET_32(currentPeer->packetThrottleInterval);
@@ -280,6 +438,32 @@ void devils_host_broadcast(devils_host *host, devils_uint8 channelID, devils_pac
     devils_packet_destroy(packet);
 }
 
+/** Queues a packet to be sent to a subset of the peers associated with the host.
+    @param host host on which to broadcast the packet
+    @param channelID channel on which to broadcast
+    @param packet packet to broadcast
+    @param peers peers to send the packet to; those not currently connected are skipped
+    @param peerCount number of entries in peers
+    @remarks The packet data is shared by every recipient, and the resulting datagrams are
+    handed to the socket in batches of up to DEVILS_HOST_SEND_BATCH_SIZE.
+*/
+void devils_host_broadcast_peers(devils_host *host, devils_uint8 channelID, devils_packet *packet, devils_peer **peers, size_t peerCount)
+{
+  size_t peerIndex;
+
+  if (packet->dataLength <= host->maximumPacketSize)
+    for (peerIndex = 0; peerIndex < peerCount; ++peerIndex)
+    {
+      if (peers[peerIndex]->state != DEVILS_PEER_STATE_CONNECTED)
+        continue;
+
+      devils_peer_send(peers[peerIndex], channelID, packet);
+    }
+
+  if (packet->referenceCount == 0)
+    devils_packet_destroy(packet);
+}
+
 /** Sets the packet compressor the host should use to compress and decompress packets.
     @param host host to enable or disable compression for
     @param compressor callbacks for for the packet compressor; if NULL, then compression is disabled
@@ -295,6 +479,38 @@ void devils_host_compress(devils_host *host, const devils_compressor *compressor
     host->compressor.context = NULL;
 }
 
+/** Sets the congestion controller the host should use to bound reliable data in transit and pace sends to its peers.
+    @param host host to set the congestion controller for
+    @param congestionControl callbacks for the congestion controller; if NULL, then the packet throttle window is used
+    @remarks the state of connected peers is recreated with the new controller. Reliable windows beyond
+    DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE are only used with a congestion controller, and a single channel
+    keeps at most DEVILS_PEER_INCOMING_RELIABLE_RING_MAXIMUM_SIZE reliable commands of them in flight.
+*/
+void devils_host_congestion_control(devils_host *host, const devils_congestion_control *congestionControl)
+{
+  devils_peer *currentPeer;
+
+  for (currentPeer = host->peers;
+       currentPeer < &host->peers[host->peerCount];
+       ++currentPeer)
+  {
+    if (currentPeer->congestionState != NULL && host->congestionControl.destroy != NULL)
+      host->congestionControl.destroy(host->congestionControl.context, currentPeer->congestionState);
+
+    currentPeer->congestionState = NULL;
+  }
+
+  if (congestionControl)
+    host->congestionControl = *congestionControl;
+  else
+    memset(&host->congestionControl, 0, sizeof(host->congestionControl));
+
+  for (currentPeer = host->peers;
+       currentPeer < &host->peers[host->peerCount];
+       ++currentPeer)
+    devils_peer_reset_congestion_control(currentPeer);
+}
+
 /** Limits the maximum allowed channels of future incoming connections.
     @param host host to limit
     @param channelLimit the maximum number of channels allowed; if 0, then this is equivalent to DEVILS_PROTOCOL_MAXIMUM_CHANNEL_COUNT
@@ -309,6 +525,48 @@ void devils_host_channel_limit(devils_host *host, size_t channelLimit)
   host->channelLimit = channelLimit;
 }
 
+/** Lets connected peers of a host continue from a new address, such as after a NAT rebinding.
+    @param host host to configure
+    @param enable non-zero to follow peers to a new address, zero to drop their datagrams
+    @remarks The checksum is no proof of who sent a datagram, since the connectID it covers crosses
+    the wire in the clear, so a datagram from a new address never moves the peer by itself. If it passed
+    the checksum and carries a sent time newer than the last accepted from the peer, the host pings the
+    new address; nothing else is taken from it. The peer moves once the acknowledgement of that ping
+    returns from the new address, which a sender spoofing it cannot produce. Until then replies keep
+    going to the old address, and what the peer sends from the new one is dropped and retransmitted
+    after the move. Has no effect unless host->checksum is set.
+*/
+void devils_host_migration(devils_host *host, int enable)
+{
+  host->migration = enable;
+}
+
+/** Sets whether a host receives fragmented packets into chunks.
+    @param host host to configure
+    @param enable non-zero to receive fragmented packets into pooled chunks, zero to receive each into one buffer
+    @remarks Either way a complete packet is delivered in the memory its fragments were written to.
+    By default that is a single buffer of the packet's length, allocated when the first fragment
+    arrives and counted in full towards the peer's and the host's waiting data limits. With chunks,
+    memory is only taken as fragments arrive, DEVILS_REASSEMBLY_CHUNK_SIZE bytes at a time, and a
+    packet spanning more than one chunk is delivered flagged DEVILS_PACKET_FLAG_CHUNKED, with its
+    data in the chunks array of the packet instead of in data. Such a packet cannot be sent on.
+*/
+void devils_host_chunked_packets(devils_host *host, int enable)
+{
+  host->chunkedPackets = enable;
+}
+
+/** Sets whether a host paces peers to the incoming bandwidth they advertised.
+    @param host host to configure
+    @param enable non-zero to pace peers without a pacing rate to their incoming bandwidth, zero to leave them unpaced
+    @remarks A congestion controller's pacing rate always applies. Without one, or before it sets a
+    rate, peers are only paced if this is enabled and they advertised a limited incoming bandwidth.
+*/
+void devils_host_bandwidth_pacing(devils_host *host, int enable)
+{
+  host->bandwidthPacing = enable;
+}
+
 /** Adjusts the bandwidth limits of a host.
     @param host host to adjust
     @param incomingBandwidth new incoming bandwidth
@@ -323,6 +581,60 @@ void devils_host_bandwidth_limit(devils_host *host, devils_uint32 incomingBandwi
   host->recalculateBandwidthLimits = 1;
 }
 
+typedef struct _devils_bandwidth_share
+{
+  devils_uint32 key;
+  devils_peer *peer;
+} devils_bandwidth_share;
+
+/* sorts shares by key with a radix sort, skipping bytes all keys agree on;
+   returns whichever of shares and scratch ends up holding the sorted shares */
+static devils_bandwidth_share *
+devils_host_sort_bandwidth_shares(devils_bandwidth_share *shares, devils_bandwidth_share *scratch, size_t shareCount)
+{
+  size_t counts[256], shift, index, offset, count;
+  devils_uint32 differences = 0;
+  devils_bandwidth_share *swap;
+
+  for (index = 1; index < shareCount; ++index)
+    differences |= shares[index].key ^ shares[0].key;
+
+  for (shift = 0; shift < 32; shift += 8)
+  {
+    if (((differences >> shift) & 0xFF) == 0)
+      continue;
+
+    memset(counts, 0, sizeof(counts));
+
+    for (index = 0; index < shareCount; ++index)
+      ++counts[(shares[index].key >> shift) & 0xFF];
+
+    for (index = 0, offset = 0; index < 256; ++index)
+    {
+      count = counts[index];
+      counts[index] = offset;
+      offset += count;
+    }
+
+    for (index = 0; index < shareCount; ++index)
+      scratch[counts[(shares[index].key >> shift) & 0xFF]++] = shares[index];
+
+    swap = shares;
+    shares = scratch;
+    scratch = swap;
+  }
+
+  return shares;
+}
+
+/* the lowest packet throttle at which a peer's queued data would exceed its incoming bandwidth;
+   at most DEVILS_PEER_PACKET_THROTTLE_SCALE since the queued data already exceeds peerBandwidth */
+static devils_uint32
+devils_host_saturating_throttle(devils_peer *peer, devils_uint32 peerBandwidth)
+{
+  return (devils_uint32)((((devils_uint64)peerBandwidth + 1) * DEVILS_PEER_PACKET_THROTTLE_SCALE + peer->outgoingDataTotal - 1) / peer->outgoingDataTotal);
+}
+
 void devils_host_bandwidth_throttle(devils_host *host)
 {
   devils_uint32 timeCurrent = devils_time_get(),
@@ -332,7 +644,8 @@ void devils_host_bandwidth_throttle(devils_host *host)
                 bandwidth = ~0,
                 throttle = 0,
                 bandwidthLimit = 0;
-  int needsAdjustment = host->bandwidthLimitedPeers > 0 ? 1 : 0;
+  devils_bandwidth_share *shares;
+  size_t shareCount = 0, shareIndex;
   devils_peer *peer;
   devils_protocol command;
 
@@ -344,66 +657,82 @@ void devils_host_bandwidth_throttle(devils_host *host)
   if (peersRemaining == 0)
     return;
 
+  if (host->bandwidthShares == NULL)
+  {
+    host->bandwidthShares = (devils_bandwidth_share *)devils_malloc(2 * host->peerCount * sizeof(devils_bandwidth_share));
+    if (host->bandwidthShares == NULL)
+      return;
+  }
+
   if (host->outgoingBandwidth != 0)
   {
     dataTotal = 0;
     bandwidth = (host->outgoingBandwidth * elapsedTime) / 1000;
+  }
 
-    for (peer = host->peers;
-         peer < &host->peers[host->peerCount];
-         ++peer)
+  for (peer = host->peers;
+       peer < &host->peers[host->peerCount];
+       ++peer)
+  {
+    if (peer->state != DEVILS_PEER_STATE_CONNECTED && peer->state != DEVILS_PEER_STATE_DISCONNECT_LATER)
+      continue;
+
+    if (host->outgoingBandwidth != 0)
+      dataTotal += peer->outgoingDataTotal;
+
+    if (host->bandwidthLimitedPeers > 0 && peer->incomingBandwidth != 0)
     {
-      if (peer->state != DEVILS_PEER_STATE_CONNECTED && peer->state != DEVILS_PEER_STATE_DISCONNECT_LATER)
+      devils_uint32 peerBandwidth = (peer->incomingBandwidth * elapsedTime) / 1000;
+
+      /* a peer whose queued data fits its bandwidth saturates at no throttle */
+      if (peer->outgoingDataTotal <= peerBandwidth)
         continue;
 
-      dataTotal += peer->outgoingDataTotal;
+      host->bandwidthShares[shareCount].key = devils_host_saturating_throttle(peer, peerBandwidth);
+      host->bandwidthShares[shareCount].peer = peer;
+      ++shareCount;
     }
   }
 
-  while (peersRemaining > 0 && needsAdjustment != 0)
+  /* water-fill the host's outgoing bandwidth: a peer that saturates below the common throttle is held
+     to its own bandwidth and leaves the rest to the others, which only raises the common throttle,
+     so peers are capped in order of the throttle they saturate at until one no longer does */
+  shares = devils_host_sort_bandwidth_shares(host->bandwidthShares, &host->bandwidthShares[host->peerCount], shareCount);
+
+  for (shareIndex = 0; shareIndex < shareCount; ++shareIndex)
   {
-    needsAdjustment = 0;
+    devils_uint32 peerBandwidth, peerDataTotal;
+
+    peer = shares[shareIndex].peer;
 
     if (dataTotal <= bandwidth)
       throttle = DEVILS_PEER_PACKET_THROTTLE_SCALE;
     else
       throttle = (bandwidth * DEVILS_PEER_PACKET_THROTTLE_SCALE) / dataTotal;
 
-    for (peer = host->peers;
-         peer < &host->peers[host->peerCount];
-         ++peer)
-    {
-      devils_uint32 peerBandwidth;
-
-      if ((peer->state != DEVILS_PEER_STATE_CONNECTED && peer->state != DEVILS_PEER_STATE_DISCONNECT_LATER) ||
-          peer->incomingBandwidth == 0 ||
-          peer->outgoingBandwidthThrottleEpoch == timeCurrent)
-        continue;
-
-      peerBandwidth = (peer->incomingBandwidth * elapsedTime) / 1000;
-      if ((throttle * peer->outgoingDataTotal) / DEVILS_PEER_PACKET_THROTTLE_SCALE <= peerBandwidth)
-        continue;
+    peerBandwidth = (peer->incomingBandwidth * elapsedTime) / 1000;
+    peerDataTotal = peer->outgoingDataTotal;
+    if ((throttle * peerDataTotal) / DEVILS_PEER_PACKET_THROTTLE_SCALE <= peerBandwidth)
+      break;
 
-      peer->packetThrottleLimit = (peerBandwidth *
-                                   DEVILS_PEER_PACKET_THROTTLE_SCALE) /
-                                  peer->outgoingDataTotal;
+    peer->packetThrottleLimit = (peerBandwidth *
+                                 DEVILS_PEER_PACKET_THROTTLE_SCALE) /
+                                peerDataTotal;
 
-      if (peer->packetThrottleLimit == 0)
-        peer->packetThrottleLimit = 1;
+    if (peer->packetThrottleLimit == 0)
+      peer->packetThrottleLimit = 1;
 
-      if (peer->packetThrottle > peer->packetThrottleLimit)
-        peer->packetThrottle = peer->packetThrottleLimit;
+    if (peer->packetThrottle > peer->packetThrottleLimit)
+      peer->packetThrottle = peer->packetThrottleLimit;
 
-      peer->outgoingBandwidthThrottleEpoch = timeCurrent;
+    peer->outgoingBandwidthThrottleEpoch = timeCurrent;
 
-      peer->incomingDataTotal = 0;
-      peer->outgoingDataTotal = 0;
+    peer->incomingDataTotal = 0;
+    peer->outgoingDataTotal = 0;
 
-      needsAdjustment = 1;
-      --peersRemaining;
-      bandwidth -= peerBandwidth;
-      dataTotal -= peerBandwidth;
-    }
+    --peersRemaining;
+    bandwidth -= peerBandwidth;
+    dataTotal -= peerDataTotal;
   }
 
   if (peersRemaining > 0)
@@ -437,36 +766,52 @@ void devils_host_bandwidth_throttle(devils_host *host)
 
     peersRemaining = (devils_uint32)host->connectedPeers;
     bandwidth = host->incomingBandwidth;
-    needsAdjustment = 1;
 
     if (bandwidth == 0)
       bandwidthLimit = 0;
     else
-      while (peersRemaining > 0 && needsAdjustment != 0)
+    {
+      shareCount = 0;
+
+      /* peers without an upstream limit take no fixed part of the bandwidth */
+      for (peer = host->peers;
+           peer < &host->peers[host->peerCount];
+           ++peer)
       {
-        needsAdjustment = 0;
-        bandwidthLimit = bandwidth / peersRemaining;
+        if (peer->state != DEVILS_PEER_STATE_CONNECTED && peer->state != DEVILS_PEER_STATE_DISCONNECT_LATER)
+          continue;
 
-        for (peer = host->peers;
-             peer < &host->peers[host->peerCount];
-             ++peer)
+        if (peer->outgoingBandwidth == 0)
         {
-          if ((peer->state != DEVILS_PEER_STATE_CONNECTED && peer->state != DEVILS_PEER_STATE_DISCONNECT_LATER) ||
-              peer->incomingBandwidthThrottleEpoch == timeCurrent)
-            continue;
-
-          if (peer->outgoingBandwidth > 0 &&
-              peer->outgoingBandwidth >= bandwidthLimit)
-            continue;
-
           peer->incomingBandwidthThrottleEpoch = timeCurrent;
-
-          needsAdjustment = 1;
           --peersRemaining;
-          bandwidth -= peer->outgoingBandwidth;
+        }
+        else
+        {
+          host->bandwidthShares[shareCount].key = peer->outgoingBandwidth;
+          host->bandwidthShares[shareCount].peer = peer;
+          ++shareCount;
         }
       }
 
+      shares = devils_host_sort_bandwidth_shares(host->bandwidthShares, &host->bandwidthShares[host->peerCount], shareCount);
+
+      /* water-fill: peers whose upstream is below the fair share of what is left keep their upstream */
+      for (shareIndex = 0; shareIndex < shareCount && peersRemaining > 0; ++shareIndex)
+      {
+        if (shares[shareIndex].key >= bandwidth / peersRemaining)
+          break;
+
+        shares[shareIndex].peer->incomingBandwidthThrottleEpoch = timeCurrent;
+
+        --peersRemaining;
+        bandwidth -= shares[shareIndex].key;
+      }
+
+      if (peersRemaining > 0)
+        bandwidthLimit = bandwidth / peersRemaining;
+    }
+
     for (peer = host->peers;
          peer < &host->peers[host->peerCount];
          ++peer)
@@ -0,0 +1,299 @@
+/**
+ @file latest.c
+ @brief Latest-value sends that replace a key's packet while it is still waiting to be sent
+*/
+#include <string.h>
+#define DEVILS_BUILDING_LIB 1
+#include "include/devils.h"
+
+enum
+{
+    DEVILS_LATEST_MINIMUM_BUCKETS = 16
+};
+
+typedef struct _devils_latest_entry
+{
+    struct _devils_latest_entry *next;
+    struct _devils_latest_entry **link; /* pointer that points at this entry, for unlinking it in place */
+    devils_uint32 key;
+    devils_outgoing_command *command; /* queued command carrying the key's latest packet */
+} devils_latest_entry;
+
+typedef struct _devils_latest_table
+{
+    devils_latest_entry **buckets;
+    size_t bucketMask;
+    size_t entryCount;
+} devils_latest_table;
+
+static devils_latest_entry **
+devils_latest_bucket(devils_latest_entry **buckets, size_t bucketMask, devils_uint32 key)
+{
+    devils_uint32 hash = key * 0x9E3779B1U;
+
+    return &buckets[(hash ^ (hash >> 16)) & bucketMask];
+}
+
+static void
+devils_latest_link(devils_latest_entry **bucket, devils_latest_entry *entry)
+{
+    entry->next = *bucket;
+    if (entry->next != NULL)
+        entry->next->link = &entry->next;
+    entry->link = bucket;
+    *bucket = entry;
+}
+
+static devils_latest_table *
+devils_latest_table_use(devils_channel_state *state)
+{
+    devils_latest_table *table = state->latest;
+
+    if (table != NULL)
+        return table;
+
+    table = (devils_latest_table *)devils_malloc(sizeof(devils_latest_table));
+    if (table == NULL)
+        return NULL;
+
+    table->buckets = (devils_latest_entry **)devils_malloc(DEVILS_LATEST_MINIMUM_BUCKETS * sizeof(devils_latest_entry *));
+    if (table->buckets == NULL)
+    {
+        devils_free(table);
+        return NULL;
+    }
+
+    memset(table->buckets, 0, DEVILS_LATEST_MINIMUM_BUCKETS * sizeof(devils_latest_entry *));
+    table->bucketMask = DEVILS_LATEST_MINIMUM_BUCKETS - 1;
+    table->entryCount = 0;
+
+    state->latest = table;
+
+    return table;
+}
+
+/* doubles the buckets once there are as many entries as buckets; failing to only lengthens the chains */
+static void
+devils_latest_table_grow(devils_latest_table *table)
+{
+    size_t bucketCount = (table->bucketMask + 1) * 2, index;
+    devils_latest_entry **buckets, *entry, *nextEntry;
+
+    if (table->entryCount <= table->bucketMask)
+        return;
+
+    buckets = (devils_latest_entry **)devils_malloc(bucketCount * sizeof(devils_latest_entry *));
+    if (buckets == NULL)
+        return;
+
+    memset(buckets, 0, bucketCount * sizeof(devils_latest_entry *));
+
+    for (index = 0; index <= table->bucketMask; ++index)
+    {
+        for (entry = table->buckets[index]; entry != NULL; entry = nextEntry)
+        {
+            nextEntry = entry->next;
+
+            devils_latest_link(devils_latest_bucket(buckets, bucketCount - 1, entry->key), entry);
+        }
+    }
+
+    devils_free(table->buckets);
+
+    table->buckets = buckets;
+    table->bucketMask = bucketCount - 1;
+}
+
+/* the largest packet the peer sends as a single command */
+static size_t
+devils_latest_maximum_length(devils_peer *peer)
+{
+    size_t maximumLength = peer->mtu - sizeof(devils_protocol_header) - sizeof(devils_protocol_send_fragment);
+
+    if (peer->host->checksum != NULL)
+        maximumLength -= sizeof(devils_uint32);
+    if (peer->outgoingPeerID >= DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID)
+        maximumLength -= sizeof(devils_uint32);
+
+    return maximumLength;
+}
+
+/* whether a packet may take the place of a queued command's packet without changing the command's kind */
+static int
+devils_latest_can_replace(devils_peer *peer, const devils_outgoing_command *outgoingCommand, const devils_packet *packet)
+{
+    devils_uint8 commandNumber = outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_MASK;
+
+    if (packet->dataLength > devils_latest_maximum_length(peer))
+        return 0;
+
+    if (packet->flags & DEVILS_PACKET_FLAG_RELIABLE)
+        return commandNumber == DEVILS_PROTOCOL_COMMAND_SEND_RELIABLE;
+
+    if (packet->flags & DEVILS_PACKET_FLAG_UNSEQUENCED)
+        return commandNumber == DEVILS_PROTOCOL_COMMAND_SEND_UNSEQUENCED;
+
+    return commandNumber == DEVILS_PROTOCOL_COMMAND_SEND_UNRELIABLE;
+}
+
+static void
+devils_latest_replace(devils_peer *peer, devils_outgoing_command *outgoingCommand, devils_packet *packet)
+{
+    devils_packet *oldPacket = outgoingCommand->packet;
+
+    /* the queued command was counted towards the outgoing data with the old packet's length */
+    peer->outgoingDataTotal += (devils_uint32)packet->dataLength - outgoingCommand->fragmentLength;
+
+    ++packet->referenceCount;
+    --oldPacket->referenceCount;
+
+    if (oldPacket->referenceCount == 0)
+        devils_packet_destroy(oldPacket);
+
+    outgoingCommand->packet = packet;
+    outgoingCommand->fragmentLength = packet->dataLength;
+    outgoingCommand->enqueueTime = peer->host->serviceTime;
+
+    devils_peer_schedule_expiry(peer, outgoingCommand);
+
+    switch (outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_MASK)
+    {
+    case DEVILS_PROTOCOL_COMMAND_SEND_RELIABLE:
+        outgoingCommand->command.sendReliable.dataLength = DEVILS_HOST_TO_NET_16(packet->dataLength);
+        break;
+
+    case DEVILS_PROTOCOL_COMMAND_SEND_UNRELIABLE:
+        outgoingCommand->command.sendUnreliable.dataLength = DEVILS_HOST_TO_NET_16(packet->dataLength);
+        break;
+
+    case DEVILS_PROTOCOL_COMMAND_SEND_UNSEQUENCED:
+        outgoingCommand->command.sendUnsequenced.dataLength = DEVILS_HOST_TO_NET_16(packet->dataLength);
+        break;
+    }
+}
+
+/** @defgroup latest Latest-value sends
+    @{
+*/
+
+/** Queues a packet that supersedes any earlier packet sent under the same key on the channel.
+    @param peer destination for the packet
+    @param channelID channel on which to send
+    @param key application key, such as an entity ID, naming what the packet describes
+    @param packet packet to send
+    @retval 0 on success
+    @retval < 0 on failure
+    @remarks If the previous packet for the key is still waiting to be sent, the new packet takes its
+    place in the queue, keeping its sequence numbers, so the channel never holds more than one unsent
+    packet per key and the newest one goes out as early as the oldest would have. This needs both
+    packets to be of the same kind (reliable, unreliable or unsequenced) and to fit in a single command;
+    otherwise the earlier packet is sent as usual and the new one is queued behind it. Packets sent with
+    devils_peer_send() on the same channel are ordered with these as usual but are never replaced.
+*/
+int devils_peer_send_latest(devils_peer *peer, devils_uint8 channelID, devils_uint32 key, devils_packet *packet)
+{
+    devils_channel_state *state;
+    devils_latest_table *table;
+    devils_latest_entry **bucket, *entry;
+    devils_outgoing_command *outgoingCommand;
+    devils_list *queue;
+
+    if (peer->state != DEVILS_PEER_STATE_CONNECTED ||
+        channelID >= peer->channelCount ||
+        packet->dataLength > peer->host->maximumPacketSize)
+        return -1;
+
+    state = devils_peer_use_channel(peer, &peer->channels[channelID]);
+    if (state == NULL)
+        return -1;
+
+    table = devils_latest_table_use(state);
+    if (table == NULL)
+        return -1;
+
+    bucket = devils_latest_bucket(table->buckets, table->bucketMask, key);
+    for (entry = *bucket; entry != NULL; entry = entry->next)
+    {
+        if (entry->key != key)
+            continue;
+
+        if (devils_latest_can_replace(peer, entry->command, packet))
+        {
+            devils_latest_replace(peer, entry->command, packet);
+            return 0;
+        }
+
+        devils_peer_latest_release(state, entry->command);
+        break;
+    }
+
+    if (devils_peer_send(peer, channelID, packet) < 0)
+        return -1;
+
+    queue = packet->flags & DEVILS_PACKET_FLAG_RELIABLE ? &state->outgoingReliableCommands : &state->outgoingUnreliableCommands;
+    if (devils_list_empty(queue))
+        return 0;
+
+    outgoingCommand = (devils_outgoing_command *)devils_list_back(queue);
+    if (outgoingCommand->packet != packet || !devils_latest_can_replace(peer, outgoingCommand, packet))
+        return 0;
+
+    entry = (devils_latest_entry *)devils_malloc(sizeof(devils_latest_entry));
+    if (entry == NULL)
+        return 0;
+
+    entry->key = key;
+    entry->command = outgoingCommand;
+    outgoingCommand->latestEntry = entry;
+
+    devils_latest_link(devils_latest_bucket(table->buckets, table->bucketMask, key), entry);
+    ++table->entryCount;
+
+    devils_latest_table_grow(table);
+
+    return 0;
+}
+
+/** @} */
+
+/* forgets a command's key once the command leaves its queue, so a later packet for the key is queued anew */
+void devils_peer_latest_release(devils_channel_state *state, devils_outgoing_command *outgoingCommand)
+{
+    devils_latest_entry *entry = outgoingCommand->latestEntry;
+
+    *entry->link = entry->next;
+    if (entry->next != NULL)
+        entry->next->link = entry->link;
+
+    --state->latest->entryCount;
+
+    outgoingCommand->latestEntry = NULL;
+
+    devils_free(entry);
+}
+
+void devils_peer_latest_destroy(devils_channel_state *state)
+{
+    devils_latest_table *table = state->latest;
+    devils_latest_entry *entry;
+    size_t index;
+
+    if (table == NULL)
+        return;
+
+    for (index = 0; index <= table->bucketMask; ++index)
+    {
+        while (table->buckets[index] != NULL)
+        {
+            entry = table->buckets[index];
+            table->buckets[index] = entry->next;
+
+            devils_free(entry);
+        }
+    }
+
+    devils_free(table->buckets);
+    devils_free(table);
+
+    state->latest = NULL;
+}
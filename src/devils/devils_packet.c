@@ -45,6 +45,9 @@ devils_packet_create(const void *data, size_t dataLength, devils_uint32 flags)
     packet->dataLength = dataLength;
     packet->freeCallback = NULL;
     packet->userData = NULL;
+    packet->timeToLive = 0;
+    packet->chunks = NULL;
+    packet->chunkCount = 0;
 
     return packet;
 }
@@ -59,8 +62,16 @@ void devils_packet_destroy(devils_packet *packet)
 
     if (packet->freeCallback != NULL)
         (*packet->freeCallback)(packet);
-    if (!(packet->flags & DEVILS_PACKET_FLAG_NO_ALLOCATE) &&
-        packet->data != NULL)
+    if (packet->flags & DEVILS_PACKET_FLAG_CHUNKED)
+    {
+        size_t chunkIndex;
+
+        for (chunkIndex = 0; chunkIndex < packet->chunkCount; ++chunkIndex)
+            devils_free(packet->chunks[chunkIndex].data);
+        devils_free(packet->chunks);
+    }
+    else if (!(packet->flags & DEVILS_PACKET_FLAG_NO_ALLOCATE) &&
+             packet->data != NULL)
         devils_free(packet->data);
     devils_free(packet);
 }
@@ -69,12 +80,15 @@ void devils_packet_destroy(devils_packet *packet)
     dataLength parameter 
     @param packet packet to resize
     @param dataLength new size for the packet data
-    @returns 0 on success, < 0 on failure
+    @returns 0 on success, < 0 on failure, which includes packets flagged DEVILS_PACKET_FLAG_CHUNKED
 */
 int devils_packet_resize(devils_packet *packet, size_t dataLength)
 {
     devils_uint8 *newData;
 
+    if (packet->flags & DEVILS_PACKET_FLAG_CHUNKED)
+        return -1;
+
     if (dataLength <= packet->dataLength || (packet->flags & DEVILS_PACKET_FLAG_NO_ALLOCATE))
     {
         packet->dataLength = dataLength;
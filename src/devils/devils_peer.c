@@ -4,6 +4,8 @@
 */
 #include <string.h>
 #define DEVILS_BUILDING_LIB 1
+#include "include/devils_utility.h"
+#include "include/devils_time.h"
 #include "include/devils.h"
 
 /** @defgroup peer ENet peer functions 
@@ -85,6 +87,82 @@ int devils_peer_throttle(devils_peer *peer, devils_uint32 rtt)
   return 0;
 }
 
+/* Queues a single entry standing for every fragment of a reliable packet. The fragments' sequence
+   numbers are reserved now, but each fragment is only allocated once it reaches the front of its
+   channel's queue, so a large packet costs memory in proportion to what is actually in flight. */
+static int
+devils_peer_queue_fragment_cursor(devils_peer *peer, devils_channel *channel, devils_packet *packet, size_t fragmentLength, devils_uint32 fragmentCount)
+{
+  devils_outgoing_command *cursor = (devils_outgoing_command *)devils_malloc(sizeof(devils_outgoing_command));
+
+  if (cursor == NULL)
+    return -1;
+
+  cursor->fragmentOffset = 0;
+  cursor->fragmentLength = fragmentLength;
+  cursor->packet = packet;
+  cursor->command.header.command = DEVILS_PROTOCOL_COMMAND_SEND_FRAGMENT | DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE;
+  if (packet->flags & DEVILS_PACKET_FLAG_STREAM)
+    cursor->command.header.command |= DEVILS_PROTOCOL_COMMAND_FLAG_STREAM;
+  cursor->command.header.channelID = channel - peer->channels;
+  cursor->command.sendFragment.startSequenceNumber = DEVILS_HOST_TO_NET_16(channel->outgoingReliableSequenceNumber + 1);
+  cursor->command.sendFragment.fragmentCount = DEVILS_HOST_TO_NET_32(fragmentCount);
+  cursor->command.sendFragment.totalLength = DEVILS_HOST_TO_NET_32(packet->dataLength);
+
+  ++packet->referenceCount;
+
+  devils_peer_setup_outgoing_command(peer, cursor);
+
+  cursor->fragmentsRemaining = fragmentCount;
+
+  channel->outgoingReliableSequenceNumber += fragmentCount - 1;
+  peer->outgoingDataTotal += (fragmentCount - 1) * sizeof(devils_protocol_send_fragment) + packet->dataLength - fragmentLength;
+
+  return 0;
+}
+
+/** Replaces a fragment cursor at the front of a queue with its next fragment.
+    @returns the fragment, now directly in front of the cursor, or NULL if it could not be allocated
+*/
+devils_outgoing_command *
+devils_peer_next_fragment(devils_outgoing_command *cursor)
+{
+  devils_outgoing_command *fragment = (devils_outgoing_command *)devils_malloc(sizeof(devils_outgoing_command));
+  devils_uint32 totalLength = cursor->packet->dataLength;
+
+  if (fragment == NULL)
+    return NULL;
+
+  *fragment = *cursor;
+  fragment->fragmentsRemaining = 0;
+  if (totalLength - cursor->fragmentOffset < fragment->fragmentLength)
+    fragment->fragmentLength = totalLength - cursor->fragmentOffset;
+  fragment->command.header.reliableSequenceNumber = DEVILS_HOST_TO_NET_16(fragment->reliableSequenceNumber);
+  fragment->command.sendFragment.dataLength = DEVILS_HOST_TO_NET_16(fragment->fragmentLength);
+  fragment->command.sendFragment.fragmentNumber = DEVILS_HOST_TO_NET_32(cursor->fragmentOffset / cursor->fragmentLength);
+  fragment->command.sendFragment.fragmentOffset = DEVILS_HOST_TO_NET_32(cursor->fragmentOffset);
+
+  ++fragment->packet->referenceCount;
+
+  devils_list_insert(&cursor->outgoingCommandList, fragment);
+
+  if (--cursor->fragmentsRemaining == 0)
+  {
+    devils_list_remove(&cursor->outgoingCommandList);
+
+    --cursor->packet->referenceCount;
+
+    devils_free(cursor);
+  }
+  else
+  {
+    ++cursor->reliableSequenceNumber;
+    cursor->fragmentOffset += cursor->fragmentLength;
+  }
+
+  return fragment;
+}
+
 /** Queues a packet to be sent.
     @param peer destination for the packet
     @param channelID channel on which to send
@@ -100,13 +178,19 @@ int devils_peer_send(devils_peer *peer, devils_uint8 channelID, devils_packet *p
 
   if (peer->state != DEVILS_PEER_STATE_CONNECTED ||
       channelID >= peer->channelCount ||
-      packet->dataLength > peer->host->maximumPacketSize)
+      packet->dataLength > peer->host->maximumPacketSize ||
+      packet->flags & DEVILS_PACKET_FLAG_CHUNKED)
     return -1;
 
   channel = &peer->channels[channelID];
+  if (devils_peer_use_channel(peer, channel) == NULL)
+    return -1;
+
   fragmentLength = peer->mtu - sizeof(devils_protocol_header) - sizeof(devils_protocol_send_fragment);
   if (peer->host->checksum != NULL)
     fragmentLength -= sizeof(devils_uint32);
+  if (peer->outgoingPeerID >= DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID)
+    fragmentLength -= sizeof(devils_uint32);
 
   if (packet->dataLength > fragmentLength)
   {
@@ -121,8 +205,11 @@ int devils_peer_send(devils_peer *peer, devils_uint8 channelID, devils_packet *p
     if (fragmentCount > DEVILS_PROTOCOL_MAXIMUM_FRAGMENT_COUNT)
       return -1;
 
+    if (packet->flags & DEVILS_PACKET_FLAG_RELIABLE)
+      return devils_peer_queue_fragment_cursor(peer, channel, packet, fragmentLength, fragmentCount);
+
     if ((packet->flags & (DEVILS_PACKET_FLAG_RELIABLE | DEVILS_PACKET_FLAG_UNRELIABLE_FRAGMENT)) == DEVILS_PACKET_FLAG_UNRELIABLE_FRAGMENT &&
-        channel->outgoingUnreliableSequenceNumber < 0xFFFF)
+        (channel->outgoingUnreliableSequenceNumber < 0xFFFF || peer->flags & DEVILS_PEER_FLAG_SERIAL_UNRELIABLE))
     {
       commandNumber = DEVILS_PROTOCOL_COMMAND_SEND_UNRELIABLE_FRAGMENT;
       startSequenceNumber = DEVILS_HOST_TO_NET_16(channel->outgoingUnreliableSequenceNumber + 1);
@@ -191,10 +278,14 @@ int devils_peer_send(devils_peer *peer, devils_uint8 channelID, devils_packet *p
     command.header.command = DEVILS_PROTOCOL_COMMAND_SEND_UNSEQUENCED | DEVILS_PROTOCOL_COMMAND_FLAG_UNSEQUENCED;
     command.sendUnsequenced.dataLength = DEVILS_HOST_TO_NET_16(packet->dataLength);
   }
-  else if (packet->flags & DEVILS_PACKET_FLAG_RELIABLE || channel->outgoingUnreliableSequenceNumber >= 0xFFFF)
+  else if (packet->flags & DEVILS_PACKET_FLAG_RELIABLE ||
+           (channel->outgoingUnreliableSequenceNumber >= 0xFFFF && !(peer->flags & DEVILS_PEER_FLAG_SERIAL_UNRELIABLE)))
   {
     command.header.command = DEVILS_PROTOCOL_COMMAND_SEND_RELIABLE | DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE;
     command.sendReliable.dataLength = DEVILS_HOST_TO_NET_16(packet->dataLength);
+
+    if (packet->flags & DEVILS_PACKET_FLAG_STREAM)
+      command.header.command |= DEVILS_PROTOCOL_COMMAND_FLAG_STREAM;
   }
   else
   {
@@ -231,9 +322,6 @@ devils_peer_receive(devils_peer *peer, devils_uint8 *channelID)
 
   --packet->referenceCount;
 
-  if (incomingCommand->fragments != NULL)
-    devils_free(incomingCommand->fragments);
-
   devils_free(incomingCommand);
 
   peer->totalWaitingData -= packet->dataLength;
@@ -262,10 +350,26 @@ devils_peer_reset_outgoing_commands(devils_list *queue)
   }
 }
 
+static void
+devils_peer_destroy_incoming_command(devils_incoming_command *incomingCommand)
+{
+  if (incomingCommand->packet != NULL)
+  {
+    --incomingCommand->packet->referenceCount;
+
+    if (incomingCommand->packet->referenceCount == 0)
+      devils_packet_destroy(incomingCommand->packet);
+  }
+
+  devils_reassembly_destroy(incomingCommand->reassembly);
+
+  devils_free(incomingCommand);
+}
+
 static void
 devils_peer_remove_incoming_commands(devils_list *queue, devils_list_iterator startCommand, devils_list_iterator endCommand, devils_incoming_command *excludeCommand)
 {
-  devils_list_iterator currentCommand;
+  devils_list_iterator currentCommand = NULL;
 
   for (currentCommand = startCommand; currentCommand != endCommand;)
   {
@@ -278,18 +382,7 @@ devils_peer_remove_incoming_commands(devils_list *queue, devils_list_iterator st
 
     devils_list_remove(&incomingCommand->incomingCommandList);
 
-    if (incomingCommand->packet != NULL)
-    {
-      --incomingCommand->packet->referenceCount;
-
-      if (incomingCommand->packet->referenceCount == 0)
-        devils_packet_destroy(incomingCommand->packet);
-    }
-
-    if (incomingCommand->fragments != NULL)
-      devils_free(incomingCommand->fragments);
-
-    devils_free(incomingCommand);
+    devils_peer_destroy_incoming_command(incomingCommand);
   }
 }
 
@@ -299,9 +392,55 @@ devils_peer_reset_incoming_commands(devils_list *queue)
   devils_peer_remove_incoming_commands(queue, devils_list_begin(queue), devils_list_end(queue), NULL);
 }
 
+static void
+devils_peer_free_incoming_reliable_ring(devils_peer *peer, devils_channel_state *state)
+{
+  devils_free(state->incomingReliableRing);
+
+  peer->totalWaitingData -= state->incomingReliableRingSize * sizeof(devils_incoming_command *);
+
+  state->incomingReliableRing = NULL;
+  state->incomingReliableRingSize = 0;
+}
+
+static void
+devils_peer_destroy_channel_state(devils_peer *peer, devils_channel *channel)
+{
+  devils_channel_state *state = channel->state;
+  size_t index;
+
+  if (state == NULL)
+    return;
+
+  devils_peer_latest_destroy(state);
+
+  if (state->incomingReliableRing != NULL)
+  {
+    for (index = 0; index < state->incomingReliableRingSize; ++index)
+    {
+      if (state->incomingReliableRing[index] != NULL)
+        devils_peer_destroy_incoming_command(state->incomingReliableRing[index]);
+    }
+
+    devils_peer_free_incoming_reliable_ring(peer, state);
+  }
+
+  devils_peer_reset_incoming_commands(&state->incomingUnreliableCommands);
+  devils_peer_reset_outgoing_commands(&state->outgoingReliableCommands);
+  devils_peer_reset_outgoing_commands(&state->outgoingUnreliableCommands);
+
+  if (state->sentReliableRing != NULL)
+    devils_free(state->sentReliableRing);
+
+  devils_free(state);
+
+  channel->state = NULL;
+}
+
 void devils_peer_reset_queues(devils_peer *peer)
 {
   devils_channel *channel;
+  size_t priority;
 
   if (peer->flags & DEVILS_PEER_FLAG_NEEDS_DISPATCH)
   {
@@ -316,6 +455,7 @@ void devils_peer_reset_queues(devils_peer *peer)
   devils_peer_reset_outgoing_commands(&peer->sentReliableCommands);
   devils_peer_reset_outgoing_commands(&peer->sentUnreliableCommands);
   devils_peer_reset_outgoing_commands(&peer->outgoingCommands);
+  devils_peer_reset_outgoing_commands(&peer->repairCommands);
   devils_peer_reset_incoming_commands(&peer->dispatchedCommands);
 
   if (peer->channels != NULL && peer->channelCount > 0)
@@ -324,17 +464,39 @@ void devils_peer_reset_queues(devils_peer *peer)
          channel < &peer->channels[peer->channelCount];
          ++channel)
     {
-      devils_peer_reset_incoming_commands(&channel->incomingReliableCommands);
-      devils_peer_reset_incoming_commands(&channel->incomingUnreliableCommands);
+      devils_peer_destroy_channel_state(peer, channel);
+      devils_peer_fec_destroy(channel);
     }
 
     devils_free(peer->channels);
   }
 
+  for (priority = 0; priority < DEVILS_PEER_CHANNEL_PRIORITIES; ++priority)
+    devils_list_clear(&peer->activeChannels[priority]);
+
   peer->channels = NULL;
   peer->channelCount = 0;
 }
 
+void devils_peer_reset_congestion_control(devils_peer *peer)
+{
+  devils_host *host = peer->host;
+
+  if (peer->congestionState != NULL)
+  {
+    if (host->congestionControl.destroy != NULL)
+      host->congestionControl.destroy(host->congestionControl.context, peer->congestionState);
+
+    peer->congestionState = NULL;
+  }
+
+  peer->congestionWindow = 0;
+  peer->pacingRate = 0;
+
+  if (peer->state != DEVILS_PEER_STATE_DISCONNECTED && host->congestionControl.create != NULL)
+    peer->congestionState = host->congestionControl.create(host->congestionControl.context, peer);
+}
+
 void devils_peer_on_connect(devils_peer *peer)
 {
   if (peer->state != DEVILS_PEER_STATE_CONNECTED && peer->state != DEVILS_PEER_STATE_DISCONNECT_LATER)
@@ -365,8 +527,17 @@ void devils_peer_on_disconnect(devils_peer *peer)
 void devils_peer_reset(devils_peer *peer)
 {
   devils_peer_on_disconnect(peer);
+  devils_peer_retire_statistics(peer);
+
+  if (peer->state != DEVILS_PEER_STATE_DISCONNECTED)
+  {
+    devils_host_unbind_peer(peer->host, peer);
+    devils_host_leave_groups(peer->host, peer);
+  }
 
-  peer->outgoingPeerID = DEVILS_PROTOCOL_MAXIMUM_PEER_ID;
+  devils_peer_reset_queues(peer);
+
+  peer->outgoingPeerID = DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID;
   peer->connectID = 0;
 
   peer->state = DEVILS_PEER_STATE_DISCONNECTED;
@@ -390,6 +561,9 @@ void devils_peer_reset(devils_peer *peer)
   peer->packetThrottleLimit = DEVILS_PEER_PACKET_THROTTLE_SCALE;
   peer->packetThrottleCounter = 0;
   peer->packetThrottleEpoch = 0;
+  peer->pacingTokens = 0;
+  peer->pacingEpoch = 0;
+  peer->trafficClass = NULL;
   peer->packetThrottleAcceleration = DEVILS_PEER_PACKET_THROTTLE_ACCELERATION;
   peer->packetThrottleDeceleration = DEVILS_PEER_PACKET_THROTTLE_DECELERATION;
   peer->packetThrottleInterval = DEVILS_PEER_PACKET_THROTTLE_INTERVAL;
@@ -409,13 +583,16 @@ void devils_peer_reset(devils_peer *peer)
   peer->windowSize = DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE;
   peer->incomingUnsequencedGroup = 0;
   peer->outgoingUnsequencedGroup = 0;
+  peer->incomingSentTime = 0;
+  peer->migrationChallenge = 0;
+  peer->migrationTime = 0;
   peer->eventData = 0;
   peer->totalWaitingData = 0;
   peer->flags = 0;
 
   memset(peer->unsequencedWindow, 0, sizeof(peer->unsequencedWindow));
 
-  devils_peer_reset_queues(peer);
+  devils_peer_reset_congestion_control(peer);
 }
 
 /** Sends a ping request to a peer.
@@ -549,6 +726,158 @@ void devils_peer_disconnect(devils_peer *peer, devils_uint32 data)
   }
 }
 
+/** Configures how a channel's outgoing packets are scheduled against those of the peer's other channels.
+
+    Each time a datagram is built, channels are served by ascending priority class, so that packets
+    queued on a channel of class 0 are sent ahead of anything waiting on channels of class 1, and so on.
+    Channels within the same class share the datagrams in proportion to their weights by deficit round
+    robin, each being allowed up to weight MTU-sized datagrams worth of commands per round.  Packets of a
+    single channel are always sent in the order they were queued.  Channels default to a priority class of
+    DEVILS_PEER_CHANNEL_DEFAULT_PRIORITY and a weight of DEVILS_PEER_CHANNEL_DEFAULT_WEIGHT.
+
+    @param peer peer to configure
+    @param channelID channel to configure
+    @param priority priority class, less than DEVILS_PEER_CHANNEL_PRIORITIES
+    @param weight share of the priority class, at least 1
+    @retval 0 on success
+    @retval < 0 on failure
+*/
+int devils_peer_channel_priority(devils_peer *peer, devils_uint8 channelID, devils_uint8 priority, devils_uint16 weight)
+{
+  devils_channel *channel;
+
+  if (channelID >= peer->channelCount ||
+      priority >= DEVILS_PEER_CHANNEL_PRIORITIES ||
+      weight < 1)
+    return -1;
+
+  channel = &peer->channels[channelID];
+
+  if (channel->priority != priority && channel->state != NULL &&
+      (!devils_list_empty(&channel->state->outgoingReliableCommands) || !devils_list_empty(&channel->state->outgoingUnreliableCommands)))
+    devils_list_insert(devils_list_end(&peer->activeChannels[priority]), devils_list_remove(&channel->state->activeList));
+
+  channel->priority = priority;
+  channel->weight = weight;
+
+  return 0;
+}
+
+/** Sets whether reliable packets received on a channel are delivered in order.
+    @param peer peer to configure
+    @param channelID channel to configure
+    @param enable nonzero to deliver each reliable packet, fragmented ones included, as soon as it is complete,
+    or 0 to hold it back until every reliable packet sent before it has been delivered
+    @retval 0 on success
+    @retval < 0 on failure
+    @remarks An unordered channel suits independent requests, where a lost datagram should only delay the
+    packets it carried. Duplicates are still discarded, and unreliable packets on the channel still wait
+    for the reliable packets sent before them, as their sequencing follows the reliable packets' order.
+*/
+int devils_peer_channel_unordered(devils_peer *peer, devils_uint8 channelID, int enable)
+{
+  if (channelID >= peer->channelCount)
+    return -1;
+
+  peer->channels[channelID].unordered = enable != 0;
+
+  return 0;
+}
+
+/** Returns the connection state of a peer.
+    @param peer peer to query
+    @returns the peer's current state
+*/
+devils_peer_state devils_peer_get_state(const devils_peer *peer)
+{
+  return peer->state;
+}
+
+/** Returns the Internet address of a peer.
+    @param peer peer to query
+    @returns the address the peer's datagrams are sent to
+*/
+const devils_address *
+devils_peer_get_address(const devils_peer *peer)
+{
+  return &peer->address;
+}
+
+/** Returns the identifier a host uses for a peer.
+    @param peer peer to query
+    @returns the index of the peer within its host, as carried by incoming datagrams
+*/
+devils_uint32 devils_peer_get_id(const devils_peer *peer)
+{
+  return peer->incomingPeerID;
+}
+
+/** Returns the application private data associated with a peer.
+    @param peer peer to query
+    @returns the value last given to devils_peer_set_data(), or NULL
+*/
+void *
+devils_peer_get_data(const devils_peer *peer)
+{
+  return peer->data;
+}
+
+/** Associates application private data with a peer.
+    @param peer peer to modify
+    @param data data to associate with the peer
+*/
+void devils_peer_set_data(devils_peer *peer, void *data)
+{
+  peer->data = data;
+}
+
+/** Returns the number of channels allocated for communication with a peer.
+    @param peer peer to query
+*/
+size_t devils_peer_get_channel_count(const devils_peer *peer)
+{
+  return peer->channelCount;
+}
+
+/** Returns the mean round trip time to a peer.
+    @param peer peer to query
+    @returns mean round trip time, in milliseconds, between sending a reliable packet and receiving its acknowledgement
+*/
+devils_uint32 devils_peer_get_round_trip_time(const devils_peer *peer)
+{
+  return peer->roundTripTime;
+}
+
+/** Returns the mean packet loss to a peer.
+    @param peer peer to query
+    @returns mean packet loss of reliable packets as a ratio with respect to the constant DEVILS_PEER_PACKET_LOSS_SCALE
+*/
+devils_uint32 devils_peer_get_packet_loss(const devils_peer *peer)
+{
+  return peer->packetLoss;
+}
+
+/** Returns the maximum transmission unit negotiated with a peer.
+    @param peer peer to query
+*/
+devils_uint32 devils_peer_get_mtu(const devils_peer *peer)
+{
+  return peer->mtu;
+}
+
+/** Returns the bandwidth limits a peer announced when connecting.
+    @param peer peer to query
+    @param incomingBandwidth if non-NULL, receives the downstream bandwidth of the peer in bytes/second, 0 if unlimited
+    @param outgoingBandwidth if non-NULL, receives the upstream bandwidth of the peer in bytes/second, 0 if unlimited
+*/
+void devils_peer_get_bandwidth(const devils_peer *peer, devils_uint32 *incomingBandwidth, devils_uint32 *outgoingBandwidth)
+{
+  if (incomingBandwidth != NULL)
+    *incomingBandwidth = peer->incomingBandwidth;
+  if (outgoingBandwidth != NULL)
+    *outgoingBandwidth = peer->outgoingBandwidth;
+}
+
 /** Request a disconnection from a peer, but only after all queued outgoing packets are sent.
     @param peer peer to request a disconnection
     @param data data describing the disconnection
@@ -558,8 +887,8 @@ void devils_peer_disconnect(devils_peer *peer, devils_uint32 data)
 void devils_peer_disconnect_later(devils_peer *peer, devils_uint32 data)
 {
   if ((peer->state == DEVILS_PEER_STATE_CONNECTED || peer->state == DEVILS_PEER_STATE_DISCONNECT_LATER) &&
-      !(devils_list_empty(&peer->outgoingCommands) &&
-        devils_list_empty(&peer->sentReliableCommands)))
+      (devils_peer_has_outgoing_commands(peer) ||
+       !devils_list_empty(&peer->sentReliableCommands)))
   {
     peer->state = DEVILS_PEER_STATE_DISCONNECT_LATER;
     peer->eventData = data;
@@ -568,6 +897,16 @@ void devils_peer_disconnect_later(devils_peer *peer, devils_uint32 data)
     devils_peer_disconnect(peer, data);
 }
 
+/* the sequence number whose reorder ring slot a reliable command occupies; fragments share their start command's slot */
+static devils_uint16
+devils_peer_incoming_reliable_slot(const devils_protocol *command)
+{
+  if ((command->header.command & DEVILS_PROTOCOL_COMMAND_MASK) == DEVILS_PROTOCOL_COMMAND_SEND_FRAGMENT)
+    return DEVILS_NET_TO_HOST_16(command->sendFragment.startSequenceNumber);
+
+  return command->header.reliableSequenceNumber;
+}
+
 devils_acknowledgement *
 devils_peer_queue_acknowledgement(devils_peer *peer, const devils_protocol *command, devils_uint16 sentTime)
 {
@@ -584,6 +923,11 @@ devils_peer_queue_acknowledgement(devils_peer *peer, const devils_protocol *comm
 
     if (reliableWindow >= currentWindow + DEVILS_PEER_FREE_RELIABLE_WINDOWS - 1 && reliableWindow <= currentWindow + DEVILS_PEER_FREE_RELIABLE_WINDOWS)
       return NULL;
+
+    /* commands too far ahead for the reorder ring were refused and are left for the sender to retransmit */
+    if (reliableWindow < currentWindow + DEVILS_PEER_FREE_RELIABLE_WINDOWS - 1 &&
+        (devils_uint16)(devils_peer_incoming_reliable_slot(command) - channel->incomingReliableSequenceNumber) > DEVILS_PEER_INCOMING_RELIABLE_RING_MAXIMUM_SIZE)
+      return NULL;
   }
 
   acknowledgement = (devils_acknowledgement *)devils_malloc(sizeof(devils_acknowledgement));
@@ -600,6 +944,27 @@ devils_peer_queue_acknowledgement(devils_peer *peer, const devils_protocol *comm
   return acknowledgement;
 }
 
+/* notes when a queued command's packet runs out of time, so that its channel's queues are swept for it then */
+void devils_peer_schedule_expiry(devils_peer *peer, const devils_outgoing_command *outgoingCommand)
+{
+  devils_channel_state *state;
+  devils_uint32 expiryTime;
+
+  if (outgoingCommand->packet == NULL ||
+      outgoingCommand->packet->timeToLive == 0 ||
+      outgoingCommand->command.header.channelID >= peer->channelCount)
+    return;
+
+  state = peer->channels[outgoingCommand->command.header.channelID].state;
+  expiryTime = outgoingCommand->enqueueTime + outgoingCommand->packet->timeToLive;
+
+  if (!state->expiring || DEVILS_TIME_LESS(expiryTime, state->expiryTime))
+  {
+    state->expiryTime = expiryTime;
+    state->expiring = 1;
+  }
+}
+
 void devils_peer_setup_outgoing_command(devils_peer *peer, devils_outgoing_command *outgoingCommand)
 {
   devils_channel *channel = &peer->channels[outgoingCommand->command.header.channelID];
@@ -621,6 +986,12 @@ void devils_peer_setup_outgoing_command(devils_peer *peer, devils_outgoing_comma
     outgoingCommand->reliableSequenceNumber = channel->outgoingReliableSequenceNumber;
     outgoingCommand->unreliableSequenceNumber = 0;
   }
+  else if ((outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_MASK) == DEVILS_PROTOCOL_COMMAND_SEND_REPAIR)
+  {
+    /* repairs name the commands they protect in their descriptors and take no sequence number of their own */
+    outgoingCommand->reliableSequenceNumber = 0;
+    outgoingCommand->unreliableSequenceNumber = 0;
+  }
   else if (outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_FLAG_UNSEQUENCED)
   {
     ++peer->outgoingUnsequencedGroup;
@@ -637,12 +1008,18 @@ void devils_peer_setup_outgoing_command(devils_peer *peer, devils_outgoing_comma
     outgoingCommand->unreliableSequenceNumber = channel->outgoingUnreliableSequenceNumber;
   }
 
+  outgoingCommand->fragmentsRemaining = 0;
+  outgoingCommand->latestEntry = NULL;
   outgoingCommand->sendAttempts = 0;
   outgoingCommand->sentTime = 0;
   outgoingCommand->roundTripTimeout = 0;
   outgoingCommand->roundTripTimeoutLimit = 0;
+  outgoingCommand->queueTime = ++peer->host->totalQueued;
+  outgoingCommand->enqueueTime = peer->host->serviceTime;
   outgoingCommand->command.header.reliableSequenceNumber = DEVILS_HOST_TO_NET_16(outgoingCommand->reliableSequenceNumber);
 
+  devils_peer_schedule_expiry(peer, outgoingCommand);
+
   switch (outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_MASK)
   {
   case DEVILS_PROTOCOL_COMMAND_SEND_UNRELIABLE:
@@ -657,13 +1034,127 @@ void devils_peer_setup_outgoing_command(devils_peer *peer, devils_outgoing_comma
     break;
   }
 
-  devils_list_insert(devils_list_end(&peer->outgoingCommands), outgoingCommand);
+  devils_peer_insert_outgoing_command(peer, outgoingCommand, 0);
+}
+
+void devils_peer_insert_outgoing_command(devils_peer *peer, devils_outgoing_command *outgoingCommand, int retransmit)
+{
+  devils_channel *channel;
+  devils_channel_state *state;
+  devils_list *queue;
+  devils_list_iterator position;
+
+  if (outgoingCommand->command.header.channelID < peer->channelCount)
+  {
+    channel = &peer->channels[outgoingCommand->command.header.channelID];
+    state = channel->state;
+    queue = outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE ? &state->outgoingReliableCommands : &state->outgoingUnreliableCommands;
+
+    if (devils_list_empty(&state->outgoingReliableCommands) && devils_list_empty(&state->outgoingUnreliableCommands))
+    {
+      devils_list_insert(devils_list_end(&peer->activeChannels[channel->priority]), &state->activeList);
+
+      state->deficit = channel->weight * peer->mtu;
+    }
+  }
+  else
+    queue = &peer->outgoingCommands;
+
+  position = devils_list_end(queue);
+  if (retransmit)
+  {
+    for (position = devils_list_begin(queue);
+         position != devils_list_end(queue);
+         position = devils_list_next(position))
+    {
+      if (((devils_outgoing_command *)position)->sendAttempts < 1)
+        break;
+    }
+  }
+
+  devils_list_insert(position, outgoingCommand);
+}
+
+int devils_peer_has_outgoing_commands(devils_peer *peer)
+{
+  size_t priority;
+
+  if (!devils_list_empty(&peer->outgoingCommands))
+    return 1;
+
+  for (priority = 0; priority < DEVILS_PEER_CHANNEL_PRIORITIES; ++priority)
+  {
+    if (!devils_list_empty(&peer->activeChannels[priority]))
+      return 1;
+  }
+
+  return 0;
+}
+
+devils_channel_state *
+devils_peer_use_channel(devils_peer *peer, devils_channel *channel)
+{
+  devils_channel_state *state = channel->state;
+
+  (void)peer;
+
+  if (state != NULL)
+    return state;
+
+  state = (devils_channel_state *)devils_malloc(sizeof(devils_channel_state));
+  if (state == NULL)
+    return NULL;
+
+  state->channel = channel;
+  memset(state->reliableWindows, 0, sizeof(state->reliableWindows));
+  state->incomingReliableRing = NULL;
+  state->incomingReliableRingSize = 0;
+  state->incomingReliableCount = 0;
+  devils_list_clear(&state->incomingUnreliableCommands);
+  devils_list_clear(&state->outgoingReliableCommands);
+  devils_list_clear(&state->outgoingUnreliableCommands);
+  state->sentReliableRing = NULL;
+  state->sentReliableRingSize = 0;
+  state->deficit = 0;
+  state->latest = NULL;
+  state->expiryTime = 0;
+  state->expiring = 0;
+
+  channel->state = state;
+
+  return state;
+}
+
+void devils_peer_reclaim_channels(devils_peer *peer)
+{
+  devils_channel *channel;
+
+  for (channel = peer->channels;
+       channel < &peer->channels[peer->channelCount];
+       ++channel)
+  {
+    if (channel->state == NULL ||
+        channel->usedReliableWindows != 0 ||
+        channel->state->incomingReliableCount > 0 ||
+        !devils_list_empty(&channel->state->incomingUnreliableCommands) ||
+        !devils_list_empty(&channel->state->outgoingReliableCommands) ||
+        !devils_list_empty(&channel->state->outgoingUnreliableCommands))
+      continue;
+
+    devils_peer_destroy_channel_state(peer, channel);
+  }
 }
 
 devils_outgoing_command *
 devils_peer_queue_outgoing_command(devils_peer *peer, const devils_protocol *command, devils_packet *packet, devils_uint32 offset, devils_uint16 length)
 {
-  devils_outgoing_command *outgoingCommand = (devils_outgoing_command *)devils_malloc(sizeof(devils_outgoing_command));
+  devils_outgoing_command *outgoingCommand;
+
+  if (command->header.channelID < peer->channelCount &&
+      devils_peer_use_channel(peer, &peer->channels[command->header.channelID]) == NULL)
+    return NULL;
+
+  outgoingCommand = (devils_outgoing_command *)devils_malloc(sizeof(devils_outgoing_command));
   if (outgoingCommand == NULL)
     return NULL;
 
@@ -681,10 +1172,11 @@ devils_peer_queue_outgoing_command(devils_peer *peer, const devils_protocol *com
 
 void devils_peer_dispatch_incoming_unreliable_commands(devils_peer *peer, devils_channel *channel, devils_incoming_command *queuedCommand)
 {
+  devils_channel_state *state = channel->state;
   devils_list_iterator droppedCommand, startCommand, currentCommand;
 
-  for (droppedCommand = startCommand = currentCommand = devils_list_begin(&channel->incomingUnreliableCommands);
-       currentCommand != devils_list_end(&channel->incomingUnreliableCommands);
+  for (droppedCommand = startCommand = currentCommand = devils_list_begin(&state->incomingUnreliableCommands);
+       currentCommand != devils_list_end(&state->incomingUnreliableCommands);
        currentCommand = devils_list_next(currentCommand))
   {
     devils_incoming_command *incomingCommand = (devils_incoming_command *)currentCommand;
@@ -757,35 +1249,93 @@ void devils_peer_dispatch_incoming_unreliable_commands(devils_peer *peer, devils
     droppedCommand = currentCommand;
   }
 
-  devils_peer_remove_incoming_commands(&channel->incomingUnreliableCommands, devils_list_begin(&channel->incomingUnreliableCommands), droppedCommand, queuedCommand);
+  devils_peer_remove_incoming_commands(&state->incomingUnreliableCommands, devils_list_begin(&state->incomingUnreliableCommands), droppedCommand, queuedCommand);
+}
+
+/* Hands a complete reliable packet on an unordered channel to the application ahead of its turn. Its
+   command stays in the ring without the packet, so retransmissions are still discarded as duplicates
+   until the channel's sequence passes it. */
+static void
+devils_peer_dispatch_unordered_command(devils_peer *peer, devils_incoming_command *incomingCommand)
+{
+  devils_incoming_command *dispatchedCommand = (devils_incoming_command *)devils_malloc(sizeof(devils_incoming_command));
+
+  if (dispatchedCommand == NULL)
+    return;
+
+  *dispatchedCommand = *incomingCommand;
+  dispatchedCommand->fragments = NULL;
+  dispatchedCommand->reassembly = NULL;
+
+  incomingCommand->packet = NULL;
+
+  devils_list_insert(devils_list_end(&peer->dispatchedCommands), dispatchedCommand);
+
+  if (!(peer->flags & DEVILS_PEER_FLAG_NEEDS_DISPATCH))
+  {
+    devils_list_insert(devils_list_end(&peer->host->dispatchQueue), &peer->dispatchList);
+
+    peer->flags |= DEVILS_PEER_FLAG_NEEDS_DISPATCH;
+  }
 }
 
 void devils_peer_dispatch_incoming_reliable_commands(devils_peer *peer, devils_channel *channel, devils_incoming_command *queuedCommand)
 {
-  devils_list_iterator currentCommand;
+  devils_channel_state *state = channel->state;
+  devils_incoming_command *incomingCommand;
+  devils_incoming_command **slot;
+  int dispatched = 0;
 
-  for (currentCommand = devils_list_begin(&channel->incomingReliableCommands);
-       currentCommand != devils_list_end(&channel->incomingReliableCommands);
-       currentCommand = devils_list_next(currentCommand))
+  if (state == NULL || state->incomingReliableRingSize == 0)
+    return;
+
+  if (channel->unordered &&
+      queuedCommand != NULL &&
+      queuedCommand->packet != NULL &&
+      queuedCommand->fragmentsRemaining == 0 &&
+      queuedCommand->reliableSequenceNumber != (devils_uint16)(channel->incomingReliableSequenceNumber + 1))
+    devils_peer_dispatch_unordered_command(peer, queuedCommand);
+
+  for (;;)
   {
-    devils_incoming_command *incomingCommand = (devils_incoming_command *)currentCommand;
+    slot = &state->incomingReliableRing[(devils_uint16)(channel->incomingReliableSequenceNumber + 1) & (state->incomingReliableRingSize - 1)];
+    incomingCommand = *slot;
 
-    if (incomingCommand->fragmentsRemaining > 0 ||
+    if (incomingCommand == NULL ||
+        incomingCommand->fragmentsRemaining > 0 ||
         incomingCommand->reliableSequenceNumber != (devils_uint16)(channel->incomingReliableSequenceNumber + 1))
       break;
 
+    *slot = NULL;
+    --state->incomingReliableCount;
+
     channel->incomingReliableSequenceNumber = incomingCommand->reliableSequenceNumber;
 
     if (incomingCommand->fragmentCount > 0)
       channel->incomingReliableSequenceNumber += incomingCommand->fragmentCount - 1;
+
+    if (incomingCommand->packet == NULL)
+    {
+      if ((incomingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_MASK) == DEVILS_PROTOCOL_COMMAND_SKIP)
+        channel->incomingReliableSequenceNumber += DEVILS_NET_TO_HOST_32(incomingCommand->command.skip.skipCount) - 1;
+
+      devils_peer_destroy_incoming_command(incomingCommand);
+    }
+    else
+      devils_list_insert(devils_list_end(&peer->dispatchedCommands), incomingCommand);
+
+    dispatched = 1;
   }
 
-  if (currentCommand == devils_list_begin(&channel->incomingReliableCommands))
+  if (!dispatched)
     return;
 
-  channel->incomingUnreliableSequenceNumber = 0;
+  /* a ring grown by a burst of reordering goes back to the minimum once the channel drains */
+  if (state->incomingReliableCount == 0 &&
+      state->incomingReliableRingSize > DEVILS_PEER_INCOMING_RELIABLE_RING_MINIMUM_SIZE)
+    devils_peer_free_incoming_reliable_ring(peer, state);
 
-  devils_list_move(devils_list_end(&peer->dispatchedCommands), devils_list_begin(&channel->incomingReliableCommands), devils_list_previous(currentCommand));
+  channel->incomingUnreliableSequenceNumber = 0;
 
   if (!(peer->flags & DEVILS_PEER_FLAG_NEEDS_DISPATCH))
   {
@@ -794,20 +1344,69 @@ void devils_peer_dispatch_incoming_reliable_commands(devils_peer *peer, devils_c
     peer->flags |= DEVILS_PEER_FLAG_NEEDS_DISPATCH;
   }
 
-  if (!devils_list_empty(&channel->incomingUnreliableCommands))
+  if (!devils_list_empty(&state->incomingUnreliableCommands))
     devils_peer_dispatch_incoming_unreliable_commands(peer, channel, queuedCommand);
 }
 
+/* Grows the reorder ring to hold a command distance ahead of the channel, counting the ring against
+   the peer's waiting data. The caller has already refused commands further ahead than the ring may span. */
+static int
+devils_peer_reserve_incoming_reliable_command(devils_peer *peer, devils_channel *channel, devils_uint16 reliableSequenceNumber)
+{
+  devils_channel_state *state = channel->state;
+  devils_uint16 distance = reliableSequenceNumber - channel->incomingReliableSequenceNumber;
+  devils_incoming_command **ring;
+  size_t size, index;
+
+  if (distance <= state->incomingReliableRingSize)
+    return 1;
+
+  for (size = state->incomingReliableRingSize > 0 ? state->incomingReliableRingSize : DEVILS_PEER_INCOMING_RELIABLE_RING_MINIMUM_SIZE;
+       size < distance;
+       size *= 2)
+    ;
+
+  if ((size - state->incomingReliableRingSize) * sizeof(devils_incoming_command *) > peer->host->maximumWaitingData - DEVILS_MIN(peer->totalWaitingData, peer->host->maximumWaitingData))
+    return 0;
+
+  ring = (devils_incoming_command **)devils_malloc(size * sizeof(devils_incoming_command *));
+  if (ring == NULL)
+    return 0;
+
+  memset(ring, 0, size * sizeof(devils_incoming_command *));
+
+  if (state->incomingReliableRing != NULL)
+  {
+    for (index = 0; index < state->incomingReliableRingSize; ++index)
+    {
+      devils_incoming_command *incomingCommand = state->incomingReliableRing[index];
+
+      if (incomingCommand != NULL)
+        ring[incomingCommand->reliableSequenceNumber & (size - 1)] = incomingCommand;
+    }
+
+    devils_peer_free_incoming_reliable_ring(peer, state);
+  }
+
+  peer->totalWaitingData += size * sizeof(devils_incoming_command *);
+
+  state->incomingReliableRing = ring;
+  state->incomingReliableRingSize = size;
+
+  return 1;
+}
+
 devils_incoming_command *
 devils_peer_queue_incoming_command(devils_peer *peer, const devils_protocol *command, const void *data, size_t dataLength, devils_uint32 flags, devils_uint32 fragmentCount)
 {
   static devils_incoming_command dummyCommand;
 
   devils_channel *channel = &peer->channels[command->header.channelID];
+  devils_channel_state *state;
   devils_uint32 unreliableSequenceNumber = 0, reliableSequenceNumber = 0;
   devils_uint16 reliableWindow, currentWindow;
   devils_incoming_command *incomingCommand;
-  devils_list_iterator currentCommand;
+  devils_list_iterator currentCommand = NULL;
   devils_packet *packet = NULL;
 
   if (peer->state == DEVILS_PEER_STATE_DISCONNECT_LATER)
@@ -826,35 +1425,28 @@ devils_peer_queue_incoming_command(devils_peer *peer, const devils_protocol *com
       goto discardCommand;
   }
 
+  state = devils_peer_use_channel(peer, channel);
+  if (state == NULL)
+    goto notifyError;
+
   switch (command->header.command & DEVILS_PROTOCOL_COMMAND_MASK)
   {
   case DEVILS_PROTOCOL_COMMAND_SEND_FRAGMENT:
   case DEVILS_PROTOCOL_COMMAND_SEND_RELIABLE:
+  case DEVILS_PROTOCOL_COMMAND_SKIP:
     if (reliableSequenceNumber == channel->incomingReliableSequenceNumber)
       goto discardCommand;
 
-    for (currentCommand = devils_list_previous(devils_list_end(&channel->incomingReliableCommands));
-         currentCommand != devils_list_end(&channel->incomingReliableCommands);
-         currentCommand = devils_list_previous(currentCommand))
-    {
-      incomingCommand = (devils_incoming_command *)currentCommand;
-
-      if (reliableSequenceNumber >= channel->incomingReliableSequenceNumber)
-      {
-        if (incomingCommand->reliableSequenceNumber < channel->incomingReliableSequenceNumber)
-          continue;
-      }
-      else if (incomingCommand->reliableSequenceNumber >= channel->incomingReliableSequenceNumber)
-        break;
+    /* Senders may run up to the free reliable windows ahead, further than the ring spans. Such a
+       command is dropped without an acknowledgement, see devils_peer_queue_acknowledgement(). */
+    if ((devils_uint16)(reliableSequenceNumber - channel->incomingReliableSequenceNumber) > DEVILS_PEER_INCOMING_RELIABLE_RING_MAXIMUM_SIZE)
+      goto discardCommand;
 
-      if (incomingCommand->reliableSequenceNumber <= reliableSequenceNumber)
-      {
-        if (incomingCommand->reliableSequenceNumber < reliableSequenceNumber)
-          break;
+    if (!devils_peer_reserve_incoming_reliable_command(peer, channel, reliableSequenceNumber))
+      goto notifyError;
 
-        goto discardCommand;
-      }
-    }
+    if (state->incomingReliableRing[reliableSequenceNumber & (state->incomingReliableRingSize - 1)] != NULL)
+      goto discardCommand;
     break;
 
   case DEVILS_PROTOCOL_COMMAND_SEND_UNRELIABLE:
@@ -862,11 +1454,11 @@ devils_peer_queue_incoming_command(devils_peer *peer, const devils_protocol *com
     unreliableSequenceNumber = DEVILS_NET_TO_HOST_16(command->sendUnreliable.unreliableSequenceNumber);
 
     if (reliableSequenceNumber == channel->incomingReliableSequenceNumber &&
-        unreliableSequenceNumber <= channel->incomingUnreliableSequenceNumber)
+        !DEVILS_PEER_UNRELIABLE_LESS(peer, channel->incomingUnreliableSequenceNumber, unreliableSequenceNumber))
       goto discardCommand;
 
-    for (currentCommand = devils_list_previous(devils_list_end(&channel->incomingUnreliableCommands));
-         currentCommand != devils_list_end(&channel->incomingUnreliableCommands);
+    for (currentCommand = devils_list_previous(devils_list_end(&state->incomingUnreliableCommands));
+         currentCommand != devils_list_end(&state->incomingUnreliableCommands);
          currentCommand = devils_list_previous(currentCommand))
     {
       incomingCommand = (devils_incoming_command *)currentCommand;
@@ -888,9 +1480,9 @@ devils_peer_queue_incoming_command(devils_peer *peer, const devils_protocol *com
       if (incomingCommand->reliableSequenceNumber > reliableSequenceNumber)
         continue;
 
-      if (incomingCommand->unreliableSequenceNumber <= unreliableSequenceNumber)
+      if (!DEVILS_PEER_UNRELIABLE_LESS(peer, unreliableSequenceNumber, incomingCommand->unreliableSequenceNumber))
       {
-        if (incomingCommand->unreliableSequenceNumber < unreliableSequenceNumber)
+        if (incomingCommand->unreliableSequenceNumber != unreliableSequenceNumber)
           break;
 
         goto discardCommand;
@@ -899,7 +1491,7 @@ devils_peer_queue_incoming_command(devils_peer *peer, const devils_protocol *com
     break;
 
   case DEVILS_PROTOCOL_COMMAND_SEND_UNSEQUENCED:
-    currentCommand = devils_list_end(&channel->incomingUnreliableCommands);
+    currentCommand = devils_list_end(&state->incomingUnreliableCommands);
     break;
 
   default:
@@ -909,9 +1501,15 @@ devils_peer_queue_incoming_command(devils_peer *peer, const devils_protocol *com
   if (peer->totalWaitingData >= peer->host->maximumWaitingData)
     goto notifyError;
 
-  packet = devils_packet_create(data, dataLength, flags);
-  if (packet == NULL)
-    goto notifyError;
+  if ((command->header.command & DEVILS_PROTOCOL_COMMAND_MASK) != DEVILS_PROTOCOL_COMMAND_SKIP)
+  {
+    if (fragmentCount > 0)
+      packet = devils_packet_create(NULL, dataLength, flags | DEVILS_PACKET_FLAG_NO_ALLOCATE);
+    else
+      packet = devils_packet_create(data, dataLength, flags);
+    if (packet == NULL)
+      goto notifyError;
+  }
 
   incomingCommand = (devils_incoming_command *)devils_malloc(sizeof(devils_incoming_command));
   if (incomingCommand == NULL)
@@ -924,37 +1522,42 @@ devils_peer_queue_incoming_command(devils_peer *peer, const devils_protocol *com
   incomingCommand->fragmentsRemaining = fragmentCount;
   incomingCommand->packet = packet;
   incomingCommand->fragments = NULL;
+  incomingCommand->reassembly = NULL;
 
   if (fragmentCount > 0)
   {
     if (fragmentCount <= DEVILS_PROTOCOL_MAXIMUM_FRAGMENT_COUNT)
-      incomingCommand->fragments = (devils_uint32 *)devils_malloc((fragmentCount + 31) / 32 * sizeof(devils_uint32));
-    if (incomingCommand->fragments == NULL)
+      incomingCommand->reassembly = devils_reassembly_create(peer, dataLength, fragmentCount, &incomingCommand->fragments);
+    if (incomingCommand->reassembly == NULL)
     {
       devils_free(incomingCommand);
 
       goto notifyError;
     }
-    memset(incomingCommand->fragments, 0, (fragmentCount + 31) / 32 * sizeof(devils_uint32));
   }
 
   if (packet != NULL)
   {
     ++packet->referenceCount;
 
-    peer->totalWaitingData += packet->dataLength;
+    if (fragmentCount == 0)
+      peer->totalWaitingData += packet->dataLength;
   }
 
-  devils_list_insert(devils_list_next(currentCommand), incomingCommand);
-
   switch (command->header.command & DEVILS_PROTOCOL_COMMAND_MASK)
   {
   case DEVILS_PROTOCOL_COMMAND_SEND_FRAGMENT:
   case DEVILS_PROTOCOL_COMMAND_SEND_RELIABLE:
+  case DEVILS_PROTOCOL_COMMAND_SKIP:
+    state->incomingReliableRing[reliableSequenceNumber & (state->incomingReliableRingSize - 1)] = incomingCommand;
+    ++state->incomingReliableCount;
+
     devils_peer_dispatch_incoming_reliable_commands(peer, channel, incomingCommand);
     break;
 
   default:
+    devils_list_insert(devils_list_next(currentCommand), incomingCommand);
+
     devils_peer_dispatch_incoming_unreliable_commands(peer, channel, incomingCommand);
     break;
   }
@@ -962,6 +1565,8 @@ devils_peer_queue_incoming_command(devils_peer *peer, const devils_protocol *com
   return incomingCommand;
 
 discardCommand:
+  ++peer->counters.commandsDropped;
+
   if (fragmentCount > 0)
     goto notifyError;
 
@@ -9,6 +9,19 @@
 #include "include/devils_time.h"
 #include "include/devils.h"
 
+typedef enum _devils_protocol_queue_status
+{
+  DEVILS_PROTOCOL_QUEUE_DRAINED = 0,          /* nothing more in the queue can be sent right now */
+  DEVILS_PROTOCOL_QUEUE_DATAGRAM_FULL = 1,    /* the next command does not fit in the datagram being built */
+  DEVILS_PROTOCOL_QUEUE_DEFICIT_EXHAUSTED = 2 /* the channel used up its round-robin share */
+} devils_protocol_queue_status;
+
+enum
+{
+  DEVILS_PROTOCOL_SENT_RELIABLE_RING_MINIMUM_SIZE = 64,
+  DEVILS_PROTOCOL_SENT_RELIABLE_RING_MAXIMUM_SIZE = 65536
+};
+
 static size_t commandSizes[DEVILS_PROTOCOL_COMMAND_COUNT] =
     {
         0,
@@ -23,7 +36,10 @@ static size_t commandSizes[DEVILS_PROTOCOL_COMMAND_COUNT] =
         sizeof(devils_protocol_send_unsequenced),
         sizeof(devils_protocol_bandwidth_limit),
         sizeof(devils_protocol_throttle_configure),
-        sizeof(devils_protocol_send_fragment)};
+        sizeof(devils_protocol_send_fragment),
+        sizeof(devils_protocol_send_repair),
+        sizeof(devils_protocol_connect_cookie),
+        sizeof(devils_protocol_skip)};
 
 size_t
 devils_protocol_command_size(devils_uint8 commandNumber)
@@ -186,34 +202,107 @@ devils_protocol_remove_sent_unreliable_commands(devils_peer *peer)
   } while (!devils_list_empty(&peer->sentUnreliableCommands));
 
   if (peer->state == DEVILS_PEER_STATE_DISCONNECT_LATER &&
-      devils_list_empty(&peer->outgoingCommands) &&
+      !devils_peer_has_outgoing_commands(peer) &&
       devils_list_empty(&peer->sentReliableCommands))
     devils_peer_disconnect(peer, peer->eventData);
 }
 
+static int
+devils_protocol_reserve_sent_reliable_command(devils_channel_state *state, devils_uint16 reliableSequenceNumber)
+{
+  devils_outgoing_command **ring;
+  size_t size = state->sentReliableRingSize, index;
+
+  if (size > 0 && state->sentReliableRing[reliableSequenceNumber & (size - 1)] == NULL)
+    return 1;
+
+  for (size = size > 0 ? size * 2 : DEVILS_PROTOCOL_SENT_RELIABLE_RING_MINIMUM_SIZE;
+       size <= DEVILS_PROTOCOL_SENT_RELIABLE_RING_MAXIMUM_SIZE;
+       size *= 2)
+  {
+    ring = (devils_outgoing_command **)devils_malloc(size * sizeof(devils_outgoing_command *));
+    if (ring == NULL)
+      return 0;
+
+    memset(ring, 0, size * sizeof(devils_outgoing_command *));
+
+    for (index = 0; index < state->sentReliableRingSize; ++index)
+    {
+      devils_outgoing_command *outgoingCommand = state->sentReliableRing[index];
+
+      if (outgoingCommand == NULL)
+        continue;
+
+      if (ring[outgoingCommand->reliableSequenceNumber & (size - 1)] != NULL)
+        break;
+
+      ring[outgoingCommand->reliableSequenceNumber & (size - 1)] = outgoingCommand;
+    }
+
+    if (index >= state->sentReliableRingSize && ring[reliableSequenceNumber & (size - 1)] == NULL)
+    {
+      if (state->sentReliableRing != NULL)
+        devils_free(state->sentReliableRing);
+
+      state->sentReliableRing = ring;
+      state->sentReliableRingSize = size;
+
+      return 1;
+    }
+
+    devils_free(ring);
+  }
+
+  return 0;
+}
+
 static devils_protocol_command
 devils_protocol_remove_sent_reliable_command(devils_peer *peer, devils_uint16 reliableSequenceNumber, devils_uint8 channelID)
 {
+  devils_channel *channel = channelID < peer->channelCount ? &peer->channels[channelID] : NULL;
+  devils_channel_state *state = channel != NULL ? channel->state : NULL;
   devils_outgoing_command *outgoingCommand = NULL;
   devils_list_iterator currentCommand;
   devils_protocol_command commandNumber;
   int wasSent = 1;
 
-  for (currentCommand = devils_list_begin(&peer->sentReliableCommands);
-       currentCommand != devils_list_end(&peer->sentReliableCommands);
-       currentCommand = devils_list_next(currentCommand))
+  if (channel != NULL)
   {
-    outgoingCommand = (devils_outgoing_command *)currentCommand;
+    if (state == NULL)
+      return DEVILS_PROTOCOL_COMMAND_NONE;
 
-    if (outgoingCommand->reliableSequenceNumber == reliableSequenceNumber &&
-        outgoingCommand->command.header.channelID == channelID)
-      break;
+    if (state->sentReliableRingSize > 0)
+    {
+      devils_outgoing_command **slot = &state->sentReliableRing[reliableSequenceNumber & (state->sentReliableRingSize - 1)];
+
+      if (*slot != NULL && (*slot)->reliableSequenceNumber == reliableSequenceNumber)
+      {
+        outgoingCommand = *slot;
+        *slot = NULL;
+      }
+    }
+  }
+  else
+  {
+    for (currentCommand = devils_list_begin(&peer->sentReliableCommands);
+         currentCommand != devils_list_end(&peer->sentReliableCommands);
+         currentCommand = devils_list_next(currentCommand))
+    {
+      if (((devils_outgoing_command *)currentCommand)->reliableSequenceNumber == reliableSequenceNumber &&
+          ((devils_outgoing_command *)currentCommand)->command.header.channelID == channelID)
+      {
+        outgoingCommand = (devils_outgoing_command *)currentCommand;
+        break;
+      }
+    }
   }
 
-  if (currentCommand == devils_list_end(&peer->sentReliableCommands))
+  if (outgoingCommand == NULL)
   {
-    for (currentCommand = devils_list_begin(&peer->outgoingCommands);
-         currentCommand != devils_list_end(&peer->outgoingCommands);
+    devils_list *queue = channel != NULL ? &state->outgoingReliableCommands : &peer->outgoingCommands;
+
+    for (currentCommand = devils_list_begin(queue);
+         currentCommand != devils_list_end(queue);
          currentCommand = devils_list_next(currentCommand))
     {
       outgoingCommand = (devils_outgoing_command *)currentCommand;
@@ -229,23 +318,19 @@ devils_protocol_remove_sent_reliable_command(devils_peer *peer, devils_uint16 re
         break;
     }
 
-    if (currentCommand == devils_list_end(&peer->outgoingCommands))
+    if (currentCommand == devils_list_end(queue))
       return DEVILS_PROTOCOL_COMMAND_NONE;
 
     wasSent = 0;
   }
 
-  if (outgoingCommand == NULL)
-    return DEVILS_PROTOCOL_COMMAND_NONE;
-
-  if (channelID < peer->channelCount)
+  if (channel != NULL)
   {
-    devils_channel *channel = &peer->channels[channelID];
     devils_uint16 reliableWindow = reliableSequenceNumber / DEVILS_PEER_RELIABLE_WINDOW_SIZE;
-    if (channel->reliableWindows[reliableWindow] > 0)
+    if (state->reliableWindows[reliableWindow] > 0)
     {
-      --channel->reliableWindows[reliableWindow];
-      if (!channel->reliableWindows[reliableWindow])
+      --state->reliableWindows[reliableWindow];
+      if (!state->reliableWindows[reliableWindow])
         channel->usedReliableWindows &= ~(1 << reliableWindow);
     }
   }
@@ -254,6 +339,15 @@ devils_protocol_remove_sent_reliable_command(devils_peer *peer, devils_uint16 re
 
   devils_list_remove(&outgoingCommand->outgoingCommandList);
 
+  if (!wasSent && channel != NULL)
+  {
+    if (devils_list_empty(&state->outgoingReliableCommands) && devils_list_empty(&state->outgoingUnreliableCommands))
+    {
+      devils_list_remove(&state->activeList);
+      state->deficit = 0;
+    }
+  }
+
   if (outgoingCommand->packet != NULL)
   {
     if (wasSent)
@@ -281,33 +375,83 @@ devils_protocol_remove_sent_reliable_command(devils_peer *peer, devils_uint16 re
   return commandNumber;
 }
 
+static void
+devils_protocol_reply_connect_cookie(devils_host *host, devils_uint32 outgoingPeerID, const devils_protocol *command)
+{
+  devils_uint8 replyData[sizeof(devils_uint16) + sizeof(devils_uint32) + sizeof(devils_uint32) + sizeof(devils_protocol_connect_cookie)];
+  devils_protocol_connect_cookie *reply;
+  devils_uint32 cookie[2];
+  devils_buffer buffer;
+  size_t replyLength = sizeof(devils_uint16);
+  int sentLength;
+
+  if (outgoingPeerID >= DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID)
+  {
+    *(devils_uint16 *)replyData = DEVILS_HOST_TO_NET_16(DEVILS_PROTOCOL_EXTENDED_PEER_ID);
+    *(devils_uint32 *)&replyData[replyLength] = DEVILS_HOST_TO_NET_32(outgoingPeerID);
+    replyLength += sizeof(devils_uint32);
+  }
+  else
+    *(devils_uint16 *)replyData = DEVILS_HOST_TO_NET_16(outgoingPeerID);
+
+  if (host->checksum != NULL)
+    replyLength += sizeof(devils_uint32);
+
+  reply = (devils_protocol_connect_cookie *)&replyData[replyLength];
+  reply->header.command = DEVILS_PROTOCOL_COMMAND_CONNECT_COOKIE;
+  reply->header.channelID = 0xFF;
+  reply->header.reliableSequenceNumber = 0;
+  reply->connectID = command->connect.connectID;
+  devils_host_cookie_generate(host, &host->receivedAddress, command->connect.connectID, cookie);
+  reply->cookie[0] = cookie[0];
+  reply->cookie[1] = cookie[1];
+  replyLength += sizeof(devils_protocol_connect_cookie);
+
+  buffer.data = replyData;
+  buffer.dataLength = replyLength;
+
+  if (host->checksum != NULL)
+  {
+    devils_uint32 *checksum = (devils_uint32 *)&replyData[replyLength - sizeof(devils_protocol_connect_cookie) - sizeof(devils_uint32)];
+    *checksum = command->connect.connectID;
+    *checksum = host->checksum(&buffer, 1);
+  }
+
+  sentLength = devils_socket_send(host->socket, &host->receivedAddress, &buffer, 1);
+  if (sentLength > 0)
+  {
+    host->totalSentData += sentLength;
+    host->totalSentPackets++;
+    host->counters.bytesSent += sentLength;
+    ++host->counters.packetsSent;
+  }
+}
+
 static devils_peer *
-devils_protocol_handle_connect(devils_host *host, devils_protocol_header *header, devils_protocol *command)
+devils_protocol_handle_connect(devils_host *host, devils_protocol_header *header, devils_protocol *command, devils_uint8 **currentData)
 {
   devils_uint8 incomingSessionID, outgoingSessionID;
-  devils_uint32 mtu, windowSize;
+  devils_uint32 mtu, windowSize, outgoingPeerID;
   devils_channel *channel;
   size_t channelCount, duplicatePeers = 0;
   devils_peer *currentPeer, *peer = NULL;
   devils_protocol verifyCommand;
 
   channelCount = DEVILS_NET_TO_HOST_32(command->connect.channelCount);
+  outgoingPeerID = (channelCount >> DEVILS_PROTOCOL_CONNECT_PEER_ID_SHIFT) << 16 | DEVILS_NET_TO_HOST_16(command->connect.outgoingPeerID);
+  channelCount &= DEVILS_PROTOCOL_CONNECT_CHANNEL_COUNT_MASK;
 
   if (channelCount < DEVILS_PROTOCOL_MINIMUM_CHANNEL_COUNT ||
-      channelCount > DEVILS_PROTOCOL_MAXIMUM_CHANNEL_COUNT)
+      channelCount > DEVILS_PROTOCOL_MAXIMUM_CHANNEL_COUNT ||
+      outgoingPeerID >= DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID)
     return NULL;
 
-  for (currentPeer = host->peers;
-       currentPeer < &host->peers[host->peerCount];
-       ++currentPeer)
+  for (currentPeer = devils_host_address_peers(host, host->receivedAddress.host);
+       currentPeer != NULL;
+       currentPeer = currentPeer->nextPeer)
   {
-    if (currentPeer->state == DEVILS_PEER_STATE_DISCONNECTED)
-    {
-      if (peer == NULL)
-        peer = currentPeer;
-    }
-    else if (currentPeer->state != DEVILS_PEER_STATE_CONNECTING &&
-             currentPeer->address.host == host->receivedAddress.host)
+    if (currentPeer->state != DEVILS_PEER_STATE_CONNECTING &&
+        currentPeer->address.host == host->receivedAddress.host)
     {
       if (currentPeer->address.port == host->receivedAddress.port &&
           currentPeer->connectID == command->connect.connectID)
@@ -317,6 +461,35 @@ devils_protocol_handle_connect(devils_host *host, devils_protocol_header *header
     }
   }
 
+  if (host->cookies != NULL)
+  {
+    devils_protocol *cookieCommand = (devils_protocol *)*currentData;
+    devils_uint32 cookie[2];
+
+    /* a peer that has not yet echoed a cookie for its address is answered without allocating any state */
+    if (*currentData + sizeof(devils_protocol_connect_cookie) <= &host->receivedData[host->receivedDataLength] &&
+        (cookieCommand->header.command & DEVILS_PROTOCOL_COMMAND_MASK) == DEVILS_PROTOCOL_COMMAND_CONNECT_COOKIE &&
+        cookieCommand->connectCookie.connectID == command->connect.connectID)
+    {
+      cookie[0] = cookieCommand->connectCookie.cookie[0];
+      cookie[1] = cookieCommand->connectCookie.cookie[1];
+    }
+    else
+      cookie[0] = cookie[1] = 0;
+
+    if (!devils_host_cookie_verify(host, &host->receivedAddress, command->connect.connectID, cookie))
+    {
+      devils_protocol_reply_connect_cookie(host, outgoingPeerID, command);
+      return NULL;
+    }
+
+    *currentData += sizeof(devils_protocol_connect_cookie);
+
+    if (!devils_host_cookie_admit(host, &host->receivedAddress))
+      return NULL;
+  }
+
+  peer = devils_host_free_peer(host, DEVILS_NET_TO_HOST_16(header->peerID) & DEVILS_PROTOCOL_HEADER_FLAG_EXTENDED_PEER_ID);
   if (peer == NULL || duplicatePeers >= host->duplicatePeers)
     return NULL;
 
@@ -329,13 +502,22 @@ devils_protocol_handle_connect(devils_host *host, devils_protocol_header *header
   peer->state = DEVILS_PEER_STATE_ACKNOWLEDGING_CONNECT;
   peer->connectID = command->connect.connectID;
   peer->address = host->receivedAddress;
-  peer->outgoingPeerID = DEVILS_NET_TO_HOST_16(command->connect.outgoingPeerID);
+  devils_host_bind_peer(host, peer);
+  peer->outgoingPeerID = outgoingPeerID;
   peer->incomingBandwidth = DEVILS_NET_TO_HOST_32(command->connect.incomingBandwidth);
   peer->outgoingBandwidth = DEVILS_NET_TO_HOST_32(command->connect.outgoingBandwidth);
   peer->packetThrottleInterval = DEVILS_NET_TO_HOST_32(command->connect.packetThrottleInterval);
   peer->packetThrottleAcceleration = DEVILS_NET_TO_HOST_32(command->connect.packetThrottleAcceleration);
   peer->packetThrottleDeceleration = DEVILS_NET_TO_HOST_32(command->connect.packetThrottleDeceleration);
   peer->eventData = DEVILS_NET_TO_HOST_32(command->connect.data);
+  if (command->header.command & DEVILS_PROTOCOL_COMMAND_FLAG_SERIAL_UNRELIABLE)
+    peer->flags |= DEVILS_PEER_FLAG_SERIAL_UNRELIABLE;
+  if (command->header.command & DEVILS_PROTOCOL_COMMAND_FLAG_WINDOW_SCALE)
+    peer->flags |= DEVILS_PEER_FLAG_WINDOW_SCALE;
+  if (command->header.command & DEVILS_PROTOCOL_COMMAND_FLAG_SKIP)
+    peer->flags |= DEVILS_PEER_FLAG_SKIP | DEVILS_PEER_FLAG_REPAIR;
+
+  devils_peer_reset_congestion_control(peer);
 
   incomingSessionID = command->connect.incomingSessionID == 0xFF ? peer->outgoingSessionID : command->connect.incomingSessionID;
   incomingSessionID = (incomingSessionID + 1) & (DEVILS_PROTOCOL_HEADER_SESSION_MASK >> DEVILS_PROTOCOL_HEADER_SESSION_SHIFT);
@@ -358,11 +540,12 @@ devils_protocol_handle_connect(devils_host *host, devils_protocol_header *header
     channel->incomingReliableSequenceNumber = 0;
     channel->incomingUnreliableSequenceNumber = 0;
 
-    devils_list_clear(&channel->incomingReliableCommands);
-    devils_list_clear(&channel->incomingUnreliableCommands);
-
     channel->usedReliableWindows = 0;
-    memset(channel->reliableWindows, 0, sizeof(channel->reliableWindows));
+    channel->priority = DEVILS_PEER_CHANNEL_DEFAULT_PRIORITY;
+    channel->weight = DEVILS_PEER_CHANNEL_DEFAULT_WEIGHT;
+    channel->unordered = 0;
+    channel->state = NULL;
+    channel->fec = NULL;
   }
 
   mtu = DEVILS_NET_TO_HOST_32(command->connect.mtu);
@@ -376,7 +559,7 @@ devils_protocol_handle_connect(devils_host *host, devils_protocol_header *header
 
   if (host->outgoingBandwidth == 0 &&
       peer->incomingBandwidth == 0)
-    peer->windowSize = DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE;
+    peer->windowSize = DEVILS_PEER_MAXIMUM_WINDOW_SIZE(peer);
   else if (host->outgoingBandwidth == 0 ||
            peer->incomingBandwidth == 0)
     peer->windowSize = (DEVILS_MAX(host->outgoingBandwidth, peer->incomingBandwidth) /
@@ -389,11 +572,11 @@ devils_protocol_handle_connect(devils_host *host, devils_protocol_header *header
 
   if (peer->windowSize < DEVILS_PROTOCOL_MINIMUM_WINDOW_SIZE)
     peer->windowSize = DEVILS_PROTOCOL_MINIMUM_WINDOW_SIZE;
-  else if (peer->windowSize > DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE)
-    peer->windowSize = DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE;
+  else if (peer->windowSize > DEVILS_PEER_MAXIMUM_WINDOW_SIZE(peer))
+    peer->windowSize = DEVILS_PEER_MAXIMUM_WINDOW_SIZE(peer);
 
   if (host->incomingBandwidth == 0)
-    windowSize = DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE;
+    windowSize = DEVILS_PEER_MAXIMUM_WINDOW_SIZE(peer);
   else
     windowSize = (host->incomingBandwidth / DEVILS_PEER_WINDOW_SIZE_SCALE) *
                  DEVILS_PROTOCOL_MINIMUM_WINDOW_SIZE;
@@ -403,17 +586,23 @@ devils_protocol_handle_connect(devils_host *host, devils_protocol_header *header
 
   if (windowSize < DEVILS_PROTOCOL_MINIMUM_WINDOW_SIZE)
     windowSize = DEVILS_PROTOCOL_MINIMUM_WINDOW_SIZE;
-  else if (windowSize > DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE)
-    windowSize = DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE;
+  else if (windowSize > DEVILS_PEER_MAXIMUM_WINDOW_SIZE(peer))
+    windowSize = DEVILS_PEER_MAXIMUM_WINDOW_SIZE(peer);
 
   verifyCommand.header.command = DEVILS_PROTOCOL_COMMAND_VERIFY_CONNECT | DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE;
+  if (peer->flags & DEVILS_PEER_FLAG_SERIAL_UNRELIABLE)
+    verifyCommand.header.command |= DEVILS_PROTOCOL_COMMAND_FLAG_SERIAL_UNRELIABLE;
+  if (peer->flags & DEVILS_PEER_FLAG_WINDOW_SCALE)
+    verifyCommand.header.command |= DEVILS_PROTOCOL_COMMAND_FLAG_WINDOW_SCALE;
+  if (peer->flags & DEVILS_PEER_FLAG_SKIP)
+    verifyCommand.header.command |= DEVILS_PROTOCOL_COMMAND_FLAG_SKIP;
   verifyCommand.header.channelID = 0xFF;
-  verifyCommand.verifyConnect.outgoingPeerID = DEVILS_HOST_TO_NET_16(peer->incomingPeerID);
+  verifyCommand.verifyConnect.outgoingPeerID = DEVILS_HOST_TO_NET_16((devils_uint16)peer->incomingPeerID);
   verifyCommand.verifyConnect.incomingSessionID = incomingSessionID;
   verifyCommand.verifyConnect.outgoingSessionID = outgoingSessionID;
   verifyCommand.verifyConnect.mtu = DEVILS_HOST_TO_NET_32(peer->mtu);
   verifyCommand.verifyConnect.windowSize = DEVILS_HOST_TO_NET_32(windowSize);
-  verifyCommand.verifyConnect.channelCount = DEVILS_HOST_TO_NET_32(channelCount);
+  verifyCommand.verifyConnect.channelCount = DEVILS_HOST_TO_NET_32(channelCount | (peer->incomingPeerID >> 16) << DEVILS_PROTOCOL_CONNECT_PEER_ID_SHIFT);
   verifyCommand.verifyConnect.incomingBandwidth = DEVILS_HOST_TO_NET_32(host->incomingBandwidth);
   verifyCommand.verifyConnect.outgoingBandwidth = DEVILS_HOST_TO_NET_32(host->outgoingBandwidth);
   verifyCommand.verifyConnect.packetThrottleInterval = DEVILS_HOST_TO_NET_32(peer->packetThrottleInterval);
@@ -442,29 +631,39 @@ devils_protocol_handle_send_reliable(devils_host *host, devils_peer *peer, const
       *currentData > &host->receivedData[host->receivedDataLength])
     return -1;
 
-  if (devils_peer_queue_incoming_command(peer, command, (const devils_uint8 *)command + sizeof(devils_protocol_send_reliable), dataLength, DEVILS_PACKET_FLAG_RELIABLE, 0) == NULL)
+  if (devils_peer_queue_incoming_command(peer, command, (const devils_uint8 *)command + sizeof(devils_protocol_send_reliable), dataLength,
+                                        command->header.command & DEVILS_PROTOCOL_COMMAND_FLAG_STREAM ? DEVILS_PACKET_FLAG_RELIABLE | DEVILS_PACKET_FLAG_STREAM : DEVILS_PACKET_FLAG_RELIABLE, 0) == NULL)
     return -1;
 
   return 0;
 }
 
 static int
-devils_protocol_handle_send_unsequenced(devils_host *host, devils_peer *peer, const devils_protocol *command, devils_uint8 **currentData)
+devils_protocol_handle_skip(devils_host *host, devils_peer *peer, const devils_protocol *command)
 {
-  devils_uint32 unsequencedGroup, index;
-  size_t dataLength;
+  devils_uint32 skipCount;
+
+  (void)host;
 
   if (command->header.channelID >= peer->channelCount ||
       (peer->state != DEVILS_PEER_STATE_CONNECTED && peer->state != DEVILS_PEER_STATE_DISCONNECT_LATER))
     return -1;
 
-  dataLength = DEVILS_NET_TO_HOST_16(command->sendUnsequenced.dataLength);
-  *currentData += dataLength;
-  if (dataLength > host->maximumPacketSize ||
-      *currentData < host->receivedData ||
-      *currentData > &host->receivedData[host->receivedDataLength])
+  skipCount = DEVILS_NET_TO_HOST_32(command->skip.skipCount);
+  if (skipCount == 0 || skipCount > DEVILS_PEER_RELIABLE_WINDOW_SIZE)
+    return -1;
+
+  if (devils_peer_queue_incoming_command(peer, command, NULL, 0, DEVILS_PACKET_FLAG_RELIABLE, 0) == NULL)
     return -1;
 
+  return 0;
+}
+
+static int
+devils_protocol_queue_unsequenced(devils_peer *peer, const devils_protocol *command, const devils_uint8 *data, size_t dataLength)
+{
+  devils_uint32 unsequencedGroup, index;
+
   unsequencedGroup = DEVILS_NET_TO_HOST_16(command->sendUnsequenced.unsequencedGroup);
   index = unsequencedGroup % DEVILS_PEER_UNSEQUENCED_WINDOW_SIZE;
 
@@ -472,7 +671,10 @@ devils_protocol_handle_send_unsequenced(devils_host *host, devils_peer *peer, co
     unsequencedGroup += 0x10000;
 
   if (unsequencedGroup >= (devils_uint32)peer->incomingUnsequencedGroup + DEVILS_PEER_FREE_UNSEQUENCED_WINDOWS * DEVILS_PEER_UNSEQUENCED_WINDOW_SIZE)
+  {
+    ++peer->counters.commandsDropped;
     return 0;
+  }
 
   unsequencedGroup &= 0xFFFF;
 
@@ -483,9 +685,12 @@ devils_protocol_handle_send_unsequenced(devils_host *host, devils_peer *peer, co
     memset(peer->unsequencedWindow, 0, sizeof(peer->unsequencedWindow));
   }
   else if (peer->unsequencedWindow[index / 32] & (1 << (index % 32)))
+  {
+    ++peer->counters.commandsDropped;
     return 0;
+  }
 
-  if (devils_peer_queue_incoming_command(peer, command, (const devils_uint8 *)command + sizeof(devils_protocol_send_unsequenced), dataLength, DEVILS_PACKET_FLAG_UNSEQUENCED, 0) == NULL)
+  if (devils_peer_queue_incoming_command(peer, command, data, dataLength, DEVILS_PACKET_FLAG_UNSEQUENCED, 0) == NULL)
     return -1;
 
   peer->unsequencedWindow[index / 32] |= 1 << (index % 32);
@@ -493,9 +698,34 @@ devils_protocol_handle_send_unsequenced(devils_host *host, devils_peer *peer, co
   return 0;
 }
 
+static int
+devils_protocol_handle_send_unsequenced(devils_host *host, devils_peer *peer, const devils_protocol *command, devils_uint8 **currentData)
+{
+  devils_channel *channel;
+  size_t dataLength;
+
+  if (command->header.channelID >= peer->channelCount ||
+      (peer->state != DEVILS_PEER_STATE_CONNECTED && peer->state != DEVILS_PEER_STATE_DISCONNECT_LATER))
+    return -1;
+
+  dataLength = DEVILS_NET_TO_HOST_16(command->sendUnsequenced.dataLength);
+  *currentData += dataLength;
+  if (dataLength > host->maximumPacketSize ||
+      *currentData < host->receivedData ||
+      *currentData > &host->receivedData[host->receivedDataLength])
+    return -1;
+
+  channel = &peer->channels[command->header.channelID];
+  if (channel->fec != NULL)
+    devils_peer_fec_record(peer, channel, command, (const devils_uint8 *)command + sizeof(devils_protocol_send_unsequenced), dataLength);
+
+  return devils_protocol_queue_unsequenced(peer, command, (const devils_uint8 *)command + sizeof(devils_protocol_send_unsequenced), dataLength);
+}
+
 static int
 devils_protocol_handle_send_unreliable(devils_host *host, devils_peer *peer, const devils_protocol *command, devils_uint8 **currentData)
 {
+  devils_channel *channel;
   size_t dataLength;
 
   if (command->header.channelID >= peer->channelCount ||
@@ -509,12 +739,93 @@ devils_protocol_handle_send_unreliable(devils_host *host, devils_peer *peer, con
       *currentData > &host->receivedData[host->receivedDataLength])
     return -1;
 
+  channel = &peer->channels[command->header.channelID];
+  if (channel->fec != NULL)
+    devils_peer_fec_record(peer, channel, command, (const devils_uint8 *)command + sizeof(devils_protocol_send_unreliable), dataLength);
+
   if (devils_peer_queue_incoming_command(peer, command, (const devils_uint8 *)command + sizeof(devils_protocol_send_unreliable), dataLength, 0, 0) == NULL)
     return -1;
 
   return 0;
 }
 
+static int
+devils_protocol_handle_send_repair(devils_host *host, devils_peer *peer, const devils_protocol *command, devils_uint8 **currentData)
+{
+  devils_protocol recoveredCommand;
+  const devils_uint8 *recoveredData;
+  size_t dataLength, recoveredLength;
+
+  if (command->header.channelID >= peer->channelCount ||
+      (peer->state != DEVILS_PEER_STATE_CONNECTED && peer->state != DEVILS_PEER_STATE_DISCONNECT_LATER))
+    return -1;
+
+  dataLength = DEVILS_NET_TO_HOST_16(command->sendRepair.dataLength);
+  *currentData += dataLength;
+  if (dataLength > host->maximumPacketSize ||
+      *currentData < host->receivedData ||
+      *currentData > &host->receivedData[host->receivedDataLength])
+    return -1;
+
+  switch (devils_peer_fec_recover(peer, &peer->channels[command->header.channelID], command,
+                                  (const devils_uint8 *)command + sizeof(devils_protocol_send_repair), dataLength,
+                                  &recoveredCommand, &recoveredData, &recoveredLength))
+  {
+  case 1:
+    break;
+
+  case -1:
+    return -1;
+
+  default:
+    return 0;
+  }
+
+  if ((recoveredCommand.header.command & DEVILS_PROTOCOL_COMMAND_MASK) == DEVILS_PROTOCOL_COMMAND_SEND_UNSEQUENCED)
+    return devils_protocol_queue_unsequenced(peer, &recoveredCommand, recoveredData, recoveredLength);
+
+  if (devils_peer_queue_incoming_command(peer, &recoveredCommand, recoveredData, recoveredLength, 0, 0) == NULL)
+    return -1;
+
+  return 0;
+}
+
+/* Stores a fragment into its packet's reassembly storage, and once it was the last one missing,
+   hands the storage to the packet. Returns 1 if the packet is now complete, 0 if it is still missing
+   fragments or the fragment was a duplicate, and -1 if it could not be stored and should be
+   retransmitted. */
+static int
+devils_protocol_store_fragment(devils_incoming_command *startCommand, devils_uint32 fragmentNumber, devils_uint32 fragmentOffset, devils_uint32 fragmentLength, const devils_uint8 *data)
+{
+  if (startCommand->fragmentsRemaining == 0 ||
+      startCommand->fragments[fragmentNumber / 32] & (1 << (fragmentNumber % 32)))
+    return 0;
+
+  if (fragmentOffset + fragmentLength > startCommand->packet->dataLength)
+    fragmentLength = startCommand->packet->dataLength - fragmentOffset;
+
+  if (devils_reassembly_write(startCommand->reassembly, fragmentOffset, data, fragmentLength) < 0)
+    return -1;
+
+  if (startCommand->fragmentsRemaining > 1)
+  {
+    --startCommand->fragmentsRemaining;
+
+    startCommand->fragments[fragmentNumber / 32] |= (1 << (fragmentNumber % 32));
+
+    return 0;
+  }
+
+  if (devils_reassembly_finish(startCommand->reassembly, startCommand->packet) < 0)
+    return -1;
+
+  startCommand->reassembly = NULL;
+  startCommand->fragments = NULL;
+  startCommand->fragmentsRemaining = 0;
+
+  return 1;
+}
+
 static int
 devils_protocol_handle_send_fragment(devils_host *host, devils_peer *peer, const devils_protocol *command, devils_uint8 **currentData)
 {
@@ -526,7 +837,6 @@ devils_protocol_handle_send_fragment(devils_host *host, devils_peer *peer, const
       totalLength;
   devils_channel *channel;
   devils_uint16 startWindow, currentWindow;
-  devils_list_iterator currentCommand;
   devils_incoming_command *startCommand = NULL;
 
   if (command->header.channelID >= peer->channelCount ||
@@ -551,6 +861,10 @@ devils_protocol_handle_send_fragment(devils_host *host, devils_peer *peer, const
   if (startWindow < currentWindow || startWindow >= currentWindow + DEVILS_PEER_FREE_RELIABLE_WINDOWS - 1)
     return 0;
 
+  /* beyond the reorder ring; left unacknowledged for the sender to retransmit */
+  if ((devils_uint16)(startSequenceNumber - channel->incomingReliableSequenceNumber) > DEVILS_PEER_INCOMING_RELIABLE_RING_MAXIMUM_SIZE)
+    return 0;
+
   fragmentNumber = DEVILS_NET_TO_HOST_32(command->sendFragment.fragmentNumber);
   fragmentCount = DEVILS_NET_TO_HOST_32(command->sendFragment.fragmentCount);
   fragmentOffset = DEVILS_NET_TO_HOST_32(command->sendFragment.fragmentOffset);
@@ -563,32 +877,24 @@ devils_protocol_handle_send_fragment(devils_host *host, devils_peer *peer, const
       fragmentLength > totalLength - fragmentOffset)
     return -1;
 
-  for (currentCommand = devils_list_previous(devils_list_end(&channel->incomingReliableCommands));
-       currentCommand != devils_list_end(&channel->incomingReliableCommands);
-       currentCommand = devils_list_previous(currentCommand))
+  if (channel->state != NULL && channel->state->incomingReliableRingSize > 0)
   {
-    devils_incoming_command *incomingCommand = (devils_incoming_command *)currentCommand;
-
-    if (startSequenceNumber >= channel->incomingReliableSequenceNumber)
-    {
-      if (incomingCommand->reliableSequenceNumber < channel->incomingReliableSequenceNumber)
-        continue;
-    }
-    else if (incomingCommand->reliableSequenceNumber >= channel->incomingReliableSequenceNumber)
-      break;
+    devils_incoming_command *incomingCommand = channel->state->incomingReliableRing[startSequenceNumber & (channel->state->incomingReliableRingSize - 1)];
 
-    if (incomingCommand->reliableSequenceNumber <= startSequenceNumber)
+    if (incomingCommand != NULL && incomingCommand->reliableSequenceNumber == startSequenceNumber)
     {
-      if (incomingCommand->reliableSequenceNumber < startSequenceNumber)
-        break;
-
       if ((incomingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_MASK) != DEVILS_PROTOCOL_COMMAND_SEND_FRAGMENT ||
-          totalLength != incomingCommand->packet->dataLength ||
           fragmentCount != incomingCommand->fragmentCount)
         return -1;
 
+      /* a retransmitted fragment of a packet an unordered channel already delivered */
+      if (incomingCommand->packet == NULL)
+        return 0;
+
+      if (totalLength != incomingCommand->packet->dataLength)
+        return -1;
+
       startCommand = incomingCommand;
-      break;
     }
   }
 
@@ -598,26 +904,23 @@ devils_protocol_handle_send_fragment(devils_host *host, devils_peer *peer, const
 
     hostCommand.header.reliableSequenceNumber = startSequenceNumber;
 
-    startCommand = devils_peer_queue_incoming_command(peer, &hostCommand, NULL, totalLength, DEVILS_PACKET_FLAG_RELIABLE, fragmentCount);
+    startCommand = devils_peer_queue_incoming_command(peer, &hostCommand, NULL, totalLength,
+                                                      command->header.command & DEVILS_PROTOCOL_COMMAND_FLAG_STREAM ? DEVILS_PACKET_FLAG_RELIABLE | DEVILS_PACKET_FLAG_STREAM : DEVILS_PACKET_FLAG_RELIABLE, fragmentCount);
     if (startCommand == NULL)
       return -1;
   }
 
-  if ((startCommand->fragments[fragmentNumber / 32] & (1 << (fragmentNumber % 32))) == 0)
+  switch (devils_protocol_store_fragment(startCommand, fragmentNumber, fragmentOffset, fragmentLength, (const devils_uint8 *)command + sizeof(devils_protocol_send_fragment)))
   {
-    --startCommand->fragmentsRemaining;
-
-    startCommand->fragments[fragmentNumber / 32] |= (1 << (fragmentNumber % 32));
-
-    if (fragmentOffset + fragmentLength > startCommand->packet->dataLength)
-      fragmentLength = startCommand->packet->dataLength - fragmentOffset;
+  case -1:
+    return -1;
 
-    memcpy(startCommand->packet->data + fragmentOffset,
-           (devils_uint8 *)command + sizeof(devils_protocol_send_fragment),
-           fragmentLength);
+  case 1:
+    devils_peer_dispatch_incoming_reliable_commands(peer, channel, startCommand);
+    break;
 
-    if (startCommand->fragmentsRemaining <= 0)
-      devils_peer_dispatch_incoming_reliable_commands(peer, channel, NULL);
+  default:
+    break;
   }
 
   return 0;
@@ -635,6 +938,7 @@ devils_protocol_handle_send_unreliable_fragment(devils_host *host, devils_peer *
       totalLength;
   devils_uint16 reliableWindow, currentWindow;
   devils_channel *channel;
+  devils_channel_state *state;
   devils_list_iterator currentCommand;
   devils_incoming_command *startCommand = NULL;
 
@@ -663,7 +967,7 @@ devils_protocol_handle_send_unreliable_fragment(devils_host *host, devils_peer *
     return 0;
 
   if (reliableSequenceNumber == channel->incomingReliableSequenceNumber &&
-      startSequenceNumber <= channel->incomingUnreliableSequenceNumber)
+      !DEVILS_PEER_UNRELIABLE_LESS(peer, channel->incomingUnreliableSequenceNumber, startSequenceNumber))
     return 0;
 
   fragmentNumber = DEVILS_NET_TO_HOST_32(command->sendFragment.fragmentNumber);
@@ -678,8 +982,12 @@ devils_protocol_handle_send_unreliable_fragment(devils_host *host, devils_peer *
       fragmentLength > totalLength - fragmentOffset)
     return -1;
 
-  for (currentCommand = devils_list_previous(devils_list_end(&channel->incomingUnreliableCommands));
-       currentCommand != devils_list_end(&channel->incomingUnreliableCommands);
+  state = devils_peer_use_channel(peer, channel);
+  if (state == NULL)
+    return -1;
+
+  for (currentCommand = devils_list_previous(devils_list_end(&state->incomingUnreliableCommands));
+       currentCommand != devils_list_end(&state->incomingUnreliableCommands);
        currentCommand = devils_list_previous(currentCommand))
   {
     devils_incoming_command *incomingCommand = (devils_incoming_command *)currentCommand;
@@ -698,9 +1006,9 @@ devils_protocol_handle_send_unreliable_fragment(devils_host *host, devils_peer *
     if (incomingCommand->reliableSequenceNumber > reliableSequenceNumber)
       continue;
 
-    if (incomingCommand->unreliableSequenceNumber <= startSequenceNumber)
+    if (!DEVILS_PEER_UNRELIABLE_LESS(peer, startSequenceNumber, incomingCommand->unreliableSequenceNumber))
     {
-      if (incomingCommand->unreliableSequenceNumber < startSequenceNumber)
+      if (incomingCommand->unreliableSequenceNumber != startSequenceNumber)
         break;
 
       if ((incomingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_MASK) != DEVILS_PROTOCOL_COMMAND_SEND_UNRELIABLE_FRAGMENT ||
@@ -720,21 +1028,17 @@ devils_protocol_handle_send_unreliable_fragment(devils_host *host, devils_peer *
       return -1;
   }
 
-  if ((startCommand->fragments[fragmentNumber / 32] & (1 << (fragmentNumber % 32))) == 0)
+  switch (devils_protocol_store_fragment(startCommand, fragmentNumber, fragmentOffset, fragmentLength, (const devils_uint8 *)command + sizeof(devils_protocol_send_fragment)))
   {
-    --startCommand->fragmentsRemaining;
-
-    startCommand->fragments[fragmentNumber / 32] |= (1 << (fragmentNumber % 32));
-
-    if (fragmentOffset + fragmentLength > startCommand->packet->dataLength)
-      fragmentLength = startCommand->packet->dataLength - fragmentOffset;
+  case -1:
+    return -1;
 
-    memcpy(startCommand->packet->data + fragmentOffset,
-           (devils_uint8 *)command + sizeof(devils_protocol_send_fragment),
-           fragmentLength);
+  case 1:
+    devils_peer_dispatch_incoming_unreliable_commands(peer, channel, NULL);
+    break;
 
-    if (startCommand->fragmentsRemaining <= 0)
-      devils_peer_dispatch_incoming_unreliable_commands(peer, channel, NULL);
+  default:
+    break;
   }
 
   return 0;
@@ -765,7 +1069,7 @@ devils_protocol_handle_bandwidth_limit(devils_host *host, devils_peer *peer, con
     ++host->bandwidthLimitedPeers;
 
   if (peer->incomingBandwidth == 0 && host->outgoingBandwidth == 0)
-    peer->windowSize = DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE;
+    peer->windowSize = DEVILS_PEER_MAXIMUM_WINDOW_SIZE(peer);
   else if (peer->incomingBandwidth == 0 || host->outgoingBandwidth == 0)
     peer->windowSize = (DEVILS_MAX(peer->incomingBandwidth, host->outgoingBandwidth) /
                         DEVILS_PEER_WINDOW_SIZE_SCALE) *
@@ -777,8 +1081,8 @@ devils_protocol_handle_bandwidth_limit(devils_host *host, devils_peer *peer, con
 
   if (peer->windowSize < DEVILS_PROTOCOL_MINIMUM_WINDOW_SIZE)
     peer->windowSize = DEVILS_PROTOCOL_MINIMUM_WINDOW_SIZE;
-  else if (peer->windowSize > DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE)
-    peer->windowSize = DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE;
+  else if (peer->windowSize > DEVILS_PEER_MAXIMUM_WINDOW_SIZE(peer))
+    peer->windowSize = DEVILS_PEER_MAXIMUM_WINDOW_SIZE(peer);
 
   return 0;
 }
@@ -830,6 +1134,7 @@ devils_protocol_handle_acknowledge(devils_host *host, devils_event *event, devil
   devils_uint32 roundTripTime,
       receivedSentTime,
       receivedReliableSequenceNumber;
+  devils_uint32 reliableDataInTransit;
   devils_protocol_command commandNumber;
 
   if (peer->state == DEVILS_PEER_STATE_DISCONNECTED || peer->state == DEVILS_PEER_STATE_ZOMBIE)
@@ -845,10 +1150,14 @@ devils_protocol_handle_acknowledge(devils_host *host, devils_event *event, devil
 
   roundTripTime = DEVILS_TIME_DIFFERENCE(host->serviceTime, receivedSentTime);
   roundTripTime = DEVILS_MAX(roundTripTime, 1);
+  devils_histogram_record(&peer->roundTripTimes, roundTripTime);
 
   if (peer->lastReceiveTime > 0)
   {
-    devils_peer_throttle(peer, roundTripTime);
+    if (peer->congestionState != NULL)
+      peer->packetThrottle = peer->packetThrottleLimit;
+    else
+      devils_peer_throttle(peer, roundTripTime);
 
     peer->roundTripTimeVariance -= peer->roundTripTimeVariance / 4;
 
@@ -892,8 +1201,13 @@ devils_protocol_handle_acknowledge(devils_host *host, devils_event *event, devil
 
   receivedReliableSequenceNumber = DEVILS_NET_TO_HOST_16(command->acknowledge.receivedReliableSequenceNumber);
 
+  reliableDataInTransit = peer->reliableDataInTransit;
+
   commandNumber = devils_protocol_remove_sent_reliable_command(peer, receivedReliableSequenceNumber, command->header.channelID);
 
+  if (peer->congestionState != NULL && host->congestionControl.acknowledge != NULL)
+    host->congestionControl.acknowledge(host->congestionControl.context, peer->congestionState, peer, roundTripTime, reliableDataInTransit - peer->reliableDataInTransit);
+
   switch (peer->state)
   {
   case DEVILS_PEER_STATE_ACKNOWLEDGING_CONNECT:
@@ -911,7 +1225,7 @@ devils_protocol_handle_acknowledge(devils_host *host, devils_event *event, devil
     break;
 
   case DEVILS_PEER_STATE_DISCONNECT_LATER:
-    if (devils_list_empty(&peer->outgoingCommands) &&
+    if (!devils_peer_has_outgoing_commands(peer) &&
         devils_list_empty(&peer->sentReliableCommands))
       devils_peer_disconnect(peer, peer->eventData);
     break;
@@ -923,18 +1237,49 @@ devils_protocol_handle_acknowledge(devils_host *host, devils_event *event, devil
   return 0;
 }
 
+static int
+devils_protocol_handle_connect_cookie(devils_host *host, devils_peer *peer, const devils_protocol *command)
+{
+  (void)host;
+
+  if (peer->state != DEVILS_PEER_STATE_CONNECTING ||
+      command->connectCookie.connectID != peer->connectID)
+    return -1;
+
+  peer->connectCookie[0] = command->connectCookie.cookie[0];
+  peer->connectCookie[1] = command->connectCookie.cookie[1];
+  peer->flags |= DEVILS_PEER_FLAG_CONNECT_COOKIE;
+
+  /* resend the connect with the cookie right away instead of waiting for it to time out */
+  while (!devils_list_empty(&peer->sentReliableCommands))
+  {
+    devils_outgoing_command *outgoingCommand = (devils_outgoing_command *)devils_list_front(&peer->sentReliableCommands);
+
+    if (outgoingCommand->packet != NULL)
+      peer->reliableDataInTransit -= outgoingCommand->fragmentLength;
+
+    devils_list_remove(&outgoingCommand->outgoingCommandList);
+    devils_peer_insert_outgoing_command(peer, outgoingCommand, 1);
+  }
+
+  return 0;
+}
+
 static int
 devils_protocol_handle_verify_connect(devils_host *host, devils_event *event, devils_peer *peer, const devils_protocol *command)
 {
-  devils_uint32 mtu, windowSize;
+  devils_uint32 mtu, windowSize, outgoingPeerID;
   size_t channelCount;
 
   if (peer->state != DEVILS_PEER_STATE_CONNECTING)
     return 0;
 
   channelCount = DEVILS_NET_TO_HOST_32(command->verifyConnect.channelCount);
+  outgoingPeerID = (channelCount >> DEVILS_PROTOCOL_CONNECT_PEER_ID_SHIFT) << 16 | DEVILS_NET_TO_HOST_16(command->verifyConnect.outgoingPeerID);
+  channelCount &= DEVILS_PROTOCOL_CONNECT_CHANNEL_COUNT_MASK;
 
   if (channelCount < DEVILS_PROTOCOL_MINIMUM_CHANNEL_COUNT || channelCount > DEVILS_PROTOCOL_MAXIMUM_CHANNEL_COUNT ||
+      outgoingPeerID >= DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID ||
       DEVILS_NET_TO_HOST_32(command->verifyConnect.packetThrottleInterval) != peer->packetThrottleInterval ||
       DEVILS_NET_TO_HOST_32(command->verifyConnect.packetThrottleAcceleration) != peer->packetThrottleAcceleration ||
       DEVILS_NET_TO_HOST_32(command->verifyConnect.packetThrottleDeceleration) != peer->packetThrottleDeceleration ||
@@ -952,7 +1297,13 @@ devils_protocol_handle_verify_connect(devils_host *host, devils_event *event, de
   if (channelCount < peer->channelCount)
     peer->channelCount = channelCount;
 
-  peer->outgoingPeerID = DEVILS_NET_TO_HOST_16(command->verifyConnect.outgoingPeerID);
+  peer->outgoingPeerID = outgoingPeerID;
+  if (command->header.command & DEVILS_PROTOCOL_COMMAND_FLAG_SERIAL_UNRELIABLE)
+    peer->flags |= DEVILS_PEER_FLAG_SERIAL_UNRELIABLE;
+  if (command->header.command & DEVILS_PROTOCOL_COMMAND_FLAG_WINDOW_SCALE)
+    peer->flags |= DEVILS_PEER_FLAG_WINDOW_SCALE;
+  if (command->header.command & DEVILS_PROTOCOL_COMMAND_FLAG_SKIP)
+    peer->flags |= DEVILS_PEER_FLAG_SKIP | DEVILS_PEER_FLAG_REPAIR;
   peer->incomingSessionID = command->verifyConnect.incomingSessionID;
   peer->outgoingSessionID = command->verifyConnect.outgoingSessionID;
 
@@ -971,8 +1322,8 @@ devils_protocol_handle_verify_connect(devils_host *host, devils_event *event, de
   if (windowSize < DEVILS_PROTOCOL_MINIMUM_WINDOW_SIZE)
     windowSize = DEVILS_PROTOCOL_MINIMUM_WINDOW_SIZE;
 
-  if (windowSize > DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE)
-    windowSize = DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE;
+  if (windowSize > DEVILS_PEER_MAXIMUM_WINDOW_SIZE(peer))
+    windowSize = DEVILS_PEER_MAXIMUM_WINDOW_SIZE(peer);
 
   if (windowSize < peer->windowSize)
     peer->windowSize = windowSize;
@@ -984,16 +1335,128 @@ devils_protocol_handle_verify_connect(devils_host *host, devils_event *event, de
   return 0;
 }
 
-static int
-devils_protocol_handle_incoming_commands(devils_host *host, devils_event *event)
+/* Pings a connected peer at the new address its datagrams arrive from. The ping goes to that address
+   alone and carries a random reliable sequence number and sent time, so only a sender that receives
+   there can acknowledge it. */
+static void
+devils_protocol_send_path_challenge(devils_host *host, devils_peer *peer)
 {
-  devils_protocol_header *header;
-  devils_protocol *command;
-  devils_peer *peer;
-  devils_uint8 *currentData;
+  devils_uint8 challengeData[sizeof(devils_protocol_header) + sizeof(devils_uint32) + sizeof(devils_uint32) + sizeof(devils_protocol_ping)];
+  devils_protocol_header *header = (devils_protocol_header *)challengeData;
+  devils_protocol_ping *ping;
+  devils_uint32 challenge;
+  devils_uint16 headerFlags = DEVILS_PROTOCOL_HEADER_FLAG_SENT_TIME | (peer->outgoingSessionID << DEVILS_PROTOCOL_HEADER_SESSION_SHIFT);
+  devils_buffer buffer;
+  size_t challengeLength = sizeof(devils_protocol_header);
+  int sentLength;
+
+  do
+    challenge = devils_host_random(host);
+  while (challenge == 0);
+
+  header->sentTime = DEVILS_HOST_TO_NET_16(challenge & 0xFFFF);
+
+  if (peer->outgoingPeerID >= DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID)
+  {
+    header->peerID = DEVILS_HOST_TO_NET_16(DEVILS_PROTOCOL_EXTENDED_PEER_ID | headerFlags);
+    *(devils_uint32 *)&challengeData[challengeLength] = DEVILS_HOST_TO_NET_32(peer->outgoingPeerID);
+    challengeLength += sizeof(devils_uint32);
+  }
+  else
+    header->peerID = DEVILS_HOST_TO_NET_16(peer->outgoingPeerID | headerFlags);
+
+  if (host->checksum != NULL)
+    challengeLength += sizeof(devils_uint32);
+
+  ping = (devils_protocol_ping *)&challengeData[challengeLength];
+  ping->header.command = DEVILS_PROTOCOL_COMMAND_PING | DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE;
+  ping->header.channelID = 0xFF;
+  ping->header.reliableSequenceNumber = DEVILS_HOST_TO_NET_16(challenge >> 16);
+  challengeLength += sizeof(devils_protocol_ping);
+
+  buffer.data = challengeData;
+  buffer.dataLength = challengeLength;
+
+  if (host->checksum != NULL)
+  {
+    devils_uint32 *checksum = (devils_uint32 *)&challengeData[challengeLength - sizeof(devils_protocol_ping) - sizeof(devils_uint32)];
+    *checksum = peer->connectID;
+    *checksum = host->checksum(&buffer, 1);
+  }
+
+  peer->migrationAddress = host->receivedAddress;
+  peer->migrationChallenge = challenge;
+  peer->migrationTime = DEVILS_MAX(host->serviceTime, 1);
+
+  sentLength = devils_socket_send(host->socket, &host->receivedAddress, &buffer, 1);
+  if (sentLength > 0)
+  {
+    host->totalSentData += sentLength;
+    host->totalSentPackets++;
+    host->counters.bytesSent += sentLength;
+    ++host->counters.packetsSent;
+  }
+}
+
+/* Returns 1 if an acknowledgement answers the peer's last path challenge, in which case the peer
+   moves to the address it came from if that is where the challenge was sent, and 0 otherwise. */
+static int
+devils_protocol_handle_path_response(devils_host *host, devils_peer *peer, const devils_protocol *command)
+{
+  if (command->header.channelID != 0xFF ||
+      DEVILS_NET_TO_HOST_16(command->acknowledge.receivedReliableSequenceNumber) != peer->migrationChallenge >> 16 ||
+      DEVILS_NET_TO_HOST_16(command->acknowledge.receivedSentTime) != (peer->migrationChallenge & 0xFFFF))
+    return 0;
+
+  if (peer->migrationTime != 0 &&
+      host->receivedAddress.host == peer->migrationAddress.host &&
+      host->receivedAddress.port == peer->migrationAddress.port)
+  {
+    peer->migrationChallenge = 0;
+    peer->migrationTime = 0;
+
+    devils_host_move_peer(host, peer, &host->receivedAddress);
+  }
+
+  return 1;
+}
+
+/* Decides what to make of a datagram that passed the checksum of a connected peer but arrived from
+   an address other than the peer's. Nothing but the acknowledgement of a path challenge is taken from
+   an address that has not answered one, since a 16-bit sent time cannot tell a replay from a fresh
+   datagram. A datagram whose sent time is newer than the last accepted from the peer challenges its
+   address, at most once per DEVILS_PEER_PATH_CHALLENGE_INTERVAL. Returns 0 to drop the datagram, or 1
+   if a challenge is pending for its address and the challenge's acknowledgement may be taken from it. */
+static int
+devils_protocol_check_new_path(devils_host *host, devils_peer *peer, const devils_protocol_header *header, devils_uint16 flags)
+{
+  int pending = peer->migrationTime != 0 &&
+                host->receivedAddress.host == peer->migrationAddress.host &&
+                host->receivedAddress.port == peer->migrationAddress.port;
+  devils_uint16 sentTimeAhead = flags & DEVILS_PROTOCOL_HEADER_FLAG_SENT_TIME ? DEVILS_NET_TO_HOST_16(header->sentTime) - peer->incomingSentTime : 0;
+
+  if (sentTimeAhead != 0 && sentTimeAhead < 0x8000 &&
+      (!pending || DEVILS_TIME_DIFFERENCE(host->serviceTime, peer->migrationTime) >= DEVILS_PEER_PATH_CHALLENGE_INTERVAL))
+  {
+    devils_protocol_send_path_challenge(host, peer);
+    pending = 1;
+  }
+
+  return pending;
+}
+
+static int
+devils_protocol_handle_incoming_commands(devils_host *host, devils_event *event)
+{
+  devils_protocol_header *header;
+  devils_protocol *command;
+  devils_peer *peer;
+  devils_uint8 *currentData;
   size_t headerSize;
-  devils_uint16 peerID, flags;
+  devils_uint32 peerID;
+  devils_uint16 flags;
   devils_uint8 sessionID;
+  int newPath = 0;
 
   if (host->receivedDataLength < (size_t) & ((devils_protocol_header *)0)->sentTime)
     return 0;
@@ -1006,10 +1469,23 @@ devils_protocol_handle_incoming_commands(devils_host *host, devils_event *event)
   peerID &= ~(DEVILS_PROTOCOL_HEADER_FLAG_MASK | DEVILS_PROTOCOL_HEADER_SESSION_MASK);
 
   headerSize = (flags & DEVILS_PROTOCOL_HEADER_FLAG_SENT_TIME ? sizeof(devils_protocol_header) : (size_t) & ((devils_protocol_header *)0)->sentTime);
+  if (peerID == DEVILS_PROTOCOL_MAXIMUM_PEER_ID)
+    peerID = DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID;
+  else if (peerID == DEVILS_PROTOCOL_EXTENDED_PEER_ID)
+  {
+    if (host->receivedDataLength < headerSize + sizeof(devils_uint32))
+      return 0;
+
+    peerID = DEVILS_NET_TO_HOST_32(*(devils_uint32 *)&host->receivedData[headerSize]);
+    if (peerID < DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID || peerID >= DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID)
+      return 0;
+
+    headerSize += sizeof(devils_uint32);
+  }
   if (host->checksum != NULL)
     headerSize += sizeof(devils_uint32);
 
-  if (peerID == DEVILS_PROTOCOL_MAXIMUM_PEER_ID)
+  if (peerID == DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID)
     peer = NULL;
   else if (peerID >= host->peerCount)
     return 0;
@@ -1021,8 +1497,10 @@ devils_protocol_handle_incoming_commands(devils_host *host, devils_event *event)
         peer->state == DEVILS_PEER_STATE_ZOMBIE ||
         ((host->receivedAddress.host != peer->address.host ||
           host->receivedAddress.port != peer->address.port) &&
-         peer->address.host != DEVILS_HOST_BROADCAST) ||
-        (peer->outgoingPeerID < DEVILS_PROTOCOL_MAXIMUM_PEER_ID &&
+         peer->address.host != DEVILS_HOST_BROADCAST &&
+         !(host->migration && host->checksum != NULL &&
+           (peer->state == DEVILS_PEER_STATE_CONNECTED || peer->state == DEVILS_PEER_STATE_DISCONNECT_LATER))) ||
+        (peer->outgoingPeerID < DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID &&
          sessionID != peer->incomingSessionID))
       return 0;
   }
@@ -1063,9 +1541,26 @@ devils_protocol_handle_incoming_commands(devils_host *host, devils_event *event)
 
   if (peer != NULL)
   {
-    peer->address.host = host->receivedAddress.host;
-    peer->address.port = host->receivedAddress.port;
+    if (host->receivedAddress.host != peer->address.host ||
+        host->receivedAddress.port != peer->address.port)
+    {
+      if (peer->address.host == DEVILS_HOST_BROADCAST)
+        devils_host_move_peer(host, peer, &host->receivedAddress);
+      else
+      {
+        /* the checksum does not authenticate the sender, so the peer only moves once its new address answers a challenge */
+        newPath = devils_protocol_check_new_path(host, peer, header, flags);
+        if (!newPath)
+          return 0;
+      }
+    }
+    if (!newPath && flags & DEVILS_PROTOCOL_HEADER_FLAG_SENT_TIME &&
+        ((peer->state != DEVILS_PEER_STATE_CONNECTED && peer->state != DEVILS_PEER_STATE_DISCONNECT_LATER) ||
+         (devils_uint16)(DEVILS_NET_TO_HOST_16(header->sentTime) - peer->incomingSentTime) < 0x8000))
+      peer->incomingSentTime = DEVILS_NET_TO_HOST_16(header->sentTime);
     peer->incomingDataTotal += host->receivedDataLength;
+    peer->counters.bytesReceived += host->receivedDataLength;
+    ++peer->counters.packetsReceived;
   }
 
   currentData = host->receivedData + headerSize;
@@ -1095,6 +1590,23 @@ devils_protocol_handle_incoming_commands(devils_host *host, devils_event *event)
 
     command->header.reliableSequenceNumber = DEVILS_NET_TO_HOST_16(command->header.reliableSequenceNumber);
 
+    if (commandNumber == DEVILS_PROTOCOL_COMMAND_ACKNOWLEDGE &&
+        peer->migrationChallenge != 0 &&
+        devils_protocol_handle_path_response(host, peer, command))
+    {
+      if (host->receivedAddress.host == peer->address.host &&
+          host->receivedAddress.port == peer->address.port)
+        newPath = 0;
+      continue;
+    }
+
+    if (newPath)
+    {
+      if (commandNumber == DEVILS_PROTOCOL_COMMAND_ACKNOWLEDGE)
+        continue;
+      break;
+    }
+
     switch (commandNumber)
     {
     case DEVILS_PROTOCOL_COMMAND_ACKNOWLEDGE:
@@ -1105,7 +1617,7 @@ devils_protocol_handle_incoming_commands(devils_host *host, devils_event *event)
     case DEVILS_PROTOCOL_COMMAND_CONNECT:
       if (peer != NULL)
         goto commandError;
-      peer = devils_protocol_handle_connect(host, header, command);
+      peer = devils_protocol_handle_connect(host, header, command, &currentData);
       if (peer == NULL)
         goto commandError;
       break;
@@ -1160,12 +1672,31 @@ devils_protocol_handle_incoming_commands(devils_host *host, devils_event *event)
         goto commandError;
       break;
 
+    case DEVILS_PROTOCOL_COMMAND_SEND_REPAIR:
+      if (devils_protocol_handle_send_repair(host, peer, command, &currentData))
+        goto commandError;
+      break;
+
+    case DEVILS_PROTOCOL_COMMAND_CONNECT_COOKIE:
+      if (devils_protocol_handle_connect_cookie(host, peer, command))
+        goto commandError;
+      break;
+
+    case DEVILS_PROTOCOL_COMMAND_SKIP:
+      if (devils_protocol_handle_skip(host, peer, command))
+        goto commandError;
+      break;
+
     default:
       goto commandError;
     }
 
-    if (peer != NULL &&
-        (command->header.command & DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE) != 0)
+    if (peer == NULL)
+      continue;
+
+    ++peer->counters.commandsReceived;
+
+    if ((command->header.command & DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE) != 0)
     {
       devils_uint16 sentTime;
 
@@ -1230,6 +1761,8 @@ devils_protocol_receive_incoming_commands(devils_host *host, devils_event *event
 
     host->totalReceivedData += receivedLength;
     host->totalReceivedPackets++;
+    host->counters.bytesReceived += receivedLength;
+    ++host->counters.packetsReceived;
 
     if (host->intercept != NULL)
     {
@@ -1318,14 +1851,43 @@ devils_protocol_send_acknowledgements(devils_host *host, devils_peer *peer)
   host->bufferCount = buffer - host->buffers;
 }
 
+static void
+devils_protocol_send_connect_cookie(devils_host *host, devils_peer *peer)
+{
+  devils_protocol *command = &host->commands[host->commandCount];
+  devils_buffer *buffer = &host->buffers[host->bufferCount];
+
+  /* the cookie must directly follow the connect it vouches for */
+  if (host->commandCount == 0 ||
+      (command[-1].header.command & DEVILS_PROTOCOL_COMMAND_MASK) != DEVILS_PROTOCOL_COMMAND_CONNECT ||
+      command >= &host->commands[sizeof(host->commands) / sizeof(devils_protocol)] ||
+      buffer >= &host->buffers[sizeof(host->buffers) / sizeof(devils_buffer)] ||
+      peer->mtu - host->packetSize < sizeof(devils_protocol_connect_cookie))
+    return;
+
+  buffer->data = command;
+  buffer->dataLength = sizeof(devils_protocol_connect_cookie);
+
+  host->packetSize += buffer->dataLength;
+
+  command->header.command = DEVILS_PROTOCOL_COMMAND_CONNECT_COOKIE;
+  command->header.channelID = 0xFF;
+  command->header.reliableSequenceNumber = 0;
+  command->connectCookie.connectID = peer->connectID;
+  command->connectCookie.cookie[0] = peer->connectCookie[0];
+  command->connectCookie.cookie[1] = peer->connectCookie[1];
+
+  ++host->commandCount;
+  ++host->bufferCount;
+}
+
 static int
 devils_protocol_check_timeouts(devils_host *host, devils_peer *peer, devils_event *event)
 {
   devils_outgoing_command *outgoingCommand;
-  devils_list_iterator currentCommand, insertPosition;
+  devils_list_iterator currentCommand;
 
   currentCommand = devils_list_begin(&peer->sentReliableCommands);
-  insertPosition = devils_list_begin(&peer->outgoingCommands);
 
   while (currentCommand != devils_list_end(&peer->sentReliableCommands))
   {
@@ -1351,13 +1913,27 @@ devils_protocol_check_timeouts(devils_host *host, devils_peer *peer, devils_even
     }
 
     if (outgoingCommand->packet != NULL)
+    {
       peer->reliableDataInTransit -= outgoingCommand->fragmentLength;
 
+      if (peer->congestionState != NULL && host->congestionControl.loss != NULL)
+        host->congestionControl.loss(host->congestionControl.context, peer->congestionState, peer, outgoingCommand->fragmentLength);
+    }
+
     ++peer->packetsLost;
+    ++peer->counters.commandsRetransmitted;
 
     outgoingCommand->roundTripTimeout *= 2;
 
-    devils_list_insert(insertPosition, devils_list_remove(&outgoingCommand->outgoingCommandList));
+    if (outgoingCommand->command.header.channelID < peer->channelCount)
+    {
+      devils_channel_state *state = peer->channels[outgoingCommand->command.header.channelID].state;
+
+      state->sentReliableRing[outgoingCommand->reliableSequenceNumber & (state->sentReliableRingSize - 1)] = NULL;
+    }
+
+    devils_list_remove(&outgoingCommand->outgoingCommandList);
+    devils_peer_insert_outgoing_command(peer, outgoingCommand, 1);
 
     if (currentCommand == devils_list_begin(&peer->sentReliableCommands) &&
         !devils_list_empty(&peer->sentReliableCommands))
@@ -1372,65 +1948,214 @@ devils_protocol_check_timeouts(devils_host *host, devils_peer *peer, devils_even
 }
 
 static int
-devils_protocol_check_outgoing_commands(devils_host *host, devils_peer *peer)
+devils_protocol_check_reliable_window(devils_peer *peer, devils_channel *channel, devils_outgoing_command *outgoingCommand, int *windowExceeded)
+{
+  if (channel != NULL)
+  {
+    devils_uint16 reliableWindow = outgoingCommand->reliableSequenceNumber / DEVILS_PEER_RELIABLE_WINDOW_SIZE;
+
+    if (outgoingCommand->sendAttempts < 1 &&
+        !(outgoingCommand->reliableSequenceNumber % DEVILS_PEER_RELIABLE_WINDOW_SIZE) &&
+        (channel->state->reliableWindows[(reliableWindow + DEVILS_PEER_RELIABLE_WINDOWS - 1) % DEVILS_PEER_RELIABLE_WINDOWS] >= DEVILS_PEER_RELIABLE_WINDOW_SIZE ||
+         channel->usedReliableWindows & (1 << ((reliableWindow + DEVILS_PEER_RELIABLE_WINDOWS - 2) % DEVILS_PEER_RELIABLE_WINDOWS)) ||
+         channel->usedReliableWindows & ((((1 << (DEVILS_PEER_FREE_RELIABLE_WINDOWS + 2)) - 1) << reliableWindow) |
+                                         (((1 << (DEVILS_PEER_FREE_RELIABLE_WINDOWS + 2)) - 1) >> (DEVILS_PEER_RELIABLE_WINDOWS - reliableWindow)))))
+      return 0;
+  }
+
+  if (outgoingCommand->packet != NULL)
+  {
+    if (!*windowExceeded)
+    {
+      devils_uint32 windowSize;
+
+      /* the packet throttle neither probes nor backs off on loss, so only a congestion
+         controller may fill a window scaled beyond DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE */
+      if (peer->congestionWindow != 0)
+        windowSize = DEVILS_MIN(peer->congestionWindow, peer->windowSize);
+      else
+        windowSize = (peer->packetThrottle * DEVILS_MIN(peer->windowSize, DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE)) / DEVILS_PEER_PACKET_THROTTLE_SCALE;
+
+      if (peer->reliableDataInTransit + outgoingCommand->fragmentLength > DEVILS_MAX(windowSize, peer->mtu))
+        *windowExceeded = 1;
+    }
+    if (*windowExceeded)
+      return 0;
+  }
+
+  if (channel != NULL && !devils_protocol_reserve_sent_reliable_command(channel->state, outgoingCommand->reliableSequenceNumber))
+    return 0;
+
+  return 1;
+}
+
+/* whether a command's packet waited longer than its time-to-live before any attempt to send it */
+static int
+devils_protocol_is_expired(devils_host *host, const devils_outgoing_command *outgoingCommand)
+{
+  return outgoingCommand->packet != NULL &&
+         outgoingCommand->packet->timeToLive != 0 &&
+         outgoingCommand->sendAttempts == 0 &&
+         DEVILS_TIME_DIFFERENCE(host->serviceTime, outgoingCommand->enqueueTime) >= outgoingCommand->packet->timeToLive;
+}
+
+static void
+devils_protocol_drop_expired_command(devils_peer *peer, devils_channel_state *state, devils_outgoing_command *outgoingCommand)
+{
+  if (outgoingCommand->latestEntry != NULL)
+    devils_peer_latest_release(state, outgoingCommand);
+
+  ++peer->counters.commandsExpired;
+  --outgoingCommand->packet->referenceCount;
+
+  if (outgoingCommand->packet->referenceCount == 0)
+    devils_packet_destroy(outgoingCommand->packet);
+
+  devils_list_remove(&outgoingCommand->outgoingCommandList);
+  devils_free(outgoingCommand);
+}
+
+/* Turns an expired reliable packet none of which has been sent into a skip over its sequence numbers.
+   A skip never crosses into another reliable window, so the window checks made for the commands behind
+   it still hold; a packet that would need one that does is sent after all. */
+static void
+devils_protocol_skip_expired_command(devils_host *host, devils_peer *peer, devils_channel_state *state, devils_outgoing_command *outgoingCommand)
+{
+  devils_uint32 skipCount = outgoingCommand->fragmentsRemaining > 0 ? outgoingCommand->fragmentsRemaining : 1;
+  devils_packet *packet = outgoingCommand->packet;
+
+  if (!(peer->flags & DEVILS_PEER_FLAG_SKIP) ||
+      !devils_protocol_is_expired(host, outgoingCommand) ||
+      ((outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_MASK) != DEVILS_PROTOCOL_COMMAND_SEND_RELIABLE &&
+       (outgoingCommand->fragmentsRemaining == 0 || outgoingCommand->fragmentOffset != 0)) ||
+      outgoingCommand->reliableSequenceNumber % DEVILS_PEER_RELIABLE_WINDOW_SIZE + skipCount > DEVILS_PEER_RELIABLE_WINDOW_SIZE)
+    return;
+
+  if (outgoingCommand->latestEntry != NULL)
+    devils_peer_latest_release(state, outgoingCommand);
+
+  ++peer->counters.commandsExpired;
+
+  outgoingCommand->command.header.command = DEVILS_PROTOCOL_COMMAND_SKIP | DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE;
+  outgoingCommand->command.header.reliableSequenceNumber = DEVILS_HOST_TO_NET_16(outgoingCommand->reliableSequenceNumber);
+  outgoingCommand->command.skip.skipCount = DEVILS_HOST_TO_NET_32(skipCount);
+  outgoingCommand->fragmentOffset = 0;
+  outgoingCommand->fragmentLength = 0;
+  outgoingCommand->fragmentsRemaining = 0;
+  outgoingCommand->packet = NULL;
+
+  --packet->referenceCount;
+
+  if (packet->referenceCount == 0)
+    devils_packet_destroy(packet);
+}
+
+/* Drops or skips every queued command of a channel whose packet ran out of time, wherever it waits in
+   its queue, once the earliest time-to-live noted for the channel has passed. */
+static void
+devils_protocol_expire_commands(devils_host *host, devils_peer *peer, devils_channel_state *state)
+{
+  devils_list_iterator currentCommand;
+  devils_outgoing_command *outgoingCommand;
+
+  if (!state->expiring || DEVILS_TIME_LESS(host->serviceTime, state->expiryTime))
+    return;
+
+  state->expiring = 0;
+
+  for (currentCommand = devils_list_begin(&state->outgoingUnreliableCommands);
+       currentCommand != devils_list_end(&state->outgoingUnreliableCommands);)
+  {
+    outgoingCommand = (devils_outgoing_command *)currentCommand;
+    currentCommand = devils_list_next(currentCommand);
+
+    if (devils_protocol_is_expired(host, outgoingCommand))
+      devils_protocol_drop_expired_command(peer, state, outgoingCommand);
+    else
+      devils_peer_schedule_expiry(peer, outgoingCommand);
+  }
+
+  for (currentCommand = devils_list_begin(&state->outgoingReliableCommands);
+       currentCommand != devils_list_end(&state->outgoingReliableCommands);
+       currentCommand = devils_list_next(currentCommand))
+  {
+    outgoingCommand = (devils_outgoing_command *)currentCommand;
+
+    if (outgoingCommand->packet == NULL || outgoingCommand->packet->timeToLive == 0 || outgoingCommand->sendAttempts > 0)
+      continue;
+
+    /* an expired packet that cannot be skipped is sent after all, so it is not noted again */
+    if (devils_protocol_is_expired(host, outgoingCommand))
+      devils_protocol_skip_expired_command(host, peer, state, outgoingCommand);
+    else
+      devils_peer_schedule_expiry(peer, outgoingCommand);
+  }
+}
+
+static devils_protocol_queue_status
+devils_protocol_check_outgoing_queue(devils_host *host, devils_peer *peer, devils_channel *channel, int *windowExceeded, int *canPing)
 {
   devils_protocol *command = &host->commands[host->commandCount];
   devils_buffer *buffer = &host->buffers[host->bufferCount];
+  devils_channel_state *state = channel != NULL ? channel->state : NULL;
+  devils_list *reliableQueue = state != NULL ? &state->outgoingReliableCommands : &peer->outgoingCommands,
+              *unreliableQueue = state != NULL ? &state->outgoingUnreliableCommands : NULL,
+              *queue;
   devils_outgoing_command *outgoingCommand;
-  devils_list_iterator currentCommand;
-  devils_channel *channel = NULL;
-  devils_uint16 reliableWindow = 0;
+  devils_protocol_queue_status status = DEVILS_PROTOCOL_QUEUE_DRAINED;
+  int reliableBlocked = 0;
   size_t commandSize;
-  int windowExceeded = 0, windowWrap = 0, canPing = 1;
 
-  currentCommand = devils_list_begin(&peer->outgoingCommands);
+  if (state != NULL)
+    devils_protocol_expire_commands(host, peer, state);
 
-  while (currentCommand != devils_list_end(&peer->outgoingCommands))
+  for (;;)
   {
-    outgoingCommand = (devils_outgoing_command *)currentCommand;
+    outgoingCommand = NULL;
+    queue = reliableQueue;
 
-    if (outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE)
+    if (!reliableBlocked && !devils_list_empty(reliableQueue))
     {
-      channel = outgoingCommand->command.header.channelID < peer->channelCount ? &peer->channels[outgoingCommand->command.header.channelID] : NULL;
-      reliableWindow = outgoingCommand->reliableSequenceNumber / DEVILS_PEER_RELIABLE_WINDOW_SIZE;
-      if (channel != NULL)
-      {
-        if (!windowWrap &&
-            outgoingCommand->sendAttempts < 1 &&
-            !(outgoingCommand->reliableSequenceNumber % DEVILS_PEER_RELIABLE_WINDOW_SIZE) &&
-            (channel->reliableWindows[(reliableWindow + DEVILS_PEER_RELIABLE_WINDOWS - 1) % DEVILS_PEER_RELIABLE_WINDOWS] >= DEVILS_PEER_RELIABLE_WINDOW_SIZE ||
-             channel->usedReliableWindows & ((((1 << (DEVILS_PEER_FREE_RELIABLE_WINDOWS + 2)) - 1) << reliableWindow) |
-                                             (((1 << (DEVILS_PEER_FREE_RELIABLE_WINDOWS + 2)) - 1) >> (DEVILS_PEER_RELIABLE_WINDOWS - reliableWindow)))))
-          windowWrap = 1;
-        if (windowWrap)
-        {
-          currentCommand = devils_list_next(currentCommand);
+      outgoingCommand = (devils_outgoing_command *)devils_list_front(reliableQueue);
 
-          continue;
-        }
-      }
+      if (outgoingCommand->fragmentsRemaining > 0)
+        outgoingCommand = devils_peer_next_fragment(outgoingCommand);
 
-      if (outgoingCommand->packet != NULL)
+      if (outgoingCommand == NULL)
+        reliableBlocked = 1;
+      else if (outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE &&
+          !devils_protocol_check_reliable_window(peer, channel, outgoingCommand, windowExceeded))
       {
-        if (!windowExceeded)
-        {
-          devils_uint32 windowSize = (peer->packetThrottle * peer->windowSize) / DEVILS_PEER_PACKET_THROTTLE_SCALE;
+        reliableBlocked = 1;
+        outgoingCommand = NULL;
+      }
+    }
 
-          if (peer->reliableDataInTransit + outgoingCommand->fragmentLength > DEVILS_MAX(windowSize, peer->mtu))
-            windowExceeded = 1;
-        }
-        if (windowExceeded)
-        {
-          currentCommand = devils_list_next(currentCommand);
+    if (unreliableQueue != NULL && !devils_list_empty(unreliableQueue))
+    {
+      devils_outgoing_command *unreliableCommand = (devils_outgoing_command *)devils_list_front(unreliableQueue);
 
-          continue;
-        }
+      if (outgoingCommand == NULL || unreliableCommand->queueTime - outgoingCommand->queueTime >= 0x80000000U)
+      {
+        outgoingCommand = unreliableCommand;
+        queue = unreliableQueue;
       }
-
-      canPing = 0;
     }
 
+    if (outgoingCommand == NULL)
+      break;
+
+    if (outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE)
+      *canPing = 0;
+
     commandSize = commandSizes[outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_MASK];
+    if (state != NULL && commandSize + outgoingCommand->fragmentLength > state->deficit)
+    {
+      status = DEVILS_PROTOCOL_QUEUE_DEFICIT_EXHAUSTED;
+
+      break;
+    }
+
     if (command >= &host->commands[sizeof(host->commands) / sizeof(devils_protocol)] ||
         buffer + 1 >= &host->buffers[sizeof(host->buffers) / sizeof(devils_buffer)] ||
         peer->mtu - host->packetSize < commandSize ||
@@ -1438,18 +2163,25 @@ devils_protocol_check_outgoing_commands(devils_host *host, devils_peer *peer)
          (devils_uint16)(peer->mtu - host->packetSize) < (devils_uint16)(commandSize + outgoingCommand->fragmentLength)))
     {
       host->continueSending = 1;
+      status = DEVILS_PROTOCOL_QUEUE_DATAGRAM_FULL;
 
       break;
     }
 
-    currentCommand = devils_list_next(currentCommand);
+    if (state != NULL)
+      state->deficit -= commandSize + outgoingCommand->fragmentLength;
+
+    if (outgoingCommand->latestEntry != NULL)
+      devils_peer_latest_release(state, outgoingCommand);
 
     if (outgoingCommand->command.header.command & DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE)
     {
-      if (channel != NULL && outgoingCommand->sendAttempts < 1)
+      if (state != NULL && outgoingCommand->sendAttempts < 1)
       {
+        devils_uint16 reliableWindow = outgoingCommand->reliableSequenceNumber / DEVILS_PEER_RELIABLE_WINDOW_SIZE;
+
         channel->usedReliableWindows |= 1 << reliableWindow;
-        ++channel->reliableWindows[reliableWindow];
+        ++state->reliableWindows[reliableWindow];
       }
 
       ++outgoingCommand->sendAttempts;
@@ -1466,6 +2198,9 @@ devils_protocol_check_outgoing_commands(devils_host *host, devils_peer *peer)
       devils_list_insert(devils_list_end(&peer->sentReliableCommands),
                          devils_list_remove(&outgoingCommand->outgoingCommandList));
 
+      if (state != NULL)
+        state->sentReliableRing[outgoingCommand->reliableSequenceNumber & (state->sentReliableRingSize - 1)] = outgoingCommand;
+
       outgoingCommand->sentTime = host->serviceTime;
 
       host->headerFlags |= DEVILS_PROTOCOL_HEADER_FLAG_SENT_TIME;
@@ -1485,6 +2220,10 @@ devils_protocol_check_outgoing_commands(devils_host *host, devils_peer *peer)
                         unreliableSequenceNumber = outgoingCommand->unreliableSequenceNumber;
           for (;;)
           {
+            if (outgoingCommand->latestEntry != NULL)
+              devils_peer_latest_release(state, outgoingCommand);
+
+            ++peer->counters.commandsThrottled;
             --outgoingCommand->packet->referenceCount;
 
             if (outgoingCommand->packet->referenceCount == 0)
@@ -1493,15 +2232,13 @@ devils_protocol_check_outgoing_commands(devils_host *host, devils_peer *peer)
             devils_list_remove(&outgoingCommand->outgoingCommandList);
             devils_free(outgoingCommand);
 
-            if (currentCommand == devils_list_end(&peer->outgoingCommands))
+            if (devils_list_empty(queue))
               break;
 
-            outgoingCommand = (devils_outgoing_command *)currentCommand;
+            outgoingCommand = (devils_outgoing_command *)devils_list_front(queue);
             if (outgoingCommand->reliableSequenceNumber != reliableSequenceNumber ||
                 outgoingCommand->unreliableSequenceNumber != unreliableSequenceNumber)
               break;
-
-            currentCommand = devils_list_next(currentCommand);
           }
 
           continue;
@@ -1511,9 +2248,17 @@ devils_protocol_check_outgoing_commands(devils_host *host, devils_peer *peer)
       devils_list_remove(&outgoingCommand->outgoingCommandList);
 
       if (outgoingCommand->packet != NULL)
+      {
+        if (channel != NULL && channel->fec != NULL)
+          devils_peer_fec_encode(peer, channel, outgoingCommand);
+
         devils_list_insert(devils_list_end(&peer->sentUnreliableCommands), outgoingCommand);
+      }
     }
 
+    if (outgoingCommand->sendAttempts <= 1)
+      devils_histogram_record(&peer->queueDelays, DEVILS_TIME_DIFFERENCE(host->serviceTime, outgoingCommand->enqueueTime));
+
     buffer->data = command;
     buffer->dataLength = commandSize;
 
@@ -1534,6 +2279,7 @@ devils_protocol_check_outgoing_commands(devils_host *host, devils_peer *peer)
       devils_free(outgoingCommand);
 
     ++peer->packetsSent;
+    ++peer->counters.commandsSent;
 
     ++command;
     ++buffer;
@@ -1542,8 +2288,66 @@ devils_protocol_check_outgoing_commands(devils_host *host, devils_peer *peer)
   host->commandCount = command - host->commands;
   host->bufferCount = buffer - host->buffers;
 
+  return status;
+}
+
+static int
+devils_protocol_check_outgoing_commands(devils_host *host, devils_peer *peer)
+{
+  devils_channel_state *state, *idleState;
+  devils_list *activeChannels;
+  size_t priority, commandCount;
+  int windowExceeded = 0, canPing = 1;
+
+  if (devils_protocol_check_outgoing_queue(host, peer, NULL, &windowExceeded, &canPing) == DEVILS_PROTOCOL_QUEUE_DATAGRAM_FULL)
+    return canPing;
+
+  for (priority = 0; priority < DEVILS_PEER_CHANNEL_PRIORITIES; ++priority)
+  {
+    activeChannels = &peer->activeChannels[priority];
+    idleState = NULL;
+
+    while (!devils_list_empty(activeChannels))
+    {
+      state = (devils_channel_state *)devils_list_front(activeChannels);
+      commandCount = host->commandCount;
+
+      switch (devils_protocol_check_outgoing_queue(host, peer, state->channel, &windowExceeded, &canPing))
+      {
+      case DEVILS_PROTOCOL_QUEUE_DATAGRAM_FULL:
+        return canPing;
+
+      case DEVILS_PROTOCOL_QUEUE_DEFICIT_EXHAUSTED:
+        state->deficit += state->channel->weight * peer->mtu;
+        idleState = NULL;
+        break;
+
+      default:
+        if (devils_list_empty(&state->outgoingReliableCommands) && devils_list_empty(&state->outgoingUnreliableCommands))
+        {
+          devils_list_remove(&state->activeList);
+          state->deficit = 0;
+          idleState = NULL;
+          continue;
+        }
+
+        if (host->commandCount != commandCount)
+          idleState = NULL;
+        else if (idleState == NULL)
+          idleState = state;
+        else if (idleState == state)
+          goto nextPriority;
+        break;
+      }
+
+      devils_list_insert(devils_list_end(activeChannels), devils_list_remove(&state->activeList));
+    }
+
+  nextPriority:;
+  }
+
   if (peer->state == DEVILS_PEER_STATE_DISCONNECT_LATER &&
-      devils_list_empty(&peer->outgoingCommands) &&
+      !devils_peer_has_outgoing_commands(peer) &&
       devils_list_empty(&peer->sentReliableCommands) &&
       devils_list_empty(&peer->sentUnreliableCommands))
     devils_peer_disconnect(peer, peer->eventData);
@@ -1551,16 +2355,88 @@ devils_protocol_check_outgoing_commands(devils_host *host, devils_peer *peer)
   return canPing;
 }
 
+static int
+devils_protocol_check_pacing(devils_host *host, devils_peer *peer)
+{
+  devils_uint32 rate = peer->pacingRate != 0 ? peer->pacingRate : (host->bandwidthPacing ? peer->incomingBandwidth : 0),
+                burst, elapsedTime, deadline;
+
+  if (peer->trafficClass != NULL && !devils_traffic_class_admit(host, peer->trafficClass))
+    return 0;
+
+  if (rate == 0)
+    return 1;
+
+  burst = DEVILS_MAX(rate / (1000 / DEVILS_PEER_PACING_BURST_INTERVAL), 2 * peer->mtu);
+  elapsedTime = DEVILS_TIME_DIFFERENCE(host->serviceTime, peer->pacingEpoch);
+  if (elapsedTime >= DEVILS_PEER_PACING_BURST_INTERVAL)
+    peer->pacingTokens = burst;
+  else
+    peer->pacingTokens = DEVILS_MIN(burst, peer->pacingTokens + (rate / 1000) * elapsedTime + ((rate % 1000) * elapsedTime) / 1000);
+  peer->pacingEpoch = host->serviceTime;
+
+  if (peer->pacingTokens >= peer->mtu)
+    return 1;
+
+  deadline = host->serviceTime + (peer->mtu - peer->pacingTokens) * 1000 / rate + 1;
+  if (host->pacingDeadline == 0 || DEVILS_TIME_LESS(deadline, host->pacingDeadline))
+    host->pacingDeadline = DEVILS_MAX(deadline, 1);
+
+  return 0;
+}
+
+static int
+devils_protocol_flush_datagrams(devils_host *host)
+{
+  int sentCount;
+
+  if (host->sendCount == 0)
+    return 0;
+
+  sentCount = devils_socket_send_batch(host->socket, host->sendAddresses, host->sendBuffers, host->sendCount);
+
+  host->sendCount = 0;
+
+  return sentCount < 0 ? -1 : 0;
+}
+
+static int
+devils_protocol_queue_datagram(devils_host *host, const devils_address *address)
+{
+  devils_uint8 *data = host->sendData[host->sendCount];
+  size_t dataLength = 0, bufferIndex;
+
+  for (bufferIndex = 0; bufferIndex < host->bufferCount; ++bufferIndex)
+  {
+    memcpy(data + dataLength, host->buffers[bufferIndex].data, host->buffers[bufferIndex].dataLength);
+    dataLength += host->buffers[bufferIndex].dataLength;
+  }
+
+  host->sendBuffers[host->sendCount].data = data;
+  host->sendBuffers[host->sendCount].dataLength = dataLength;
+  host->sendAddresses[host->sendCount] = *address;
+
+  if (++host->sendCount >= DEVILS_HOST_SEND_BATCH_SIZE &&
+      devils_protocol_flush_datagrams(host) < 0)
+    return -1;
+
+  return (int)dataLength;
+}
+
 static int
 devils_protocol_send_outgoing_commands(devils_host *host, devils_event *event, int checkForTimeouts)
 {
-  devils_uint8 headerData[sizeof(devils_protocol_header) + sizeof(devils_uint32)];
+  devils_uint8 headerData[sizeof(devils_protocol_header) + sizeof(devils_uint32) + sizeof(devils_uint32)];
   devils_protocol_header *header = (devils_protocol_header *)headerData;
   devils_peer *currentPeer;
-  int sentLength;
+  int sentLength, extendedPeerID;
   size_t shouldCompress = 0;
 
+  if (!devils_list_empty(&host->streams))
+    devils_host_pump_streams(host);
+
   host->continueSending = 1;
+  host->pacingDeadline = 0;
 
   while (host->continueSending)
     for (host->continueSending = 0,
@@ -1575,7 +2451,9 @@ devils_protocol_send_outgoing_commands(devils_host *host, devils_event *event, i
       host->headerFlags = 0;
       host->commandCount = 0;
       host->bufferCount = 1;
-      host->packetSize = sizeof(devils_protocol_header);
+      extendedPeerID = currentPeer->outgoingPeerID >= DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID &&
+                       currentPeer->outgoingPeerID < DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID;
+      host->packetSize = sizeof(devils_protocol_header) + (extendedPeerID ? sizeof(devils_uint32) : 0);
 
       if (!devils_list_empty(&currentPeer->acknowledgements))
         devils_protocol_send_acknowledgements(host, currentPeer);
@@ -1586,13 +2464,17 @@ devils_protocol_send_outgoing_commands(devils_host *host, devils_event *event, i
           devils_protocol_check_timeouts(host, currentPeer, event) == 1)
       {
         if (event != NULL && event->type != DEVILS_EVENT_TYPE_NONE)
+        {
+          devils_protocol_flush_datagrams(host);
           return 1;
+        }
         else
           continue;
       }
 
-      if ((devils_list_empty(&currentPeer->outgoingCommands) ||
-           devils_protocol_check_outgoing_commands(host, currentPeer)) &&
+      if ((!devils_peer_has_outgoing_commands(currentPeer) ||
+           ((checkForTimeouts == 0 || devils_protocol_check_pacing(host, currentPeer)) &&
+            devils_protocol_check_outgoing_commands(host, currentPeer))) &&
           devils_list_empty(&currentPeer->sentReliableCommands) &&
           DEVILS_TIME_DIFFERENCE(host->serviceTime, currentPeer->lastReceiveTime) >= currentPeer->pingInterval &&
           currentPeer->mtu - host->packetSize >= sizeof(devils_protocol_ping))
@@ -1601,6 +2483,10 @@ devils_protocol_send_outgoing_commands(devils_host *host, devils_event *event, i
         devils_protocol_check_outgoing_commands(host, currentPeer);
       }
 
+      if (currentPeer->flags & DEVILS_PEER_FLAG_CONNECT_COOKIE &&
+          currentPeer->state == DEVILS_PEER_STATE_CONNECTING)
+        devils_protocol_send_connect_cookie(host, currentPeer);
+
       if (host->commandCount == 0)
         continue;
 
@@ -1612,7 +2498,7 @@ devils_protocol_send_outgoing_commands(devils_host *host, devils_event *event, i
         devils_uint32 packetLoss = currentPeer->packetsLost * DEVILS_PEER_PACKET_LOSS_SCALE / currentPeer->packetsSent;
 
 #ifdef DEVILS_DEBUG
-        printf("peer %u: %f%%+-%f%% packet loss, %u+-%u ms round trip time, %f%% throttle, %u outgoing, %u/%u incoming\n", currentPeer->incomingPeerID, currentPeer->packetLoss / (float)DEVILS_PEER_PACKET_LOSS_SCALE, currentPeer->packetLossVariance / (float)DEVILS_PEER_PACKET_LOSS_SCALE, currentPeer->roundTripTime, currentPeer->roundTripTimeVariance, currentPeer->packetThrottle / (float)DEVILS_PEER_PACKET_THROTTLE_SCALE, devils_list_size(&currentPeer->outgoingCommands), currentPeer->channels != NULL ? devils_list_size(&currentPeer->channels->incomingReliableCommands) : 0, currentPeer->channels != NULL ? devils_list_size(&currentPeer->channels->incomingUnreliableCommands) : 0);
+        printf("peer %u: %f%%+-%f%% packet loss, %u+-%u ms round trip time, %f%% throttle, %u outgoing, %u/%u incoming\n", currentPeer->incomingPeerID, currentPeer->packetLoss / (float)DEVILS_PEER_PACKET_LOSS_SCALE, currentPeer->packetLossVariance / (float)DEVILS_PEER_PACKET_LOSS_SCALE, currentPeer->roundTripTime, currentPeer->roundTripTimeVariance, currentPeer->packetThrottle / (float)DEVILS_PEER_PACKET_THROTTLE_SCALE, devils_list_size(&currentPeer->outgoingCommands), currentPeer->channels != NULL && currentPeer->channels->state != NULL ? currentPeer->channels->state->incomingReliableCount : 0, currentPeer->channels != NULL && currentPeer->channels->state != NULL ? devils_list_size(&currentPeer->channels->state->incomingUnreliableCommands) : 0);
 #endif
 
         currentPeer->packetLossVariance = (currentPeer->packetLossVariance * 3 + DEVILS_DIFFERENCE(packetLoss, currentPeer->packetLoss)) / 4;
@@ -1621,6 +2507,8 @@ devils_protocol_send_outgoing_commands(devils_host *host, devils_event *event, i
         currentPeer->packetLossEpoch = host->serviceTime;
         currentPeer->packetsSent = 0;
         currentPeer->packetsLost = 0;
+
+        devils_peer_reclaim_channels(currentPeer);
       }
 
       host->buffers->data = headerData;
@@ -1636,7 +2524,7 @@ devils_protocol_send_outgoing_commands(devils_host *host, devils_event *event, i
       shouldCompress = 0;
       if (host->compressor.context != NULL && host->compressor.compress != NULL)
       {
-        size_t originalSize = host->packetSize - sizeof(devils_protocol_header),
+        size_t originalSize = host->packetSize - sizeof(devils_protocol_header) - (extendedPeerID ? sizeof(devils_uint32) : 0),
                compressedSize = host->compressor.compress(host->compressor.context,
                                                           &host->buffers[1], host->bufferCount - 1,
                                                           originalSize,
@@ -1652,13 +2540,24 @@ devils_protocol_send_outgoing_commands(devils_host *host, devils_event *event, i
         }
       }
 
-      if (currentPeer->outgoingPeerID < DEVILS_PROTOCOL_MAXIMUM_PEER_ID)
+      if (currentPeer->outgoingPeerID >= DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID)
+        header->peerID = DEVILS_HOST_TO_NET_16(DEVILS_PROTOCOL_MAXIMUM_PEER_ID | DEVILS_PROTOCOL_HEADER_FLAG_EXTENDED_PEER_ID | host->headerFlags);
+      else
+      {
         host->headerFlags |= currentPeer->outgoingSessionID << DEVILS_PROTOCOL_HEADER_SESSION_SHIFT;
-      header->peerID = DEVILS_HOST_TO_NET_16(currentPeer->outgoingPeerID | host->headerFlags);
+        if (extendedPeerID)
+        {
+          header->peerID = DEVILS_HOST_TO_NET_16(DEVILS_PROTOCOL_EXTENDED_PEER_ID | host->headerFlags);
+          *(devils_uint32 *)&headerData[host->buffers->dataLength] = DEVILS_HOST_TO_NET_32(currentPeer->outgoingPeerID);
+          host->buffers->dataLength += sizeof(devils_uint32);
+        }
+        else
+          header->peerID = DEVILS_HOST_TO_NET_16(currentPeer->outgoingPeerID | host->headerFlags);
+      }
       if (host->checksum != NULL)
       {
         devils_uint32 *checksum = (devils_uint32 *)&headerData[host->buffers->dataLength];
-        *checksum = currentPeer->outgoingPeerID < DEVILS_PROTOCOL_MAXIMUM_PEER_ID ? currentPeer->connectID : 0;
+        *checksum = currentPeer->outgoingPeerID < DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID ? currentPeer->connectID : 0;
         host->buffers->dataLength += sizeof(devils_uint32);
         *checksum = host->checksum(host->buffers, host->bufferCount);
       }
@@ -1672,24 +2571,54 @@ devils_protocol_send_outgoing_commands(devils_host *host, devils_event *event, i
 
       currentPeer->lastSendTime = host->serviceTime;
 
-      sentLength = devils_socket_send(host->socket, &currentPeer->address, host->buffers, host->bufferCount);
+      sentLength = devils_protocol_queue_datagram(host, &currentPeer->address);
 
       devils_protocol_remove_sent_unreliable_commands(currentPeer);
 
+      if (!devils_list_empty(&currentPeer->repairCommands))
+      {
+        do
+        {
+          devils_outgoing_command *repairCommand = (devils_outgoing_command *)devils_list_remove(devils_list_begin(&currentPeer->repairCommands));
+
+          if (devils_peer_use_channel(currentPeer, &currentPeer->channels[repairCommand->command.header.channelID]) == NULL)
+          {
+            if (repairCommand->packet != NULL && --repairCommand->packet->referenceCount == 0)
+              devils_packet_destroy(repairCommand->packet);
+
+            devils_free(repairCommand);
+            continue;
+          }
+
+          devils_peer_setup_outgoing_command(currentPeer, repairCommand);
+        } while (!devils_list_empty(&currentPeer->repairCommands));
+
+        host->continueSending = 1;
+      }
+
       if (sentLength < 0)
         return -1;
 
+      currentPeer->pacingTokens -= DEVILS_MIN(currentPeer->pacingTokens, (devils_uint32)sentLength);
+      if (currentPeer->trafficClass != NULL)
+        devils_traffic_class_charge(currentPeer->trafficClass, sentLength);
+
       host->totalSentData += sentLength;
       host->totalSentPackets++;
+      host->counters.bytesSent += sentLength;
+      ++host->counters.packetsSent;
+      currentPeer->counters.bytesSent += sentLength;
+      ++currentPeer->counters.packetsSent;
     }
 
-  return 0;
+  return devils_protocol_flush_datagrams(host);
 }
 
 /** Sends any queued packets on the host specified to its designated peers.
 
     @param host   host to flush
     @remarks this function need only be used in circumstances where one wishes to send queued packets earlier than in a call to devils_host_service().
+    Packets are sent regardless of any send pacing in effect for the peers.
     @ingroup host
 */
 void devils_host_flush(devils_host *host)
@@ -1735,7 +2664,7 @@ int devils_host_check_events(devils_host *host, devils_event *event)
 */
 int devils_host_service(devils_host *host, devils_event *event, devils_uint32 timeout)
 {
-  devils_uint32 waitCondition;
+  devils_uint32 waitCondition, waitTime;
 
   if (event != NULL)
   {
@@ -1847,13 +2776,18 @@ int devils_host_service(devils_host *host, devils_event *event, devils_uint32 ti
         return 0;
 
       waitCondition = DEVILS_SOCKET_WAIT_RECEIVE | DEVILS_SOCKET_WAIT_INTERRUPT;
+      waitTime = DEVILS_TIME_DIFFERENCE(timeout, host->serviceTime);
+
+      if (host->pacingDeadline != 0)
+        waitTime = DEVILS_TIME_GREATER_EQUAL(host->serviceTime, host->pacingDeadline) ? 0 : DEVILS_MIN(waitTime, DEVILS_TIME_DIFFERENCE(host->pacingDeadline, host->serviceTime));
 
-      if (devils_socket_wait(host->socket, &waitCondition, DEVILS_TIME_DIFFERENCE(timeout, host->serviceTime)) != 0)
+      if (devils_socket_wait(host->socket, &waitCondition, waitTime) != 0)
         return -1;
     } while (waitCondition & DEVILS_SOCKET_WAIT_INTERRUPT);
 
     host->serviceTime = devils_time_get();
-  } while (waitCondition & DEVILS_SOCKET_WAIT_RECEIVE);
+  } while ((waitCondition & DEVILS_SOCKET_WAIT_RECEIVE) ||
+           (host->pacingDeadline != 0 && DEVILS_TIME_GREATER_EQUAL(host->serviceTime, host->pacingDeadline)));
 
   return 0;
 }
@@ -0,0 +1,293 @@
+/**
+ @file reassembly.c
+ @brief Chunked storage for reassembling incoming fragmented packets
+*/
+#define DEVILS_BUILDING_LIB 1
+#include <string.h>
+#include "include/devils_utility.h"
+#include "include/devils.h"
+
+enum
+{
+    DEVILS_REASSEMBLY_CHUNK_SIZE = 16 * 1024, /* bytes of packet data held by one chunk */
+    DEVILS_REASSEMBLY_POOL_SIZE = 256         /* free chunks a host keeps for reuse */
+};
+
+typedef struct _devils_reassembly
+{
+    devils_peer *peer;
+    size_t chunkSize;     /* bytes of packet data held by each chunk but the last */
+    size_t chunkCount;
+    size_t reservedData;  /* bytes counted towards the peer's and the host's limits */
+    devils_buffer *chunks; /* handed to the packet once it is complete */
+    devils_uint32 fragments[1];
+} devils_reassembly;
+
+static devils_uint8 *
+devils_reassembly_acquire_chunk(devils_host *host)
+{
+    devils_uint8 *chunk = host->reassemblyPool;
+
+    if (chunk != NULL)
+    {
+        host->reassemblyPool = *(devils_uint8 **)chunk;
+        --host->reassemblyPoolCount;
+
+        return chunk;
+    }
+
+    return (devils_uint8 *)devils_malloc(DEVILS_REASSEMBLY_CHUNK_SIZE);
+}
+
+static void
+devils_reassembly_release_chunk(devils_host *host, devils_uint8 *chunk)
+{
+    if (host->reassemblyPoolCount >= DEVILS_REASSEMBLY_POOL_SIZE)
+    {
+        devils_free(chunk);
+        return;
+    }
+
+    *(devils_uint8 **)chunk = host->reassemblyPool;
+    host->reassemblyPool = chunk;
+    ++host->reassemblyPoolCount;
+}
+
+/* counts buffer space against the peer's and the host's limits, failing if either would be exceeded */
+static int
+devils_reassembly_reserve(devils_reassembly *reassembly, devils_peer *peer, size_t length)
+{
+    devils_host *host = peer->host;
+
+    if (length > host->maximumWaitingData - DEVILS_MIN(peer->totalWaitingData, host->maximumWaitingData) ||
+        length > host->maximumReassemblyData - DEVILS_MIN(host->reassemblyData, host->maximumReassemblyData))
+        return -1;
+
+    peer->totalWaitingData += length;
+    host->reassemblyData += length;
+
+    if (reassembly != NULL)
+        reassembly->reservedData += length;
+
+    return 0;
+}
+
+/* allocates the chunk a fragment lands in, from the host's pool if it is a full-sized chunk */
+static int
+devils_reassembly_use_chunk(devils_reassembly *reassembly, size_t chunkIndex)
+{
+    devils_peer *peer = reassembly->peer;
+    devils_buffer *chunk = &reassembly->chunks[chunkIndex];
+    size_t allocationSize = reassembly->chunkSize == DEVILS_REASSEMBLY_CHUNK_SIZE ? DEVILS_REASSEMBLY_CHUNK_SIZE : chunk->dataLength;
+
+    if (devils_reassembly_reserve(reassembly, peer, allocationSize) < 0)
+        return -1;
+
+    chunk->data = allocationSize == DEVILS_REASSEMBLY_CHUNK_SIZE ? devils_reassembly_acquire_chunk(peer->host) : devils_malloc(allocationSize);
+    if (chunk->data == NULL)
+    {
+        peer->totalWaitingData -= allocationSize;
+        peer->host->reassemblyData -= allocationSize;
+        reassembly->reservedData -= allocationSize;
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/** Creates empty reassembly storage for a fragmented packet.
+    @param peer peer the fragments arrive from
+    @param totalLength advertised length of the whole packet
+    @param fragmentCount advertised number of fragments
+    @param fragments set to a bitmap of received fragments, cleared, that lives as long as the storage
+    @returns the storage on success, NULL on failure or if the peer or host is over its waiting data limit
+    @remarks Unless the host delivers chunked packets, the storage is a single buffer of the packet's
+    length, allocated as the first fragment lands so that the packet can own it unchanged. Otherwise
+    it is a table of pooled chunks, each taken as a fragment first lands in it. The storage itself,
+    the chunk table and the bitmap, and every chunk count towards the peer's and the host's waiting
+    data from when they are allocated.
+*/
+devils_reassembly *
+devils_reassembly_create(devils_peer *peer, size_t totalLength, devils_uint32 fragmentCount, devils_uint32 **fragments)
+{
+    size_t chunkSize = peer->host->chunkedPackets ? DEVILS_REASSEMBLY_CHUNK_SIZE : totalLength,
+           fragmentWords = (fragmentCount + 31) / 32, chunkCount, chunkIndex, storageSize;
+    devils_reassembly *reassembly;
+
+    if (chunkSize == 0)
+        chunkSize = 1;
+    chunkCount = (totalLength + chunkSize - 1) / chunkSize;
+    if (chunkCount == 0)
+        chunkCount = 1;
+    if (fragmentWords == 0)
+        fragmentWords = 1;
+
+    storageSize = sizeof(devils_reassembly) + (fragmentWords - 1) * sizeof(devils_uint32);
+    if (devils_reassembly_reserve(NULL, peer, storageSize + chunkCount * sizeof(devils_buffer)) < 0)
+        return NULL;
+
+    reassembly = (devils_reassembly *)devils_malloc(storageSize);
+    if (reassembly != NULL)
+    {
+        reassembly->chunks = (devils_buffer *)devils_malloc(chunkCount * sizeof(devils_buffer));
+        if (reassembly->chunks == NULL)
+        {
+            devils_free(reassembly);
+            reassembly = NULL;
+        }
+    }
+    if (reassembly == NULL)
+    {
+        peer->totalWaitingData -= storageSize + chunkCount * sizeof(devils_buffer);
+        peer->host->reassemblyData -= storageSize + chunkCount * sizeof(devils_buffer);
+
+        return NULL;
+    }
+
+    reassembly->peer = peer;
+    reassembly->chunkSize = chunkSize;
+    reassembly->chunkCount = chunkCount;
+    reassembly->reservedData = storageSize + chunkCount * sizeof(devils_buffer);
+
+    for (chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex)
+    {
+        reassembly->chunks[chunkIndex].data = NULL;
+        reassembly->chunks[chunkIndex].dataLength = chunkIndex + 1 < chunkCount ? chunkSize : totalLength - chunkIndex * chunkSize;
+    }
+
+    memset(reassembly->fragments, 0, fragmentWords * sizeof(devils_uint32));
+    *fragments = reassembly->fragments;
+
+    return reassembly;
+}
+
+/** Releases a reassembly's chunks and frees it.
+    @param reassembly storage to destroy, may be NULL
+*/
+void devils_reassembly_destroy(devils_reassembly *reassembly)
+{
+    devils_peer *peer;
+    devils_host *host;
+    size_t chunkIndex;
+
+    if (reassembly == NULL)
+        return;
+
+    peer = reassembly->peer;
+    host = peer->host;
+
+    for (chunkIndex = 0; chunkIndex < reassembly->chunkCount; ++chunkIndex)
+    {
+        if (reassembly->chunks[chunkIndex].data == NULL)
+            continue;
+
+        if (reassembly->chunkSize == DEVILS_REASSEMBLY_CHUNK_SIZE)
+            devils_reassembly_release_chunk(host, (devils_uint8 *)reassembly->chunks[chunkIndex].data);
+        else
+            devils_free(reassembly->chunks[chunkIndex].data);
+    }
+
+    peer->totalWaitingData -= reassembly->reservedData;
+    host->reassemblyData -= reassembly->reservedData;
+
+    devils_free(reassembly->chunks);
+    devils_free(reassembly);
+}
+
+/** Stores one fragment's data.
+    @param reassembly storage to write into
+    @param offset offset of the data within the packet, already checked against the packet's length
+    @param data fragment data
+    @param dataLength length of the fragment data
+    @retval 0 on success
+    @retval < 0 if a chunk could not be allocated or the peer or host is over its waiting data limit
+*/
+int devils_reassembly_write(devils_reassembly *reassembly, size_t offset, const void *data, size_t dataLength)
+{
+    const devils_uint8 *source = (const devils_uint8 *)data;
+    size_t chunkIndex, chunkOffset, copyLength;
+
+    while (dataLength > 0)
+    {
+        chunkIndex = offset / reassembly->chunkSize;
+        chunkOffset = offset % reassembly->chunkSize;
+        copyLength = reassembly->chunks[chunkIndex].dataLength - chunkOffset;
+        if (copyLength > dataLength)
+            copyLength = dataLength;
+
+        if (reassembly->chunks[chunkIndex].data == NULL &&
+            devils_reassembly_use_chunk(reassembly, chunkIndex) < 0)
+            return -1;
+
+        memcpy((devils_uint8 *)reassembly->chunks[chunkIndex].data + chunkOffset, source, copyLength);
+
+        source += copyLength;
+        offset += copyLength;
+        dataLength -= copyLength;
+    }
+
+    return 0;
+}
+
+/** Hands a complete packet's storage to the packet without copying it.
+    @param reassembly storage holding every fragment of the packet; destroyed on success
+    @param packet packet created with DEVILS_PACKET_FLAG_NO_ALLOCATE and no data
+    @retval 0 on success
+    @retval < 0 on failure, leaving both the reassembly and the packet untouched
+    @remarks A packet held by a single chunk takes it as its data. Otherwise the packet takes the
+    chunk table and is flagged DEVILS_PACKET_FLAG_CHUNKED. Chunks no fragment landed in are
+    allocated and zeroed here.
+*/
+int devils_reassembly_finish(devils_reassembly *reassembly, devils_packet *packet)
+{
+    devils_peer *peer = reassembly->peer;
+    size_t chunkIndex;
+
+    for (chunkIndex = 0; chunkIndex < reassembly->chunkCount; ++chunkIndex)
+    {
+        if (reassembly->chunks[chunkIndex].data != NULL)
+            continue;
+
+        if (devils_reassembly_use_chunk(reassembly, chunkIndex) < 0)
+            return -1;
+
+        memset(reassembly->chunks[chunkIndex].data, 0, reassembly->chunks[chunkIndex].dataLength);
+    }
+
+    if (reassembly->chunkCount == 1)
+    {
+        packet->data = (devils_uint8 *)reassembly->chunks[0].data;
+        devils_free(reassembly->chunks);
+    }
+    else
+    {
+        packet->chunks = reassembly->chunks;
+        packet->chunkCount = reassembly->chunkCount;
+        packet->flags |= DEVILS_PACKET_FLAG_CHUNKED;
+    }
+    packet->flags &= ~DEVILS_PACKET_FLAG_NO_ALLOCATE;
+
+    peer->totalWaitingData -= reassembly->reservedData;
+    peer->host->reassemblyData -= reassembly->reservedData;
+    peer->totalWaitingData += packet->dataLength;
+
+    devils_free(reassembly);
+
+    return 0;
+}
+
+void devils_host_flush_reassembly_pool(devils_host *host)
+{
+    devils_uint8 *chunk;
+
+    while (host->reassemblyPool != NULL)
+    {
+        chunk = host->reassemblyPool;
+        host->reassemblyPool = *(devils_uint8 **)chunk;
+
+        devils_free(chunk);
+    }
+
+    host->reassemblyPoolCount = 0;
+}
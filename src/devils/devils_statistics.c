@@ -0,0 +1,182 @@
+/**
+ @file statistics.c
+ @brief Traffic counters, latency histograms and statistics snapshots
+*/
+#define DEVILS_BUILDING_LIB 1
+#include <string.h>
+#include "include/devils.h"
+
+static size_t
+devils_histogram_bucket(devils_uint32 value)
+{
+    size_t exponent, bucket;
+
+    if (value < DEVILS_HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    for (exponent = DEVILS_HISTOGRAM_SUB_BUCKET_BITS; exponent < 31 && value >> (exponent + 1); ++exponent)
+        ;
+
+    /* the bits below the leading one select the sub-bucket within its power of two */
+    bucket = DEVILS_HISTOGRAM_SUB_BUCKETS * (exponent - DEVILS_HISTOGRAM_SUB_BUCKET_BITS + 1) +
+             ((value >> (exponent - DEVILS_HISTOGRAM_SUB_BUCKET_BITS)) & (DEVILS_HISTOGRAM_SUB_BUCKETS - 1));
+
+    return bucket < DEVILS_HISTOGRAM_BUCKETS ? bucket : DEVILS_HISTOGRAM_BUCKETS - 1;
+}
+
+void devils_histogram_record(devils_histogram *histogram, devils_uint32 value)
+{
+    ++histogram->counts[devils_histogram_bucket(value)];
+}
+
+/** Returns the smallest value counted by a histogram bucket.
+    @param bucket index of the bucket, below DEVILS_HISTOGRAM_BUCKETS
+    @returns the lower bound of the bucket in milliseconds
+*/
+devils_uint32
+devils_histogram_bucket_floor(size_t bucket)
+{
+    if (bucket < DEVILS_HISTOGRAM_SUB_BUCKETS)
+        return (devils_uint32)bucket;
+
+    /* the inverse of devils_histogram_bucket(): the leading one and sub-bucket bits, shifted back into place */
+    return (devils_uint32)(DEVILS_HISTOGRAM_SUB_BUCKETS + bucket % DEVILS_HISTOGRAM_SUB_BUCKETS) << (bucket / DEVILS_HISTOGRAM_SUB_BUCKETS - 1);
+}
+
+/** Estimates a percentile of the values recorded in a histogram.
+    @param histogram histogram to inspect
+    @param percent percentile to estimate, from 0 to 100
+    @returns the lower bound of the bucket holding the percentile, or 0 if the histogram is empty
+*/
+devils_uint32
+devils_histogram_percentile(const devils_histogram *histogram, devils_uint32 percent)
+{
+    devils_uint64 total = 0, threshold, count = 0;
+    size_t bucket;
+
+    for (bucket = 0; bucket < DEVILS_HISTOGRAM_BUCKETS; ++bucket)
+        total += histogram->counts[bucket];
+
+    if (total == 0)
+        return 0;
+
+    threshold = (total * (percent < 100 ? percent : 100) + 99) / 100;
+    if (threshold == 0)
+        threshold = 1;
+
+    for (bucket = 0; bucket < DEVILS_HISTOGRAM_BUCKETS - 1; ++bucket)
+    {
+        count += histogram->counts[bucket];
+        if (count >= threshold)
+            break;
+    }
+
+    return devils_histogram_bucket_floor(bucket);
+}
+
+/** Takes a snapshot of a host's statistics.
+    @param host host to inspect
+    @param statistics filled in with the host's counters
+    @remarks Runs in time proportional to the number of peers.
+*/
+void devils_host_get_statistics(devils_host *host, devils_host_statistics *statistics)
+{
+    devils_peer *currentPeer;
+
+    statistics->counters = host->counters;
+    statistics->connectedPeers = host->connectedPeers;
+
+    for (currentPeer = host->peers;
+         currentPeer < &host->peers[host->peerCount];
+         ++currentPeer)
+    {
+        if (currentPeer->state == DEVILS_PEER_STATE_DISCONNECTED)
+            continue;
+
+        statistics->counters.commandsSent += currentPeer->counters.commandsSent;
+        statistics->counters.commandsReceived += currentPeer->counters.commandsReceived;
+        statistics->counters.commandsRetransmitted += currentPeer->counters.commandsRetransmitted;
+        statistics->counters.commandsDropped += currentPeer->counters.commandsDropped;
+        statistics->counters.commandsThrottled += currentPeer->counters.commandsThrottled;
+        statistics->counters.commandsExpired += currentPeer->counters.commandsExpired;
+    }
+}
+
+/** Takes a snapshot of a peer's statistics.
+    @param peer peer to inspect
+    @param statistics filled in with the peer's counters, histograms and current link estimates
+    @remarks Counters and histograms start over whenever the peer is reset.
+*/
+void devils_peer_get_statistics(devils_peer *peer, devils_peer_statistics *statistics)
+{
+    statistics->counters = peer->counters;
+    statistics->roundTripTimes = peer->roundTripTimes;
+    statistics->queueDelays = peer->queueDelays;
+    statistics->roundTripTime = peer->roundTripTime;
+    statistics->roundTripTimeVariance = peer->roundTripTimeVariance;
+    statistics->packetLoss = peer->packetLoss;
+    statistics->packetLossVariance = peer->packetLossVariance;
+    statistics->packetThrottle = peer->packetThrottle;
+    statistics->reliableDataInTransit = peer->reliableDataInTransit;
+    statistics->channelCount = peer->channelCount;
+}
+
+/** Takes a snapshot of the queue depths of a peer's channels.
+    @param peer peer to inspect
+    @param statistics array filled in with one entry per channel
+    @param channelCount number of entries available in statistics
+    @returns the number of entries filled in, the lesser of channelCount and the peer's channel count
+    @remarks Runs in time proportional to the number of queued and unacknowledged commands.
+*/
+size_t
+devils_peer_get_channel_statistics(devils_peer *peer, devils_channel_statistics *statistics, size_t channelCount)
+{
+    devils_list_iterator currentCommand;
+    devils_channel_state *state;
+    size_t channelID;
+
+    if (channelCount > peer->channelCount)
+        channelCount = peer->channelCount;
+
+    memset(statistics, 0, channelCount * sizeof(devils_channel_statistics));
+
+    for (channelID = 0; channelID < channelCount; ++channelID)
+    {
+        state = peer->channels[channelID].state;
+        if (state == NULL)
+            continue;
+
+        statistics[channelID].outgoingReliableCommands = (devils_uint32)devils_list_size(&state->outgoingReliableCommands);
+        statistics[channelID].outgoingUnreliableCommands = (devils_uint32)devils_list_size(&state->outgoingUnreliableCommands);
+        statistics[channelID].incomingReliableCommands = (devils_uint32)state->incomingReliableCount;
+        statistics[channelID].incomingUnreliableCommands = (devils_uint32)devils_list_size(&state->incomingUnreliableCommands);
+    }
+
+    for (currentCommand = devils_list_begin(&peer->sentReliableCommands);
+         currentCommand != devils_list_end(&peer->sentReliableCommands);
+         currentCommand = devils_list_next(currentCommand))
+    {
+        devils_outgoing_command *outgoingCommand = (devils_outgoing_command *)currentCommand;
+
+        if (outgoingCommand->command.header.channelID < channelCount)
+            statistics[outgoingCommand->command.header.channelID].reliableDataInTransit += outgoingCommand->fragmentLength;
+    }
+
+    return channelCount;
+}
+
+void devils_peer_retire_statistics(devils_peer *peer)
+{
+    devils_counters *counters = &peer->host->counters;
+
+    counters->commandsSent += peer->counters.commandsSent;
+    counters->commandsReceived += peer->counters.commandsReceived;
+    counters->commandsRetransmitted += peer->counters.commandsRetransmitted;
+    counters->commandsDropped += peer->counters.commandsDropped;
+    counters->commandsThrottled += peer->counters.commandsThrottled;
+    counters->commandsExpired += peer->counters.commandsExpired;
+
+    memset(&peer->counters, 0, sizeof(peer->counters));
+    memset(&peer->roundTripTimes, 0, sizeof(peer->roundTripTimes));
+    memset(&peer->queueDelays, 0, sizeof(peer->queueDelays));
+}
@@ -0,0 +1,261 @@
+/**
+ @file stream.c
+ @brief Streams of data of any length sent as a windowed run of reliable packets
+*/
+#define DEVILS_BUILDING_LIB 1
+#include "include/devils.h"
+
+enum
+{
+    DEVILS_STREAM_FLAG_ENDED = (1 << 0),  /* the zero-length packet ending the stream has been queued */
+    DEVILS_STREAM_FLAG_CLOSED = (1 << 1), /* the application has released the stream */
+    DEVILS_STREAM_FLAG_FAILED = (1 << 2)  /* the peer disconnected or refused a packet */
+};
+
+static void DEVILS_CALLBACK
+devils_stream_release_chunk(devils_packet *packet)
+{
+    devils_stream *stream = (devils_stream *)packet->userData;
+
+    stream->dataInFlight -= packet->dataLength;
+    --stream->chunksInFlight;
+}
+
+/* the largest packet the peer sends without fragmenting it */
+static size_t
+devils_stream_chunk_length(devils_stream *stream)
+{
+    devils_peer *peer = stream->peer;
+    size_t chunkLength = peer->mtu - sizeof(devils_protocol_header) - sizeof(devils_protocol_send_fragment);
+
+    if (peer->host->checksum != NULL)
+        chunkLength -= sizeof(devils_uint32);
+    if (peer->outgoingPeerID >= DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID)
+        chunkLength -= sizeof(devils_uint32);
+
+    return chunkLength;
+}
+
+static int
+devils_stream_is_open(devils_stream *stream)
+{
+    if (stream->flags & (DEVILS_STREAM_FLAG_ENDED | DEVILS_STREAM_FLAG_FAILED))
+        return 0;
+
+    if (stream->peer->state != DEVILS_PEER_STATE_CONNECTED || stream->peer->connectID != stream->connectID)
+    {
+        stream->flags |= DEVILS_STREAM_FLAG_FAILED;
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+devils_stream_send_chunk(devils_stream *stream, devils_packet *packet)
+{
+    packet->freeCallback = devils_stream_release_chunk;
+    packet->userData = stream;
+
+    stream->dataInFlight += packet->dataLength;
+    ++stream->chunksInFlight;
+
+    if (devils_peer_send(stream->peer, stream->channelID, packet) < 0)
+    {
+        devils_packet_destroy(packet);
+
+        stream->flags |= DEVILS_STREAM_FLAG_FAILED;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+devils_stream_end(devils_stream *stream)
+{
+    devils_packet *packet;
+
+    if (!devils_stream_is_open(stream))
+        return;
+
+    stream->flags |= DEVILS_STREAM_FLAG_ENDED;
+
+    packet = devils_packet_create(NULL, 0, DEVILS_PACKET_FLAG_RELIABLE | DEVILS_PACKET_FLAG_STREAM);
+    if (packet == NULL)
+    {
+        stream->flags |= DEVILS_STREAM_FLAG_FAILED;
+        return;
+    }
+
+    devils_stream_send_chunk(stream, packet);
+}
+
+/** Opens a stream to a peer on one of its channels.
+    @param peer peer to send the stream to
+    @param channelID channel the stream's packets are sent on; ordinary packets on the channel interleave with them
+    @param read callback that pulls the stream's data as its window opens, or NULL to push the data with devils_stream_write()
+    @param userData initial value of the stream's userData field
+    @returns the stream on success, NULL on failure or if a stream on the channel has not yet ended
+    @remarks The stream's packets reach the receiver flagged DEVILS_PACKET_FLAG_STREAM. The stream fails once
+    its peer disconnects, even if the peer then reconnects. The read callback is called from within devils_host_service() and devils_host_flush(), and must
+    not destroy the stream's host or reset its peer. Every stream must eventually be released with
+    devils_stream_close(), even after its peer has disconnected.
+*/
+devils_stream *
+devils_stream_open(devils_peer *peer, devils_uint8 channelID, devils_stream_read_callback read, void *userData)
+{
+    devils_list_iterator currentStream;
+    devils_stream *stream;
+
+    if (peer->state != DEVILS_PEER_STATE_CONNECTED || channelID >= peer->channelCount)
+        return NULL;
+
+    for (currentStream = devils_list_begin(&peer->host->streams);
+         currentStream != devils_list_end(&peer->host->streams);
+         currentStream = devils_list_next(currentStream))
+    {
+        stream = (devils_stream *)currentStream;
+
+        if (stream->peer == peer && stream->channelID == channelID && devils_stream_is_open(stream))
+            return NULL;
+    }
+
+    stream = (devils_stream *)devils_malloc(sizeof(devils_stream));
+    if (stream == NULL)
+        return NULL;
+
+    stream->peer = peer;
+    stream->connectID = peer->connectID;
+    stream->channelID = channelID;
+    stream->read = read;
+    stream->userData = userData;
+    stream->window = DEVILS_STREAM_DEFAULT_WINDOW;
+    stream->dataInFlight = 0;
+    stream->chunksInFlight = 0;
+    stream->flags = 0;
+
+    devils_list_insert(devils_list_end(&peer->host->streams), &stream->streamList);
+
+    return stream;
+}
+
+/** Queues data on a stream opened without a read callback.
+    @param stream stream to write to
+    @param data data to append to the stream
+    @param dataLength number of bytes of data
+    @returns the number of bytes accepted, which is less than dataLength once the stream's window is full, or < 0 if
+    the stream has ended or its peer has disconnected
+    @remarks Data that was not accepted should be written again after servicing the host, once acknowledgements
+    have made room in the window.
+*/
+int devils_stream_write(devils_stream *stream, const void *data, size_t dataLength)
+{
+    const devils_uint8 *source = (const devils_uint8 *)data;
+    size_t chunkLength = devils_stream_chunk_length(stream), accepted = 0, length;
+    devils_packet *packet;
+
+    if (stream->read != NULL || !devils_stream_is_open(stream))
+        return -1;
+
+    if (dataLength > 0x7FFFFFFF)
+        dataLength = 0x7FFFFFFF;
+
+    while (accepted < dataLength && stream->dataInFlight < stream->window)
+    {
+        length = dataLength - accepted;
+        if (length > chunkLength)
+            length = chunkLength;
+
+        packet = devils_packet_create(source + accepted, length, DEVILS_PACKET_FLAG_RELIABLE | DEVILS_PACKET_FLAG_STREAM);
+        if (packet == NULL || devils_stream_send_chunk(stream, packet) < 0)
+            break;
+
+        accepted += length;
+    }
+
+    if (accepted == 0 && (stream->flags & DEVILS_STREAM_FLAG_FAILED))
+        return -1;
+
+    return (int)accepted;
+}
+
+/** Ends a stream and releases it.
+    @param stream stream to close; it may not be used afterwards
+    @remarks Data already queued is still delivered, followed by the zero-length packet that tells the
+    receiver the stream has ended. A pulling stream ends here even if its read callback had more to give.
+*/
+void devils_stream_close(devils_stream *stream)
+{
+    devils_stream_end(stream);
+
+    stream->flags |= DEVILS_STREAM_FLAG_CLOSED;
+
+    if (stream->chunksInFlight == 0)
+    {
+        devils_list_remove(&stream->streamList);
+
+        devils_free(stream);
+    }
+}
+
+void devils_host_pump_streams(devils_host *host)
+{
+    devils_list_iterator currentStream, nextStream;
+    devils_stream *stream;
+    devils_packet *packet;
+    size_t chunkLength;
+    int length;
+
+    for (currentStream = devils_list_begin(&host->streams);
+         currentStream != devils_list_end(&host->streams);
+         currentStream = nextStream)
+    {
+        stream = (devils_stream *)currentStream;
+        nextStream = devils_list_next(currentStream);
+
+        if (stream->flags & DEVILS_STREAM_FLAG_CLOSED)
+        {
+            if (stream->chunksInFlight == 0)
+            {
+                devils_list_remove(&stream->streamList);
+
+                devils_free(stream);
+            }
+            continue;
+        }
+
+        if (stream->read == NULL)
+            continue;
+
+        chunkLength = devils_stream_chunk_length(stream);
+
+        while (stream->dataInFlight < stream->window && devils_stream_is_open(stream))
+        {
+            packet = devils_packet_create(NULL, chunkLength, DEVILS_PACKET_FLAG_RELIABLE | DEVILS_PACKET_FLAG_STREAM);
+            if (packet == NULL)
+                break;
+
+            length = stream->read(stream, packet->data, chunkLength);
+            if (length <= 0)
+            {
+                devils_packet_destroy(packet);
+
+                if (length == 0)
+                    devils_stream_end(stream);
+                break;
+            }
+
+            if ((size_t)length < chunkLength)
+                devils_packet_resize(packet, length);
+
+            devils_stream_send_chunk(stream, packet);
+        }
+    }
+}
+
+void devils_host_destroy_streams(devils_host *host)
+{
+    while (!devils_list_empty(&host->streams))
+        devils_free(devils_list_remove(devils_list_begin(&host->streams)));
+}
@@ -0,0 +1,224 @@
+/**
+ @file traffic.c
+ @brief Hierarchical token bucket traffic classes sharing a host's outgoing bandwidth
+*/
+#define DEVILS_BUILDING_LIB 1
+#include "include/devils_utility.h"
+#include "include/devils_time.h"
+#include "include/devils.h"
+
+enum
+{
+    DEVILS_TRAFFIC_CLASS_BURST_INTERVAL = 20,     /* milliseconds of its rates a class may send at once */
+    DEVILS_TRAFFIC_CLASS_MAXIMUM_DEBT = 1 << 30   /* tokens a class may owe after sends that bypassed it */
+};
+
+static int
+devils_traffic_class_burst(devils_traffic_class *trafficClass, devils_uint32 rate)
+{
+    devils_uint32 burst = rate / (1000 / DEVILS_TRAFFIC_CLASS_BURST_INTERVAL);
+
+    return (int)DEVILS_MAX(burst, 2 * trafficClass->host->mtu);
+}
+
+static int
+devils_traffic_class_fill(devils_traffic_class *trafficClass, int tokens, devils_uint32 rate, devils_uint32 elapsedTime)
+{
+    long long filled = tokens + ((long long)rate * elapsedTime) / 1000;
+    int burst = devils_traffic_class_burst(trafficClass, rate);
+
+    return filled > burst ? burst : (int)filled;
+}
+
+static void
+devils_traffic_class_refill(devils_traffic_class *trafficClass, devils_uint32 serviceTime)
+{
+    devils_uint32 elapsedTime = DEVILS_TIME_DIFFERENCE(serviceTime, trafficClass->epoch);
+
+    if (elapsedTime == 0)
+        return;
+
+    trafficClass->epoch = serviceTime;
+
+    if (trafficClass->rate != 0)
+        trafficClass->tokens = devils_traffic_class_fill(trafficClass, trafficClass->tokens, trafficClass->rate, elapsedTime);
+    if (trafficClass->ceiling != 0)
+        trafficClass->ceilingTokens = devils_traffic_class_fill(trafficClass, trafficClass->ceilingTokens, trafficClass->ceiling, elapsedTime);
+}
+
+/* whether a class may send on its own rate rather than borrow from its parent */
+static int
+devils_traffic_class_is_green(const devils_traffic_class *trafficClass)
+{
+    if (trafficClass->rate == 0)
+        return trafficClass->parent == NULL;
+
+    return trafficClass->tokens >= 0;
+}
+
+static int
+devils_traffic_class_debit(int tokens, size_t length)
+{
+    long long debited = tokens - (long long)length;
+
+    return debited < -DEVILS_TRAFFIC_CLASS_MAXIMUM_DEBT ? -DEVILS_TRAFFIC_CLASS_MAXIMUM_DEBT : (int)debited;
+}
+
+/** Creates a traffic class to share out a host's outgoing bandwidth among its peers.
+    @param host host whose peers may be assigned to the class
+    @param parent class the new class borrows spare bandwidth from, or NULL for a top-level class
+    @param rate bytes/second the class is guaranteed; a top-level class given 0 is unlimited
+    @param ceiling bytes/second the class may reach by borrowing, or 0 to be bounded only by its ancestors
+    @returns the class on success, NULL on failure
+    @remarks Datagrams to a peer in a class are only built while the class has tokens of its own rate,
+    or while some ancestor does and no class in between has exceeded its ceiling. Sending charges the
+    class and every ancestor up to the one lent from, so rates guaranteed to children must fit within
+    their parent's rate for the guarantees to hold; a top-level class should be given the uplink's rate.
+    Classes still alive when their host is destroyed are destroyed with it.
+*/
+devils_traffic_class *
+devils_traffic_class_create(devils_host *host, devils_traffic_class *parent, devils_uint32 rate, devils_uint32 ceiling)
+{
+    devils_traffic_class *trafficClass;
+
+    if (parent != NULL && parent->host != host)
+        return NULL;
+
+    trafficClass = (devils_traffic_class *)devils_malloc(sizeof(devils_traffic_class));
+    if (trafficClass == NULL)
+        return NULL;
+
+    trafficClass->host = host;
+    trafficClass->parent = parent;
+    trafficClass->rate = rate;
+    trafficClass->ceiling = ceiling;
+    trafficClass->tokens = devils_traffic_class_burst(trafficClass, rate);
+    trafficClass->ceilingTokens = devils_traffic_class_burst(trafficClass, ceiling);
+    trafficClass->epoch = devils_time_get();
+    trafficClass->sentData = 0;
+    trafficClass->borrowedData = 0;
+
+    devils_list_insert(devils_list_end(&host->trafficClasses), &trafficClass->classList);
+
+    return trafficClass;
+}
+
+/** Destroys a traffic class.
+    @param trafficClass class to destroy
+    @remarks The class's peers and child classes move to its parent class, or become unclassified
+    if it had none.
+*/
+void devils_traffic_class_destroy(devils_traffic_class *trafficClass)
+{
+    devils_host *host;
+    devils_list_iterator currentClass;
+    devils_peer *currentPeer;
+
+    if (trafficClass == NULL)
+        return;
+
+    host = trafficClass->host;
+
+    for (currentClass = devils_list_begin(&host->trafficClasses);
+         currentClass != devils_list_end(&host->trafficClasses);
+         currentClass = devils_list_next(currentClass))
+    {
+        devils_traffic_class *childClass = (devils_traffic_class *)currentClass;
+
+        if (childClass->parent == trafficClass)
+            childClass->parent = trafficClass->parent;
+    }
+
+    for (currentPeer = host->peers;
+         currentPeer < &host->peers[host->peerCount];
+         ++currentPeer)
+    {
+        if (currentPeer->trafficClass == trafficClass)
+            currentPeer->trafficClass = trafficClass->parent;
+    }
+
+    devils_list_remove(&trafficClass->classList);
+
+    devils_free(trafficClass);
+}
+
+/** Assigns a peer to a traffic class.
+    @param peer peer to assign
+    @param trafficClass class of the peer's host, or NULL to leave the peer unclassified
+    @remarks Unclassified peers are only limited by their own pacing. A peer leaves its class
+    when it is reset, so a reused peer slot never inherits an old class.
+*/
+void devils_peer_traffic_class(devils_peer *peer, devils_traffic_class *trafficClass)
+{
+    if (trafficClass != NULL && trafficClass->host != peer->host)
+        return;
+
+    peer->trafficClass = trafficClass;
+}
+
+/** Decides whether a datagram may be built for a peer in a traffic class now.
+    @returns 1 if the class or an ancestor it may borrow from has tokens, 0 otherwise, in which case
+    host->pacingDeadline is brought forward to when that may change
+*/
+int devils_traffic_class_admit(devils_host *host, devils_traffic_class *trafficClass)
+{
+    devils_traffic_class *currentClass;
+    devils_uint32 waitTime = ~0, deadline;
+
+    for (currentClass = trafficClass; currentClass != NULL; currentClass = currentClass->parent)
+    {
+        devils_traffic_class_refill(currentClass, host->serviceTime);
+
+        if (currentClass->ceiling != 0 && currentClass->ceilingTokens < 0)
+        {
+            waitTime = DEVILS_MIN(waitTime, (devils_uint32)(((long long)-currentClass->ceilingTokens * 1000) / currentClass->ceiling));
+            break;
+        }
+
+        if (devils_traffic_class_is_green(currentClass))
+            return 1;
+
+        if (currentClass->rate != 0)
+            waitTime = DEVILS_MIN(waitTime, (devils_uint32)(((long long)-currentClass->tokens * 1000) / currentClass->rate));
+    }
+
+    if (waitTime == (devils_uint32)~0)
+        return 0;
+
+    deadline = host->serviceTime + waitTime + 1;
+    if (host->pacingDeadline == 0 || DEVILS_TIME_LESS(deadline, host->pacingDeadline))
+        host->pacingDeadline = DEVILS_MAX(deadline, 1);
+
+    return 0;
+}
+
+/** Charges a datagram sent to a peer to its traffic class and the class's ancestors.
+    @remarks Every class pays against its ceiling. Rate tokens are only paid from the first class
+    with tokens of its own upwards; classes below it borrowed and keep their debt unchanged.
+*/
+void devils_traffic_class_charge(devils_traffic_class *trafficClass, size_t length)
+{
+    devils_traffic_class *currentClass, *lender;
+
+    for (lender = trafficClass; lender != NULL; lender = lender->parent)
+    {
+        if (devils_traffic_class_is_green(lender))
+            break;
+    }
+
+    if (lender != NULL && lender != trafficClass)
+        trafficClass->borrowedData += length;
+
+    for (currentClass = trafficClass; currentClass != NULL; currentClass = currentClass->parent)
+    {
+        if (currentClass == lender)
+            lender = NULL;
+
+        if (lender == NULL && currentClass->rate != 0)
+            currentClass->tokens = devils_traffic_class_debit(currentClass->tokens, length);
+        if (currentClass->ceiling != 0)
+            currentClass->ceilingTokens = devils_traffic_class_debit(currentClass->ceilingTokens, length);
+
+        currentClass->sentData += length;
+    }
+}
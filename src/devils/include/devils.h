@@ -115,6 +115,10 @@ extern "C"
       /** packet will be fragmented using unreliable (instead of reliable) sends
      * if it exceeds the MTU */
       DEVILS_PACKET_FLAG_UNRELIABLE_FRAGMENT = (1 << 3),
+      /** packet data is held in chunks rather than in data, see devils_host_chunked_packets() */
+      DEVILS_PACKET_FLAG_CHUNKED = (1 << 4),
+      /** reliable packet belongs to a stream, see devils_stream_open() */
+      DEVILS_PACKET_FLAG_STREAM = (1 << 5),
 
       /** whether the packet has been sent from all queues it has been entered into */
       DEVILS_PACKET_FLAG_SENT = (1 << 8)
@@ -142,7 +146,16 @@ extern "C"
  *    DEVILS_PACKET_FLAG_UNRELIABLE_FRAGMENT - packet will be fragmented using unreliable
  *    (instead of reliable) sends if it exceeds the MTU
  *
+ *    DEVILS_PACKET_FLAG_CHUNKED - packet data is held in chunks rather than in data
+ *
+ *    DEVILS_PACKET_FLAG_STREAM - reliable packet belongs to a stream
+ *
  *    DEVILS_PACKET_FLAG_SENT - whether the packet has been sent from all queues it has been entered into
+ *
+ * A non-zero timeToLive bounds how long the packet may wait in a peer's queue. Once it
+ * runs out, the packet's unreliable sends are discarded. A reliable packet none of which has
+ * been sent yet is abandoned as well, and the receiver told to skip its sequence numbers,
+ * provided the peer supports that; otherwise it is still delivered.
    @sa devils_packet_flag
  */
    typedef struct _devils_packet
@@ -153,6 +166,9 @@ extern "C"
       size_t dataLength;                        /**< length of data */
       devils_packet_free_callback freeCallback; /**< function to be called when the packet is no longer in use */
       void *userData;                           /**< application private data, may be freely modified */
+      devils_uint32 timeToLive;                 /**< milliseconds the packet may wait to be sent before it is discarded, or 0 to wait indefinitely; may be freely modified before the packet is sent */
+      devils_buffer *chunks;                    /**< for a packet flagged DEVILS_PACKET_FLAG_CHUNKED, its data as chunkCount buffers in order, and data is NULL */
+      size_t chunkCount;
    } devils_packet;
 
    typedef struct _devils_acknowledgement
@@ -173,8 +189,12 @@ extern "C"
       devils_uint32 fragmentOffset;
       devils_uint16 fragmentLength;
       devils_uint16 sendAttempts;
+      devils_uint32 queueTime; /**< host-wide queue order, used to interleave a channel's reliable and unreliable commands */
+      devils_uint32 enqueueTime; /**< service time at which the command was queued, for the queueing delay histogram */
+      devils_uint32 fragmentsRemaining; /**< for a fragment cursor, fragments not yet generated; 0 for any other command */
       devils_protocol command;
       devils_packet *packet;
+      struct _devils_latest_entry *latestEntry; /**< key under which a later packet may replace this one, see devils_peer_send_latest() */
    } devils_outgoing_command;
 
    typedef struct _devils_incoming_command
@@ -185,7 +205,8 @@ extern "C"
       devils_protocol command;
       devils_uint32 fragmentCount;
       devils_uint32 fragmentsRemaining;
-      devils_uint32 *fragments;
+      devils_uint32 *fragments;              /**< fragments received so far, held by the reassembly */
+      struct _devils_reassembly *reassembly; /**< storage for a fragmented packet's data until every fragment has arrived */
       devils_packet *packet;
    } devils_incoming_command;
 
@@ -215,6 +236,11 @@ extern "C"
       DEVILS_HOST_DEFAULT_MTU = 1400,
       DEVILS_HOST_DEFAULT_MAXIMUM_PACKET_SIZE = 32 * 1024 * 1024,
       DEVILS_HOST_DEFAULT_MAXIMUM_WAITING_DATA = 32 * 1024 * 1024,
+      DEVILS_HOST_DEFAULT_MAXIMUM_REASSEMBLY_DATA = 256 * 1024 * 1024,
+      DEVILS_HOST_COOKIE_KEY_SIZE = 8,
+      DEVILS_HOST_SEND_BATCH_SIZE = 32,
+
+      DEVILS_STREAM_DEFAULT_WINDOW = 256 * 1024,
 
       DEVILS_PEER_DEFAULT_ROUND_TRIP_TIME = 500,
       DEVILS_PEER_DEFAULT_PACKET_THROTTLE = 32,
@@ -230,48 +256,145 @@ extern "C"
       DEVILS_PEER_TIMEOUT_MINIMUM = 5000,
       DEVILS_PEER_TIMEOUT_MAXIMUM = 30000,
       DEVILS_PEER_PING_INTERVAL = 500,
+      DEVILS_PEER_PATH_CHALLENGE_INTERVAL = 250,
+      DEVILS_PEER_PACING_BURST_INTERVAL = 20,
       DEVILS_PEER_UNSEQUENCED_WINDOWS = 64,
       DEVILS_PEER_UNSEQUENCED_WINDOW_SIZE = 1024,
       DEVILS_PEER_FREE_UNSEQUENCED_WINDOWS = 32,
       DEVILS_PEER_RELIABLE_WINDOWS = 16,
       DEVILS_PEER_RELIABLE_WINDOW_SIZE = 0x1000,
-      DEVILS_PEER_FREE_RELIABLE_WINDOWS = 8
+      DEVILS_PEER_FREE_RELIABLE_WINDOWS = 8,
+      DEVILS_PEER_INCOMING_RELIABLE_RING_MINIMUM_SIZE = 32,
+      DEVILS_PEER_INCOMING_RELIABLE_RING_MAXIMUM_SIZE = 2 * DEVILS_PEER_RELIABLE_WINDOW_SIZE,
+      DEVILS_PEER_CHANNEL_PRIORITIES = 4,
+      DEVILS_PEER_CHANNEL_DEFAULT_PRIORITY = 1,
+      DEVILS_PEER_CHANNEL_DEFAULT_WEIGHT = 1
    };
 
+   struct _devils_channel;
+
+   /**
+ * Queues and reordering state of a channel, only allocated while the channel has traffic
+ * in flight or waiting.
+ */
+   typedef struct _devils_channel_state
+   {
+      devils_list_node activeList;
+      struct _devils_channel *channel;
+      devils_uint16 reliableWindows[DEVILS_PEER_RELIABLE_WINDOWS];
+      devils_incoming_command **incomingReliableRing; /**< reliable commands awaiting dispatch, indexed by reliableSequenceNumber modulo incomingReliableRingSize, which spans at most two reliable windows and counts towards the peer's waiting data */
+      size_t incomingReliableRingSize;
+      size_t incomingReliableCount;
+      devils_list incomingUnreliableCommands;
+      devils_list outgoingReliableCommands;
+      devils_list outgoingUnreliableCommands;
+      devils_outgoing_command **sentReliableRing; /**< in-flight reliable commands, indexed by reliableSequenceNumber modulo sentReliableRingSize */
+      size_t sentReliableRingSize;
+      devils_uint32 deficit;
+      struct _devils_latest_table *latest; /**< queued commands by key, or NULL if devils_peer_send_latest() was never used */
+      devils_uint32 expiryTime;             /**< service time at which the first queued packet's timeToLive runs out, valid while expiring is set */
+      int expiring;
+   } devils_channel_state;
+
    typedef struct _devils_channel
    {
       devils_uint16 outgoingReliableSequenceNumber;
       devils_uint16 outgoingUnreliableSequenceNumber;
       devils_uint16 usedReliableWindows;
-      devils_uint16 reliableWindows[DEVILS_PEER_RELIABLE_WINDOWS];
       devils_uint16 incomingReliableSequenceNumber;
       devils_uint16 incomingUnreliableSequenceNumber;
-      devils_list incomingReliableCommands;
-      devils_list incomingUnreliableCommands;
+      devils_uint8 priority; /**< priority class, 0 being served first */
+      devils_uint16 weight;  /**< share of the priority class, in datagrams per round */
+      devils_uint8 unordered; /**< reliable packets received on the channel are delivered as soon as they are complete, see devils_peer_channel_unordered() */
+      devils_channel_state *state;     /**< queues of the channel, or NULL while it is idle */
+      struct _devils_channel_fec *fec; /**< forward error correction state, or NULL if never used on this channel */
    } devils_channel;
 
    typedef enum _devils_peer_flag
    {
-      DEVILS_PEER_FLAG_NEEDS_DISPATCH = (1 << 0)
+      DEVILS_PEER_FLAG_NEEDS_DISPATCH = (1 << 0),
+      DEVILS_PEER_FLAG_CONNECT_COOKIE = (1 << 1), /**< connectCookie holds a cookie to echo with CONNECT */
+      DEVILS_PEER_FLAG_SERIAL_UNRELIABLE = (1 << 2), /**< both sides let unreliable sequence numbers wrap around */
+      DEVILS_PEER_FLAG_WINDOW_SCALE = (1 << 3),      /**< both sides accept windows beyond DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE */
+      DEVILS_PEER_FLAG_SKIP = (1 << 4),              /**< both sides understand DEVILS_PROTOCOL_COMMAND_SKIP */
+      DEVILS_PEER_FLAG_REPAIR = (1 << 5)             /**< both sides understand DEVILS_PROTOCOL_COMMAND_SEND_REPAIR */
    } devils_peer_flag;
 
+/* the largest reliable window a peer may use */
+#define DEVILS_PEER_MAXIMUM_WINDOW_SIZE(peer) \
+   ((peer)->flags & DEVILS_PEER_FLAG_WINDOW_SCALE ? DEVILS_PROTOCOL_MAXIMUM_SCALED_WINDOW_SIZE : DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE)
+
+/* whether unreliable sequence number a precedes b within one reliable sequence number of a peer's channel */
+#define DEVILS_PEER_UNRELIABLE_LESS(peer, a, b) \
+   ((peer)->flags & DEVILS_PEER_FLAG_SERIAL_UNRELIABLE ? (devils_uint16)((a) - (b)) >= 0x8000 : (a) < (b))
+
+   enum
+   {
+      DEVILS_HISTOGRAM_SUB_BUCKET_BITS = 2,
+      DEVILS_HISTOGRAM_SUB_BUCKETS = 1 << DEVILS_HISTOGRAM_SUB_BUCKET_BITS,
+      DEVILS_HISTOGRAM_BUCKETS = 64 /**< buckets of a devils_histogram; values from 2^17 ms on share the last one */
+   };
+
+   /**
+ * A log-linear histogram of millisecond values: each power of two is split into
+ * DEVILS_HISTOGRAM_SUB_BUCKETS equal buckets, so a bucket is accurate to within 25%.
+ *
+ * @sa devils_histogram_bucket_floor()
+ * @sa devils_histogram_percentile()
+ */
+   typedef struct _devils_histogram
+   {
+      devils_uint32 counts[DEVILS_HISTOGRAM_BUCKETS];
+   } devils_histogram;
+
+   /**
+ * 64-bit traffic counters kept for a host and for each of its peers.
+ */
+   typedef struct _devils_counters
+   {
+      devils_uint64 packetsSent;           /**< UDP packets sent */
+      devils_uint64 packetsReceived;       /**< UDP packets received */
+      devils_uint64 bytesSent;
+      devils_uint64 bytesReceived;
+      devils_uint64 commandsSent;          /**< protocol commands placed into outgoing packets, retransmissions included */
+      devils_uint64 commandsReceived;      /**< protocol commands processed from incoming packets */
+      devils_uint64 commandsRetransmitted; /**< reliable commands that timed out and were queued again */
+      devils_uint64 commandsDropped;       /**< incoming commands discarded as duplicate, stale or out of window */
+      devils_uint64 commandsThrottled;     /**< outgoing unreliable commands discarded by the packet throttle */
+      devils_uint64 commandsExpired;       /**< outgoing commands discarded or skipped because their packet's timeToLive ran out */
+   } devils_counters;
+
    /**
  * An ENet peer which data packets may be sent or received from. 
  *
- * No fields should be modified unless otherwise specified. 
+ * No fields should be modified unless otherwise specified. Fields are grouped by how often
+ * the library touches them rather than by meaning, so the layout may change between releases;
+ * applications should prefer the devils_peer_get_*() accessors.
  */
    typedef struct _devils_peer
    {
+      /* scheduling state read on every service pass, kept together at the front */
       devils_list_node dispatchList;
+      devils_peer_state state;
+      devils_uint16 flags;
+      devils_uint16 reserved;
+      devils_uint32 outgoingPeerID;
+      devils_uint32 nextTimeout;
+      devils_uint32 lastReceiveTime;
+      devils_uint32 pingInterval;
+      devils_uint32 mtu;
+      devils_list acknowledgements;
+      devils_list sentReliableCommands;
+      devils_list outgoingCommands; /**< commands not bound to a channel */
+      devils_list activeChannels[DEVILS_PEER_CHANNEL_PRIORITIES];
+      devils_list sentUnreliableCommands;
+      devils_list repairCommands;
+
+      /* state used while building datagrams and throttling bandwidth */
       struct _devils_host *host;
-      devils_uint16 outgoingPeerID;
-      devils_uint16 incomingPeerID;
-      devils_uint32 connectID;
       devils_uint8 outgoingSessionID;
       devils_uint8 incomingSessionID;
       devils_address address; /**< Internet address of the peer */
-      void *data;             /**< Application private data, may be freely modified */
-      devils_peer_state state;
       devils_channel *channels;
       size_t channelCount;             /**< Number of channels allocated for communication with peer */
       devils_uint32 incomingBandwidth; /**< Downstream bandwidth of the client in bytes/second */
@@ -281,49 +404,89 @@ extern "C"
       devils_uint32 incomingDataTotal;
       devils_uint32 outgoingDataTotal;
       devils_uint32 lastSendTime;
-      devils_uint32 lastReceiveTime;
-      devils_uint32 nextTimeout;
       devils_uint32 earliestTimeout;
       devils_uint32 packetLossEpoch;
       devils_uint32 packetsSent;
       devils_uint32 packetsLost;
-      devils_uint32 packetLoss; /**< mean packet loss of reliable packets as a ratio with respect to the constant DEVILS_PEER_PACKET_LOSS_SCALE */
-      devils_uint32 packetLossVariance;
       devils_uint32 packetThrottle;
       devils_uint32 packetThrottleLimit;
       devils_uint32 packetThrottleCounter;
       devils_uint32 packetThrottleEpoch;
-      devils_uint32 packetThrottleAcceleration;
-      devils_uint32 packetThrottleDeceleration;
-      devils_uint32 packetThrottleInterval;
-      devils_uint32 pingInterval;
+      devils_uint32 roundTripTime; /**< mean round trip time (RTT), in milliseconds, between sending a reliable packet and receiving its acknowledgement */
+      devils_uint32 roundTripTimeVariance;
       devils_uint32 timeoutLimit;
       devils_uint32 timeoutMinimum;
       devils_uint32 timeoutMaximum;
-      devils_uint32 lastRoundTripTime;
-      devils_uint32 lowestRoundTripTime;
-      devils_uint32 lastRoundTripTimeVariance;
-      devils_uint32 highestRoundTripTimeVariance;
-      devils_uint32 roundTripTime; /**< mean round trip time (RTT), in milliseconds, between sending a reliable packet and receiving its acknowledgement */
-      devils_uint32 roundTripTimeVariance;
-      devils_uint32 mtu;
       devils_uint32 windowSize;
       devils_uint32 reliableDataInTransit;
+      devils_uint32 congestionWindow; /**< reliable data in transit allowed by the congestion controller, or 0 if the packet throttle window applies */
+      devils_uint32 pacingRate;       /**< send rate in bytes/second requested by the congestion controller, or 0 if unpaced */
+      devils_uint32 pacingTokens;
+      devils_uint32 pacingEpoch;
+      struct _devils_traffic_class *trafficClass; /**< class sharing out the host's outgoing bandwidth to this peer, or NULL, see devils_peer_traffic_class() */
+      void *congestionState;
       devils_uint16 outgoingReliableSequenceNumber;
-      devils_list acknowledgements;
-      devils_list sentReliableCommands;
-      devils_list sentUnreliableCommands;
-      devils_list outgoingCommands;
-      devils_list dispatchedCommands;
-      devils_uint16 flags;
-      devils_uint16 reserved;
-      devils_uint16 incomingUnsequencedGroup;
       devils_uint16 outgoingUnsequencedGroup;
-      devils_uint32 unsequencedWindow[DEVILS_PEER_UNSEQUENCED_WINDOW_SIZE / 32];
+
+      /* connection identity, statistics and configuration, touched rarely */
+      devils_uint32 incomingPeerID;
+      struct _devils_peer *nextPeer; /**< next peer in the free list or address bucket of the host */
+      struct _devils_peer **peerLink; /**< pointer to this peer within its address bucket */
+      devils_uint16 incomingUnsequencedGroup;
+      devils_uint32 connectID;
+      devils_uint32 connectCookie[2];
+      devils_uint16 incomingSentTime;   /**< newest sent time of a datagram received from the peer */
+      devils_address migrationAddress;  /**< new address of the peer awaiting a path challenge, see devils_host_migration() */
+      devils_uint32 migrationChallenge; /**< reliable sequence number and sent time the challenge's acknowledgement must echo, or 0 once answered */
+      devils_uint32 migrationTime;      /**< when the pending path challenge was sent, or 0 if none is pending */
+      void *data; /**< Application private data, may be freely modified */
+      devils_uint32 packetLoss; /**< mean packet loss of reliable packets as a ratio with respect to the constant DEVILS_PEER_PACKET_LOSS_SCALE */
+      devils_uint32 packetLossVariance;
+      devils_uint32 packetThrottleAcceleration;
+      devils_uint32 packetThrottleDeceleration;
+      devils_uint32 packetThrottleInterval;
+      devils_uint32 lastRoundTripTime;
+      devils_uint32 lowestRoundTripTime;
+      devils_uint32 lastRoundTripTimeVariance;
+      devils_uint32 highestRoundTripTimeVariance;
       devils_uint32 eventData;
+      devils_list dispatchedCommands;
       size_t totalWaitingData;
+      devils_uint32 unsequencedWindow[DEVILS_PEER_UNSEQUENCED_WINDOW_SIZE / 32];
+      devils_counters counters;
+      devils_histogram roundTripTimes; /**< round trip time of every acknowledged command */
+      devils_histogram queueDelays;    /**< time from queueing a command to its first transmission */
    } devils_peer;
 
+   /**
+ * A snapshot of a peer's statistics, see devils_peer_get_statistics().
+ */
+   typedef struct _devils_peer_statistics
+   {
+      devils_counters counters;
+      devils_histogram roundTripTimes;
+      devils_histogram queueDelays;
+      devils_uint32 roundTripTime;
+      devils_uint32 roundTripTimeVariance;
+      devils_uint32 packetLoss;            /**< ratio with respect to DEVILS_PEER_PACKET_LOSS_SCALE */
+      devils_uint32 packetLossVariance;
+      devils_uint32 packetThrottle;        /**< ratio with respect to DEVILS_PEER_PACKET_THROTTLE_SCALE */
+      devils_uint32 reliableDataInTransit; /**< bytes sent reliably and not yet acknowledged */
+      size_t channelCount;
+   } devils_peer_statistics;
+
+   /**
+ * Queue depths of one channel of a peer, see devils_peer_get_channel_statistics().
+ */
+   typedef struct _devils_channel_statistics
+   {
+      devils_uint32 outgoingReliableCommands;
+      devils_uint32 outgoingUnreliableCommands;
+      devils_uint32 incomingReliableCommands;   /**< received reliable commands waiting for earlier ones */
+      devils_uint32 incomingUnreliableCommands;
+      devils_uint32 reliableDataInTransit;      /**< bytes sent reliably on this channel and not yet acknowledged */
+   } devils_channel_statistics;
+
    /** An ENet packet compressor for compressing UDP packets before socket sends or receives.
  */
    typedef struct _devils_compressor
@@ -338,6 +501,24 @@ extern "C"
       void(DEVILS_CALLBACK *destroy)(void *context);
    } devils_compressor;
 
+   /** An ENet congestion controller that bounds reliable data in transit and paces sends to a peer in place of the packet throttle window.
+
+   The controller reports its decisions through the congestionWindow and pacingRate fields of the peer.
+ */
+   typedef struct _devils_congestion_control
+   {
+      /** Context data for the congestion controller, passed to every callback. May be NULL. */
+      void *context;
+      /** Allocates controller state for a peer when its connection is initiated or accepted. Must be non-NULL and should return NULL on failure. */
+      void *(DEVILS_CALLBACK *create)(void *context, struct _devils_peer *peer);
+      /** Called when a reliable command is acknowledged with the measured round trip time in milliseconds and the number of bytes no longer in transit. May be NULL. */
+      void(DEVILS_CALLBACK *acknowledge)(void *context, void *state, struct _devils_peer *peer, devils_uint32 roundTripTime, devils_uint32 bytesAcknowledged);
+      /** Called when a reliable command times out with the number of bytes queued for retransmission. May be NULL. */
+      void(DEVILS_CALLBACK *loss)(void *context, void *state, struct _devils_peer *peer, devils_uint32 bytesLost);
+      /** Destroys the state of a peer when it is reset or the controller is replaced. May be NULL. */
+      void(DEVILS_CALLBACK *destroy)(void *context, void *state);
+   } devils_congestion_control;
+
    /** Callback that computes the checksum of the data held in buffers[0:bufferCount-1] */
    typedef devils_uint32(DEVILS_CALLBACK *devils_checksum_callback)(const devils_buffer *buffers, size_t bufferCount);
 
@@ -356,6 +537,8 @@ extern "C"
     @sa devils_host_broadcast()
     @sa devils_host_compress()
     @sa devils_host_compress_with_range_coder()
+    @sa devils_host_congestion_control()
+    @sa devils_host_congestion_control_with_bbr()
     @sa devils_host_channel_limit()
     @sa devils_host_bandwidth_limit()
     @sa devils_host_bandwidth_throttle()
@@ -372,9 +555,18 @@ extern "C"
       int recalculateBandwidthLimits;
       devils_peer *peers;  /**< array of peers allocated for this host */
       size_t peerCount;    /**< number of peers allocated for this host */
+      devils_peer *freePeers;         /**< disconnected peers addressable by a compact header */
+      devils_peer *freeExtendedPeers; /**< disconnected peers that need an extended peer ID */
+      devils_peer **peerBuckets;      /**< peers in use, hashed by address */
+      size_t peerBucketMask;
       size_t channelLimit; /**< maximum number of channels allowed for connected peers */
       devils_uint32 serviceTime;
+      devils_uint32 pacingDeadline; /**< earliest time a paced peer may send again, or 0 if no peer is waiting on pacing */
+      devils_uint32 totalQueued;
       devils_list dispatchQueue;
+      devils_list groups; /**< groups created on this host, see devils_group_create() */
+      devils_list streams; /**< streams opened on this host's peers, see devils_stream_open() */
+      devils_list trafficClasses; /**< traffic classes created on this host, see devils_traffic_class_create() */
       int continueSending;
       size_t packetSize;
       devils_uint16 headerFlags;
@@ -383,8 +575,15 @@ extern "C"
       devils_buffer buffers[DEVILS_BUFFER_MAXIMUM];
       size_t bufferCount;
       devils_checksum_callback checksum; /**< callback the user can set to enable packet checksums for this host */
+      int migration;                     /**< whether connected peers may move to a new address, see devils_host_migration() */
+      struct _devils_host_cookies *cookies; /**< connect cookie state, or NULL if connecting peers are admitted directly */
       devils_compressor compressor;
+      devils_congestion_control congestionControl;
       devils_uint8 packetData[2][DEVILS_PROTOCOL_MAXIMUM_MTU];
+      devils_uint8 sendData[DEVILS_HOST_SEND_BATCH_SIZE][DEVILS_PROTOCOL_MAXIMUM_MTU]; /**< datagrams assembled by one service pass, handed to the socket together */
+      devils_buffer sendBuffers[DEVILS_HOST_SEND_BATCH_SIZE];
+      devils_address sendAddresses[DEVILS_HOST_SEND_BATCH_SIZE];
+      size_t sendCount;
       devils_address receivedAddress;
       devils_uint8 *receivedData;
       size_t receivedDataLength;
@@ -392,14 +591,103 @@ extern "C"
       devils_uint32 totalSentPackets;      /**< total UDP packets sent, user should reset to 0 as needed to prevent overflow */
       devils_uint32 totalReceivedData;     /**< total data received, user should reset to 0 as needed to prevent overflow */
       devils_uint32 totalReceivedPackets;  /**< total UDP packets received, user should reset to 0 as needed to prevent overflow */
+      devils_counters counters;            /**< non-wrapping totals; command counts only include peers that have since been reset */
       devils_intercept_callback intercept; /**< callback the user can set to intercept received raw UDP packets */
       size_t connectedPeers;
       size_t bandwidthLimitedPeers;
-      size_t duplicatePeers;     /**< optional number of allowed peers from duplicate IPs, defaults to DEVILS_PROTOCOL_MAXIMUM_PEER_ID */
+      struct _devils_bandwidth_share *bandwidthShares; /**< scratch space for devils_host_bandwidth_throttle(), allocated on first use */
+      size_t duplicatePeers;     /**< optional number of allowed peers from duplicate IPs, defaults to DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID */
       size_t maximumPacketSize;  /**< the maximum allowable packet size that may be sent or received on a peer */
       size_t maximumWaitingData; /**< the maximum aggregate amount of buffer space a peer may use waiting for packets to be delivered */
+      size_t maximumReassemblyData; /**< the maximum amount of buffer space all peers together may use for partially received packets */
+      size_t reassemblyData;        /**< buffer space currently used for partially received packets */
+      int chunkedPackets;           /**< whether fragmented packets are received into chunks, see devils_host_chunked_packets() */
+      int bandwidthPacing;          /**< whether peers without a pacing rate are paced to their incoming bandwidth, see devils_host_bandwidth_pacing() */
+      devils_uint8 *reassemblyPool;
+      size_t reassemblyPoolCount;
    } devils_host;
 
+   /**
+ * A snapshot of a host's statistics, see devils_host_get_statistics().
+ */
+   typedef struct _devils_host_statistics
+   {
+      devils_counters counters; /**< command counts include both current and past peers */
+      size_t connectedPeers;
+   } devils_host_statistics;
+
+   /**
+ * A set of peers of one host that can be sent the same packet together.
+ *
+ * @sa devils_group_create()
+ * @sa devils_group_send()
+ */
+   typedef struct _devils_group
+   {
+      devils_list_node groupList;
+      devils_host *host;
+      devils_uint32 *members; /**< one bit per entry of host->peers */
+      size_t wordCount;
+      size_t peerCount;       /**< number of member peers */
+   } devils_group;
+
+   /**
+ * A hierarchical token bucket class sharing a host's outgoing bandwidth among the peers assigned to it.
+ *
+ * A class sends at up to its guaranteed rate on its own tokens and beyond that, up to its ceiling,
+ * on spare tokens borrowed from its ancestors.
+ *
+ * @sa devils_traffic_class_create()
+ * @sa devils_peer_traffic_class()
+ */
+   typedef struct _devils_traffic_class
+   {
+      devils_list_node classList;
+      devils_host *host;
+      struct _devils_traffic_class *parent;
+      devils_uint32 rate;    /**< guaranteed bytes/second, may be freely modified */
+      devils_uint32 ceiling; /**< bytes/second reachable by borrowing, or 0 for no limit beyond the ancestors', may be freely modified */
+      int tokens;
+      int ceilingTokens;
+      devils_uint32 epoch;
+      devils_uint64 sentData;     /**< bytes sent to peers of this class and its descendants */
+      devils_uint64 borrowedData; /**< bytes sent to peers of this class on tokens borrowed from an ancestor */
+   } devils_traffic_class;
+
+   struct _devils_stream;
+
+   /** Callback that supplies a stream's next data.
+    @returns the number of bytes written to the buffer, 0 once the stream's data is exhausted, or < 0 if no data is available yet
+*/
+   typedef int(DEVILS_CALLBACK *devils_stream_read_callback)(struct _devils_stream *stream, void *buffer, size_t length);
+
+   /**
+ * An ordered stream of data of any length sent on one channel of a peer.
+ *
+ * The data is sent as reliable packets small enough to need no fragmentation, and only as many of
+ * them as fit in the stream's window are held by the library at once. The receiver gets them as
+ * DEVILS_EVENT_TYPE_RECEIVE events on the channel, in order, flagged DEVILS_PACKET_FLAG_STREAM to
+ * set them apart from ordinary packets on the channel, followed by a zero-length flagged packet once
+ * the stream has ended. A channel of a peer carries at most one open stream at a time.
+ *
+ * @sa devils_stream_open()
+ * @sa devils_stream_write()
+ * @sa devils_stream_close()
+ */
+   typedef struct _devils_stream
+   {
+      devils_list_node streamList;
+      devils_peer *peer;
+      devils_uint32 connectID; /**< connection of the peer the stream was opened on */
+      devils_uint8 channelID;
+      devils_stream_read_callback read; /**< pulls the stream's data, or NULL if it is pushed with devils_stream_write() */
+      void *userData;                   /**< application private data, may be freely modified */
+      size_t window;                    /**< maximum stream data queued or unacknowledged at once, may be freely modified */
+      size_t dataInFlight;
+      size_t chunksInFlight;
+      devils_uint32 flags;
+   } devils_stream;
+
    /**
  * An ENet event type, as specified in @ref devils_event.
  */
@@ -501,6 +789,7 @@ extern "C"
    DEVILS_API devils_socket devils_socket_accept(devils_socket, devils_address *);
    DEVILS_API int devils_socket_connect(devils_socket, const devils_address *);
    DEVILS_API int devils_socket_send(devils_socket, const devils_address *, const devils_buffer *, size_t);
+   DEVILS_API int devils_socket_send_batch(devils_socket, const devils_address *, const devils_buffer *, size_t);
    DEVILS_API int devils_socket_receive(devils_socket, devils_address *, devils_buffer *, size_t);
    DEVILS_API int devils_socket_wait(devils_socket, devils_uint32 *, devils_uint32);
    DEVILS_API int devils_socket_set_option(devils_socket, devils_socket_option, int);
@@ -569,15 +858,59 @@ extern "C"
    DEVILS_API int devils_host_service(devils_host *, devils_event *, devils_uint32);
    DEVILS_API void devils_host_flush(devils_host *);
    DEVILS_API void devils_host_broadcast(devils_host *, devils_uint8, devils_packet *);
+   DEVILS_API void devils_host_broadcast_peers(devils_host *, devils_uint8, devils_packet *, devils_peer **, size_t);
    DEVILS_API void devils_host_compress(devils_host *, const devils_compressor *);
    DEVILS_API int devils_host_compress_with_range_coder(devils_host *host);
+   DEVILS_API void devils_host_congestion_control(devils_host *, const devils_congestion_control *);
+   DEVILS_API void devils_host_congestion_control_with_bbr(devils_host *host);
    DEVILS_API void devils_host_channel_limit(devils_host *, size_t);
+   DEVILS_API void devils_host_migration(devils_host *, int);
+   DEVILS_API void devils_host_chunked_packets(devils_host *, int);
+   DEVILS_API void devils_host_bandwidth_pacing(devils_host *, int);
+   DEVILS_API int devils_host_connect_cookies(devils_host *, const devils_uint8 *);
+   extern void devils_host_cookie_generate(devils_host *, const devils_address *, devils_uint32, devils_uint32 *);
+   extern int devils_host_cookie_verify(devils_host *, const devils_address *, devils_uint32, const devils_uint32 *);
+   extern int devils_host_cookie_admit(devils_host *, const devils_address *);
    DEVILS_API void devils_host_bandwidth_limit(devils_host *, devils_uint32, devils_uint32);
    extern void devils_host_bandwidth_throttle(devils_host *);
    extern devils_uint32 devils_host_random_seed(void);
    extern devils_uint32 devils_host_random(devils_host *);
+   extern devils_peer *devils_host_address_peers(devils_host *, devils_uint32);
+   extern devils_peer *devils_host_free_peer(devils_host *, int);
+   extern void devils_host_bind_peer(devils_host *, devils_peer *);
+   extern void devils_host_unbind_peer(devils_host *, devils_peer *);
+   extern void devils_host_move_peer(devils_host *, devils_peer *, const devils_address *);
+   extern void devils_host_leave_groups(devils_host *, devils_peer *);
+   extern void devils_host_pump_streams(devils_host *);
+   extern void devils_host_destroy_streams(devils_host *);
+   extern void devils_host_flush_reassembly_pool(devils_host *);
+
+   DEVILS_API void devils_host_get_statistics(devils_host *, devils_host_statistics *);
+   DEVILS_API void devils_peer_get_statistics(devils_peer *, devils_peer_statistics *);
+   DEVILS_API size_t devils_peer_get_channel_statistics(devils_peer *, devils_channel_statistics *, size_t);
+   DEVILS_API devils_uint32 devils_histogram_bucket_floor(size_t);
+   DEVILS_API devils_uint32 devils_histogram_percentile(const devils_histogram *, devils_uint32);
+   extern void devils_histogram_record(devils_histogram *, devils_uint32);
+   extern void devils_peer_retire_statistics(devils_peer *);
+
+   DEVILS_API devils_group *devils_group_create(devils_host *);
+   DEVILS_API void devils_group_destroy(devils_group *);
+   DEVILS_API int devils_group_add(devils_group *, devils_peer *);
+   DEVILS_API void devils_group_remove(devils_group *, devils_peer *);
+   DEVILS_API void devils_group_send(devils_group *, devils_uint8, devils_packet *);
+
+   DEVILS_API devils_traffic_class *devils_traffic_class_create(devils_host *, devils_traffic_class *, devils_uint32, devils_uint32);
+   DEVILS_API void devils_traffic_class_destroy(devils_traffic_class *);
+   DEVILS_API void devils_peer_traffic_class(devils_peer *, devils_traffic_class *);
+   extern int devils_traffic_class_admit(devils_host *, devils_traffic_class *);
+   extern void devils_traffic_class_charge(devils_traffic_class *, size_t);
+
+   DEVILS_API devils_stream *devils_stream_open(devils_peer *, devils_uint8, devils_stream_read_callback, void *);
+   DEVILS_API int devils_stream_write(devils_stream *, const void *, size_t);
+   DEVILS_API void devils_stream_close(devils_stream *);
 
    DEVILS_API int devils_peer_send(devils_peer *, devils_uint8, devils_packet *);
+   DEVILS_API int devils_peer_send_latest(devils_peer *, devils_uint8, devils_uint32, devils_packet *);
    DEVILS_API devils_packet *devils_peer_receive(devils_peer *, devils_uint8 *channelID);
    DEVILS_API void devils_peer_ping(devils_peer *);
    DEVILS_API void devils_peer_ping_interval(devils_peer *, devils_uint32);
@@ -587,22 +920,57 @@ extern "C"
    DEVILS_API void devils_peer_disconnect_now(devils_peer *, devils_uint32);
    DEVILS_API void devils_peer_disconnect_later(devils_peer *, devils_uint32);
    DEVILS_API void devils_peer_throttle_configure(devils_peer *, devils_uint32, devils_uint32, devils_uint32);
+   DEVILS_API devils_peer_state devils_peer_get_state(const devils_peer *);
+   DEVILS_API const devils_address *devils_peer_get_address(const devils_peer *);
+   DEVILS_API devils_uint32 devils_peer_get_id(const devils_peer *);
+   DEVILS_API void *devils_peer_get_data(const devils_peer *);
+   DEVILS_API void devils_peer_set_data(devils_peer *, void *);
+   DEVILS_API size_t devils_peer_get_channel_count(const devils_peer *);
+   DEVILS_API devils_uint32 devils_peer_get_round_trip_time(const devils_peer *);
+   DEVILS_API devils_uint32 devils_peer_get_packet_loss(const devils_peer *);
+   DEVILS_API devils_uint32 devils_peer_get_mtu(const devils_peer *);
+   DEVILS_API void devils_peer_get_bandwidth(const devils_peer *, devils_uint32 *, devils_uint32 *);
    extern int devils_peer_throttle(devils_peer *, devils_uint32);
    extern void devils_peer_reset_queues(devils_peer *);
+   extern void devils_peer_reset_congestion_control(devils_peer *);
+   DEVILS_API int devils_peer_channel_priority(devils_peer *, devils_uint8, devils_uint8, devils_uint16);
+   DEVILS_API int devils_peer_channel_unordered(devils_peer *, devils_uint8, int);
    extern void devils_peer_setup_outgoing_command(devils_peer *, devils_outgoing_command *);
+   extern void devils_peer_schedule_expiry(devils_peer *, const devils_outgoing_command *);
+   extern devils_channel_state *devils_peer_use_channel(devils_peer *, devils_channel *);
+   extern void devils_peer_reclaim_channels(devils_peer *);
+   extern void devils_peer_insert_outgoing_command(devils_peer *, devils_outgoing_command *, int);
+   extern devils_outgoing_command *devils_peer_next_fragment(devils_outgoing_command *);
+   extern int devils_peer_has_outgoing_commands(devils_peer *);
    extern devils_outgoing_command *devils_peer_queue_outgoing_command(devils_peer *, const devils_protocol *, devils_packet *, devils_uint32, devils_uint16);
    extern devils_incoming_command *devils_peer_queue_incoming_command(devils_peer *, const devils_protocol *, const void *, size_t, devils_uint32, devils_uint32);
+   extern struct _devils_reassembly *devils_reassembly_create(devils_peer *, size_t, devils_uint32, devils_uint32 **);
+   extern void devils_reassembly_destroy(struct _devils_reassembly *);
+   extern int devils_reassembly_write(struct _devils_reassembly *, size_t, const void *, size_t);
+   extern int devils_reassembly_finish(struct _devils_reassembly *, devils_packet *);
    extern devils_acknowledgement *devils_peer_queue_acknowledgement(devils_peer *, const devils_protocol *, devils_uint16);
    extern void devils_peer_dispatch_incoming_unreliable_commands(devils_peer *, devils_channel *, devils_incoming_command *);
    extern void devils_peer_dispatch_incoming_reliable_commands(devils_peer *, devils_channel *, devils_incoming_command *);
    extern void devils_peer_on_connect(devils_peer *);
    extern void devils_peer_on_disconnect(devils_peer *);
+   DEVILS_API int devils_peer_channel_fec(devils_peer *, devils_uint8, int);
+   extern void devils_peer_fec_encode(devils_peer *, devils_channel *, const devils_outgoing_command *);
+   extern void devils_peer_fec_record(devils_peer *, devils_channel *, const devils_protocol *, const devils_uint8 *, size_t);
+   extern int devils_peer_fec_recover(devils_peer *, devils_channel *, const devils_protocol *, const devils_uint8 *, size_t, devils_protocol *, const devils_uint8 **, size_t *);
+   extern void devils_peer_fec_destroy(devils_channel *);
+   extern void devils_peer_latest_release(devils_channel_state *, devils_outgoing_command *);
+   extern void devils_peer_latest_destroy(devils_channel_state *);
 
    DEVILS_API void *devils_range_coder_create(void);
    DEVILS_API void devils_range_coder_destroy(void *);
    DEVILS_API size_t devils_range_coder_compress(void *, const devils_buffer *, size_t, size_t, devils_uint8 *, size_t);
    DEVILS_API size_t devils_range_coder_decompress(void *, const devils_uint8 *, size_t, devils_uint8 *, size_t);
 
+   DEVILS_API void *devils_bbr_create(void *, devils_peer *);
+   DEVILS_API void devils_bbr_destroy(void *, void *);
+   DEVILS_API void devils_bbr_acknowledge(void *, void *, devils_peer *, devils_uint32, devils_uint32);
+   DEVILS_API void devils_bbr_loss(void *, void *, devils_peer *, devils_uint32);
+
    extern size_t devils_protocol_command_size(devils_uint8);
 
 #ifdef __cplusplus
@@ -14,9 +14,15 @@ enum
    DEVILS_PROTOCOL_MAXIMUM_PACKET_COMMANDS = 32,
    DEVILS_PROTOCOL_MINIMUM_WINDOW_SIZE = 4096,
    DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE = 65536,
+   DEVILS_PROTOCOL_MAXIMUM_SCALED_WINDOW_SIZE = 16 * 1024 * 1024, /**< window limit once both sides negotiated DEVILS_PROTOCOL_COMMAND_FLAG_WINDOW_SCALE, shared by all channels */
    DEVILS_PROTOCOL_MINIMUM_CHANNEL_COUNT = 1,
    DEVILS_PROTOCOL_MAXIMUM_CHANNEL_COUNT = 255,
    DEVILS_PROTOCOL_MAXIMUM_PEER_ID = 0xFFF,
+   DEVILS_PROTOCOL_EXTENDED_PEER_ID = 0xFFE, /**< header peer ID announcing a 32-bit peer ID after the header; never assigned, as older hosts may use it as an ordinary peer ID */
+   DEVILS_PROTOCOL_MINIMUM_EXTENDED_PEER_ID = 0x1000, /**< first peer ID sent in an extended header, only assigned once the remote host accepts them */
+   DEVILS_PROTOCOL_MAXIMUM_EXTENDED_PEER_ID = 0x7FFFFFFF,
+   DEVILS_PROTOCOL_CONNECT_CHANNEL_COUNT_MASK = 0xFFFF,
+   DEVILS_PROTOCOL_CONNECT_PEER_ID_SHIFT = 16, /**< upper bits of channelCount in CONNECT and VERIFY_CONNECT hold the upper bits of outgoingPeerID */
    DEVILS_PROTOCOL_MAXIMUM_FRAGMENT_COUNT = 1024 * 1024
 };
 
@@ -35,7 +41,10 @@ typedef enum _devils_protocol_command
    DEVILS_PROTOCOL_COMMAND_BANDWIDTH_LIMIT = 10,
    DEVILS_PROTOCOL_COMMAND_THROTTLE_CONFIGURE = 11,
    DEVILS_PROTOCOL_COMMAND_SEND_UNRELIABLE_FRAGMENT = 12,
-   DEVILS_PROTOCOL_COMMAND_COUNT = 13,
+   DEVILS_PROTOCOL_COMMAND_SEND_REPAIR = 13,
+   DEVILS_PROTOCOL_COMMAND_CONNECT_COOKIE = 14,
+   DEVILS_PROTOCOL_COMMAND_SKIP = 15,
+   DEVILS_PROTOCOL_COMMAND_COUNT = 16,
 
    DEVILS_PROTOCOL_COMMAND_MASK = 0x0F
 } devils_protocol_command;
@@ -44,13 +53,28 @@ typedef enum _devils_protocol_flag
 {
    DEVILS_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE = (1 << 7),
    DEVILS_PROTOCOL_COMMAND_FLAG_UNSEQUENCED = (1 << 6),
+   /* only valid on CONNECT and VERIFY_CONNECT, where the unsequenced bit is otherwise unused:
+      the sender understands DEVILS_PROTOCOL_COMMAND_SKIP and DEVILS_PROTOCOL_COMMAND_SEND_REPAIR */
+   DEVILS_PROTOCOL_COMMAND_FLAG_SKIP = (1 << 6),
+   /* only valid on CONNECT and VERIFY_CONNECT: the sender compares unreliable sequence numbers
+      with serial arithmetic, so they may wrap around without an intervening reliable command */
+   DEVILS_PROTOCOL_COMMAND_FLAG_SERIAL_UNRELIABLE = (1 << 5),
+   /* only valid on CONNECT and VERIFY_CONNECT: the sender accepts windowSize values up to
+      DEVILS_PROTOCOL_MAXIMUM_SCALED_WINDOW_SIZE rather than DEVILS_PROTOCOL_MAXIMUM_WINDOW_SIZE */
+   DEVILS_PROTOCOL_COMMAND_FLAG_WINDOW_SCALE = (1 << 4),
+   /* only valid on SEND_RELIABLE and SEND_FRAGMENT, where the bit is otherwise unused:
+      the packet belongs to a stream and is delivered flagged DEVILS_PACKET_FLAG_STREAM */
+   DEVILS_PROTOCOL_COMMAND_FLAG_STREAM = (1 << 5),
 
    DEVILS_PROTOCOL_HEADER_FLAG_COMPRESSED = (1 << 14),
    DEVILS_PROTOCOL_HEADER_FLAG_SENT_TIME = (1 << 15),
    DEVILS_PROTOCOL_HEADER_FLAG_MASK = DEVILS_PROTOCOL_HEADER_FLAG_COMPRESSED | DEVILS_PROTOCOL_HEADER_FLAG_SENT_TIME,
 
    DEVILS_PROTOCOL_HEADER_SESSION_MASK = (3 << 12),
-   DEVILS_PROTOCOL_HEADER_SESSION_SHIFT = 12
+   DEVILS_PROTOCOL_HEADER_SESSION_SHIFT = 12,
+
+   /* only valid without a peer ID, where the session bits are otherwise unused: the sender accepts an extended peer ID */
+   DEVILS_PROTOCOL_HEADER_FLAG_EXTENDED_PEER_ID = (1 << 12)
 } devils_protocol_flag;
 
 #ifdef _MSC_VER
@@ -174,6 +198,40 @@ typedef struct _devils_protocol_send_fragment
    devils_uint32 fragmentOffset;
 } DEVILS_PACKED devils_protocol_send_fragment;
 
+typedef struct _devils_protocol_send_repair
+{
+   devils_protocol_command_header header;
+   devils_uint8 groupSize;
+   devils_uint16 dataLength;
+} DEVILS_PACKED devils_protocol_send_repair;
+
+/** Sent by a host that requires connect cookies in answer to a CONNECT without a valid one;
+    the connecting peer echoes it ahead of its CONNECT until the connection is verified. */
+typedef struct _devils_protocol_connect_cookie
+{
+   devils_protocol_command_header header;
+   devils_uint32 connectID;
+   devils_uint32 cookie[2];
+} DEVILS_PACKED devils_protocol_connect_cookie;
+
+/** Sent reliably in place of a reliable packet that expired before any of it was sent; the
+    receiver moves past skipCount reliable sequence numbers starting at the header's without
+    delivering anything for them. */
+typedef struct _devils_protocol_skip
+{
+   devils_protocol_command_header header;
+   devils_uint32 skipCount;
+} DEVILS_PACKED devils_protocol_skip;
+
+/** Identifies one protected command of a repair group; groupSize of these precede the parity data of a repair command. */
+typedef struct _devils_protocol_repair_descriptor
+{
+   devils_uint8 command;
+   devils_uint16 reliableSequenceNumber;
+   devils_uint16 sequenceNumber; /**< unreliable sequence number or unsequenced group */
+   devils_uint16 dataLength;
+} DEVILS_PACKED devils_protocol_repair_descriptor;
+
 typedef union _devils_protocol
 {
    devils_protocol_command_header header;
@@ -186,6 +244,9 @@ typedef union _devils_protocol
    devils_protocol_send_unreliable sendUnreliable;
    devils_protocol_send_unsequenced sendUnsequenced;
    devils_protocol_send_fragment sendFragment;
+   devils_protocol_send_repair sendRepair;
+   devils_protocol_connect_cookie connectCookie;
+   devils_protocol_skip skip;
    devils_protocol_bandwidth_limit bandwidthLimit;
    devils_protocol_throttle_configure throttleConfigure;
 } DEVILS_PACKED devils_protocol;
@@ -8,5 +8,10 @@
 typedef unsigned char devils_uint8;   /**< unsigned 8-bit type  */
 typedef unsigned short devils_uint16; /**< unsigned 16-bit type */
 typedef unsigned int devils_uint32;   /**< unsigned 32-bit type */
+#ifdef _MSC_VER
+typedef unsigned __int64 devils_uint64; /**< unsigned 64-bit type */
+#else
+typedef unsigned long long devils_uint64; /**< unsigned 64-bit type */
+#endif
 
 #endif /* __DEVILS_TYPES_H__ */
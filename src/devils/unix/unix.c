@@ -4,6 +4,10 @@
 */
 #ifndef _WIN32
 
+#if defined(HAS_SENDMMSG) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1
+#endif
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
@@ -61,6 +65,13 @@ typedef int socklen_t;
 #define MSG_NOSIGNAL 0
 #endif
 
+#ifdef HAS_SENDMMSG
+enum
+{
+    DEVILS_SOCKET_SEND_BATCH = 32 /* datagrams handed to a single sendmmsg call */
+};
+#endif
+
 static devils_uint32 timeBase = 0;
 
 int devils_initialize(void)
@@ -451,6 +462,69 @@ int devils_socket_send(devils_socket socket,
     return sentLength;
 }
 
+int devils_socket_send_batch(devils_socket socket,
+                             const devils_address *addresses,
+                             const devils_buffer *datagrams,
+                             size_t datagramCount)
+{
+#ifdef HAS_SENDMMSG
+    struct mmsghdr msgHdrs[DEVILS_SOCKET_SEND_BATCH];
+    struct sockaddr_in sins[DEVILS_SOCKET_SEND_BATCH];
+    size_t sentCount = 0, batchCount, i;
+    int result;
+
+    while (sentCount < datagramCount)
+    {
+        batchCount = datagramCount - sentCount;
+        if (batchCount > DEVILS_SOCKET_SEND_BATCH)
+            batchCount = DEVILS_SOCKET_SEND_BATCH;
+
+        memset(msgHdrs, 0, batchCount * sizeof(struct mmsghdr));
+
+        for (i = 0; i < batchCount; ++i)
+        {
+            memset(&sins[i], 0, sizeof(struct sockaddr_in));
+
+            sins[i].sin_family = AF_INET;
+            sins[i].sin_port = DEVILS_HOST_TO_NET_16(addresses[sentCount + i].port);
+            sins[i].sin_addr.s_addr = addresses[sentCount + i].host;
+
+            msgHdrs[i].msg_hdr.msg_name = &sins[i];
+            msgHdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgHdrs[i].msg_hdr.msg_iov = (struct iovec *)&datagrams[sentCount + i];
+            msgHdrs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        result = sendmmsg(socket, msgHdrs, batchCount, MSG_NOSIGNAL);
+        if (result == -1)
+        {
+            if (errno == EWOULDBLOCK)
+                break;
+
+            return -1;
+        }
+
+        sentCount += result;
+    }
+
+    return (int)sentCount;
+#else
+    size_t sentCount;
+    int sentLength;
+
+    for (sentCount = 0; sentCount < datagramCount; ++sentCount)
+    {
+        sentLength = devils_socket_send(socket, &addresses[sentCount], &datagrams[sentCount], 1);
+        if (sentLength < 0)
+            return -1;
+        if (sentLength == 0)
+            break;
+    }
+
+    return (int)sentCount;
+#endif
+}
+
 int devils_socket_receive(devils_socket socket,
                           devils_address *address,
                           devils_buffer *buffers,
@@ -332,6 +332,26 @@ int devils_socket_send(devils_socket socket,
     return (int)sentLength;
 }
 
+int devils_socket_send_batch(devils_socket socket,
+                             const devils_address *addresses,
+                             const devils_buffer *datagrams,
+                             size_t datagramCount)
+{
+    size_t sentCount;
+    int sentLength;
+
+    for (sentCount = 0; sentCount < datagramCount; ++sentCount)
+    {
+        sentLength = devils_socket_send(socket, &addresses[sentCount], &datagrams[sentCount], 1);
+        if (sentLength < 0)
+            return -1;
+        if (sentLength == 0)
+            break;
+    }
+
+    return (int)sentCount;
+}
+
 int devils_socket_receive(devils_socket socket,
                           devils_address *address,
                           devils_buffer *buffers,